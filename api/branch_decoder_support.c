@@ -215,55 +215,15 @@ mambo_branch_type __get_arm_branch_type(mambo_context *ctx) {
 }
 #endif // __arm__
 
-mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
+#ifdef DBM_ARCH_RISCV64
+/* Also used by the scanner to fill the decode cache */
+mambo_branch_type _riscv_get_branch_type(int inst, void *read_address) {
   mambo_branch_type type;
 
-#ifdef __arm__
-  if (mambo_get_inst_type(ctx) == THUMB_INST) {
-   type = __get_thumb_branch_type(ctx);
-  } else { // ARM
-    type = __get_arm_branch_type(ctx);
-  }
-#endif
-#ifdef __aarch64__
-  type = BRANCH_NONE;
-
-  switch (ctx->code.inst) {
-    case A64_CBZ_CBNZ:
-      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_CBZ;
-      break;
-    case A64_B_COND:
-      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_PSR;
-      break;
-    case A64_TBZ_TBNZ:
-      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_TBZ;
-      break;
-    case A64_BR:
-      type = BRANCH_INDIRECT;
-      break;
-    case A64_BLR:
-      type = BRANCH_INDIRECT | BRANCH_CALL;
-      break;
-    case A64_RET:
-      type = BRANCH_INDIRECT | BRANCH_RETURN;
-      break;
-    case A64_B_BL: {
-      uint32_t op, imm26;
-      a64_B_BL_decode_fields(ctx->code.read_address, &op, &imm26);
-
-      type = BRANCH_DIRECT;
-      if (op == 1) { // BL
-        type |= BRANCH_CALL;
-      }
-      break;
-    }
-  }
-#endif // __aarch64__
-#ifdef DBM_ARCH_RISCV64
-  switch (ctx->code.inst) {
+  switch (inst) {
     case RISCV_JAL: {
       unsigned int rd, imm;
-      riscv_jal_decode_fields(ctx->code.read_address, &rd, &imm);
+      riscv_jal_decode_fields(read_address, &rd, &imm);
       type = BRANCH_DIRECT;
       // It's a routine call if linked to ra
       if (rd == ra)
@@ -275,7 +235,7 @@ mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
       break;
     case RISCV_JALR: {
       unsigned int rd, rs1, imm;
-      riscv_jalr_decode_fields(ctx->code.read_address, &rd, &rs1, &imm);
+      riscv_jalr_decode_fields(read_address, &rd, &rs1, &imm);
       type = BRANCH_INDIRECT;
       if (rs1 == ra && rd == x0 && imm == 0)
         type |= BRANCH_RETURN;
@@ -289,7 +249,7 @@ mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
       break;
     case RISCV_C_JR: {
       unsigned int rs1;
-      riscv_c_jr_decode_fields(ctx->code.read_address, &rs1);
+      riscv_c_jr_decode_fields(read_address, &rs1);
       type = BRANCH_INDIRECT;
       if (rs1 == ra)
         type |= BRANCH_RETURN;
@@ -310,6 +270,62 @@ mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
       type = BRANCH_NONE;
       break;
   }
+
+  return type;
+}
+#endif
+
+mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
+  mambo_branch_type type;
+
+#ifdef __arm__
+  if (mambo_get_inst_type(ctx) == THUMB_INST) {
+   type = __get_thumb_branch_type(ctx);
+  } else { // ARM
+    type = __get_arm_branch_type(ctx);
+  }
+#endif
+#ifdef __aarch64__
+  type = BRANCH_NONE;
+
+  switch (ctx->code.inst) {
+    case A64_CBZ_CBNZ:
+      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_CBZ;
+      break;
+    case A64_B_COND:
+      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_PSR;
+      break;
+    case A64_TBZ_TBNZ:
+      type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_TBZ;
+      break;
+    case A64_BR:
+      type = BRANCH_INDIRECT;
+      break;
+    case A64_BLR:
+      type = BRANCH_INDIRECT | BRANCH_CALL;
+      break;
+    case A64_RET:
+      type = BRANCH_INDIRECT | BRANCH_RETURN;
+      break;
+    case A64_B_BL: {
+      uint32_t op, imm26;
+      a64_B_BL_decode_fields(ctx->code.read_address, &op, &imm26);
+
+      type = BRANCH_DIRECT;
+      if (op == 1) { // BL
+        type |= BRANCH_CALL;
+      }
+      break;
+    }
+  }
+#endif // __aarch64__
+#ifdef DBM_ARCH_RISCV64
+#ifdef DBM_DECODE_CACHE
+  if (ctx->code.decoded != NULL) {
+    return ctx->code.decoded->branch_type;
+  }
+#endif
+  type = _riscv_get_branch_type(ctx->code.inst, ctx->code.read_address);
 #endif
 
   return type;
@@ -40,6 +40,9 @@ void set_mambo_context_code(mambo_context *ctx, dbm_thread *thread_data, mambo_c
   ctx->code.fragment_id = fragment_id;
   ctx->code.inst = inst;
   ctx->code.cond = cond;
+#ifdef DBM_DECODE_CACHE
+  ctx->code.decoded = NULL;
+#endif
   ctx->code.read_address = read_address;
   ctx->code.write_p = write_p;
   ctx->code.data_p = data_p;
@@ -299,6 +299,11 @@ bool mambo_is_store(mambo_context *ctx) {
 }
 
 bool mambo_is_load_or_store(mambo_context *ctx) {
+#ifdef DBM_DECODE_CACHE
+  if (ctx->code.decoded != NULL) {
+    return ctx->code.decoded->ld_st_size > 0;
+  }
+#endif
 #if __arm__ || DBM_ARCH_RISCV64
   return mambo_is_load(ctx) || mambo_is_store(ctx);
 #elif __aarch64__
@@ -1357,16 +1362,17 @@ int _arm_get_ld_st_size(mambo_context *ctx) {
 
 #ifdef DBM_ARCH_RISCV64
 /**
- * Get load or store data size. (RISC-V only)
- * @param ctx MAMBO context.
+ * Get load or store data size. (RISC-V only) Also used by the scanner to fill
+ * the decode cache.
+ * @param inst RISC-V instruction.
  * @return Load or store data size. Returns `-1` if no size exists (e.g. not a 
  *  load/store instruction)
  */
-int _riscv_get_ld_st_size(mambo_context *ctx)
+int _riscv_get_ld_st_size(int inst)
 {
   int size = -1;
 
-  switch (ctx->code.inst) {
+  switch (inst) {
   case RISCV_LB:
   case RISCV_LBU:
   case RISCV_SB:
@@ -1413,7 +1419,12 @@ int mambo_get_ld_st_size(mambo_context *ctx) {
 #elif __aarch64__
   return _a64_get_ld_st_size(ctx);
 #elif DBM_ARCH_RISCV64
-  return _riscv_get_ld_st_size(ctx);
+#ifdef DBM_DECODE_CACHE
+  if (ctx->code.decoded != NULL) {
+    return ctx->code.decoded->ld_st_size;
+  }
+#endif
+  return _riscv_get_ld_st_size(ctx->code.inst);
 #endif
   return -1;
 }
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <stdarg.h>
+#include <unistd.h>
 
 #include "../dbm.h"
 #include "../common.h"
@@ -206,6 +207,11 @@ int mambo_get_inst_len(mambo_context *ctx) {
 #elif __aarch64__
   return 4;
 #elif DBM_ARCH_RISCV64
+#ifdef DBM_DECODE_CACHE
+  if (ctx->code.decoded != NULL) {
+    return ctx->code.decoded->len;
+  }
+#endif
   return (inst <= 39) ? 2 : 4;
 #endif
 }
@@ -417,10 +423,22 @@ int mambo_add_identity_mapping(mambo_context *ctx) {
     addr |= THUMB;
   }
 
-  int ret = hash_add(&current_thread->entry_address, addr, addr);
+  int ret = hash_add(cc_thread(current_thread)->entry_address, addr, addr);
   return (ret) ? 0 : -1;
 }
 
+/* Forks the application from code called by the instrumentation. The child is
+   reset like after a fork system call: only the calling thread is kept and the
+   pre-thread callbacks are delivered to it. */
+pid_t mambo_fork(void) {
+  dbm_thread *thread_data = current_thread;
+  pid_t pid = fork();
+  if (pid == 0) {
+    reset_process(thread_data);
+  }
+  return pid;
+}
+
 vm_op_t mambo_get_vm_op(mambo_context *ctx) {
   assert(ctx->event_type == VM_OP_C);
   return ctx->vm.op;
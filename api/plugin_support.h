@@ -32,6 +32,9 @@ struct code_ctx {
   void *read_address;
   int inst;
   mambo_cond cond;
+#ifdef DBM_DECODE_CACHE
+  decode_cache_entry *decoded; // properties of inst, NULL if it wasn't decoded through the decode cache
+#endif
 
   void *write_p;
   void *data_p;
@@ -235,6 +238,15 @@ int mambo_calc_ld_st_addr(mambo_context *ctx, enum reg reg);
  */
 int mambo_get_ld_st_size(mambo_context *ctx);
 int mambo_add_identity_mapping(mambo_context *ctx);
+
+/**
+ * Fork the application from a function called by the instrumentation. Unlike a
+ * plain `fork()`, the child is reset like after a fork system call of the
+ * application: the other threads are dropped, the locks are reinitialised and
+ * the pre-thread callbacks are delivered.
+ * @return The child's PID in the parent, 0 in the child, -1 on error.
+ */
+pid_t mambo_fork(void);
 char *mambo_get_cb_function_name(mambo_context *ctx);
 int mambo_stop_scan(mambo_context *ctx);
 int mambo_reserve_cc_space(mambo_context *ctx, size_t size);
@@ -669,7 +669,7 @@ void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int
   copy_to_reg_32bit(&write_p, r_tmp, CODE_CACHE_HASH_SIZE);
 
   // MOVW+MOVT r6, hash_table
-  copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address.entries);
+  copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address->entries);
 
   // AND r_tmp, target, r_tmp
   thumb_and32(&write_p, 0, target, 0, r_tmp, 0, 0, r_tmp);
@@ -520,7 +520,7 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   }
 
   a64_copy_to_reg_64bits(&write_p, x0,
-                         (uint64_t)&thread_data->entry_address.entries);
+                         (uint64_t)thread_data->entry_address->entries);
 
   a64_logical_immed(&write_p, 1, 0, 1, 62, 18, reg_spc, reg_tmp);
   write_p++;
@@ -1,10 +1,15 @@
 #include <stdio.h>
+#include <assert.h>
+#include <string.h>
 
 #include "../../dbm.h"
 #include "../../scanner_common.h"
 #include "dispatcher_riscv.h"
 
 #include "../../pie/pie-riscv-encoder.h"
+#ifdef DBM_LOOKAHEAD
+#include "../../pie/pie-riscv-decoder.h"
+#endif
 
 #ifdef DEBUG
 	#define debug(...) log("dispatcher_riscv", __VA_ARGS__)
@@ -12,6 +17,12 @@
 	#define debug(...)
 #endif
 
+#ifdef MODULE_ONLY
+	#define cc_mark_dirty(...)
+#endif
+
+#define NOP_INSTRUCTION 0x00010001		// 2x C.NOP
+
 void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, uint16_t **write_p, 
 	mambo_cond *cond)
 {
@@ -52,6 +63,42 @@ void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, uint16_t **write_p,
 	}
 }
 
+/**
+ * Get the address an exit branch has to jump to, to reach a basic block.
+ * @param thread_data Thread data of current thread.
+ * @param branch_addr Address of the exit branch.
+ * @param block_address Address of the target basic block.
+ * @return Address after the pops of the target basic block if it is within JAL
+ * range, else the address of a veneer or 0 if the exit can't be linked.
+ */
+static uintptr_t riscv_link_target(dbm_thread *thread_data, uint16_t *branch_addr,
+	uintptr_t block_address)
+{
+	/* +8 added to block_address to jump over the pops of x10 and x11. There are
+	 * only pushed and needed to be popped if the dispatcher was invoked before.
+	 */
+	int64_t offset = (int64_t)(block_address + 8) - (int64_t)branch_addr;
+	if (offset >= -MAX_BRANCH_RANGE && offset < MAX_BRANCH_RANGE)
+		return block_address + 8;
+#ifdef DBM_CC_VENEERS
+	return riscv_get_veneer(thread_data, (uintptr_t)branch_addr, block_address);
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Link an exit branch to the address returned by riscv_link_target().
+ */
+static void riscv_link_branch(dbm_thread *thread_data, uint16_t *branch_addr,
+	uintptr_t link_target)
+{
+	riscv_cc_branch(thread_data, branch_addr, link_target);
+#ifdef DBM_CC_VENEERS
+	riscv_record_veneer_link(thread_data, (uintptr_t)branch_addr, link_target);
+#endif
+}
+
 void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index, 
 	branch_type exit_type, uintptr_t target, uintptr_t block_address)
 {
@@ -59,6 +106,7 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 	bool is_taken;
 	uintptr_t other_target;
 	bool other_target_in_cache;
+	uintptr_t link_target;
 	mambo_cond cond;
 
 	branch_addr = thread_data->code_cache_meta[source_index].exit_branch_addr;
@@ -88,12 +136,17 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 	 	 *              +-------------------------------+
 		 * 
 		 * ## dead code
+		 *
+		 * If block_address is out of JAL range, the JAL goes through a veneer.
 	 	 */
-		/* +8 added to block_address to jump over the pops of x10 and x11. There are
-		 * only pushed and needed to be popped if the dispatcher was invoked before.
-		 */
-		riscv_cc_branch(thread_data, branch_addr, block_address + 8);
-		__clear_cache((void *)branch_addr, (void *)branch_addr + 8 + 1);
+		link_target = riscv_link_target(thread_data, branch_addr, block_address);
+		if (link_target == 0) {
+			// Out of range, the dispatcher trampoline looks up the target
+			thread_data->code_cache_meta[source_index].branch_cache_status = BRANCH_NO_LINK;
+			break;
+		}
+		riscv_link_branch(thread_data, branch_addr, link_target);
+		cc_mark_dirty(thread_data, (void *)branch_addr, (void *)branch_addr + 8 + 1);
 		thread_data->code_cache_meta[source_index].branch_cache_status = BRANCH_LINKED;
 		break;
 	#endif
@@ -104,14 +157,28 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 
 		// Link target if not linked yet
 		if (thread_data->code_cache_meta[source_index].branch_cache_status == 0) {
+			// The skip condition must only be inserted if the exit can be linked
+			link_target = riscv_link_target(thread_data, branch_addr + 2, block_address);
+			if (link_target == 0)
+				break;
+
 			if (is_taken)
 				other_target = 
 					thread_data->code_cache_meta[source_index].branch_skipped_addr;
 			else
 				other_target = 
 					thread_data->code_cache_meta[source_index].branch_taken_addr;
+#ifdef DBM_LINK_COND_STUBS
+			// An untranslated other target gets a stub, scanned when it is reached
+			other_target = lookup_or_stub(thread_data, other_target);
+			// Allocating the stub may have evicted the source or the target
+			if (thread_data->was_flushed)
+				break;
+			other_target_in_cache = true;
+#else
 			other_target = cc_lookup(thread_data, other_target);
 			other_target_in_cache = (other_target != UINT_MAX);
+#endif
 
 			// Configure skip condition
 			cond = thread_data->code_cache_meta[source_index].branch_condition;
@@ -125,6 +192,9 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 		} else {
 			branch_addr += 4;
 			other_target_in_cache = false;
+			link_target = riscv_link_target(thread_data, branch_addr, block_address);
+			if (link_target == 0)
+				break;
 			thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
 		}
 
@@ -150,12 +220,13 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 		 * 
 		 * ** if conditional exit
 	 	 */
-		/* +8 added to block_address to jump over the pops of x10 and x11. There are
-		 * only pushed and needed to be popped if the dispatcher was invoked before.
-		 */
-		riscv_cc_branch(thread_data, branch_addr, block_address + 8);
+		riscv_link_branch(thread_data, branch_addr, link_target);
 		branch_addr += 2;
 
+		if (other_target_in_cache) {
+			link_target = riscv_link_target(thread_data, branch_addr, other_target);
+			other_target_in_cache = (link_target != 0);
+		}
 		if (other_target_in_cache) {
 			/*
 			 * Overwrite code written by riscv_branch_jump_cond to jump to the other 
@@ -182,17 +253,505 @@ void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index,
 			 * ** if conditional exit
 			 * ## dead code
 			 */
-			/* +8 added to block_address to jump over the pops of x10 and x11. There are
-			* only pushed and needed to be popped if the dispatcher was invoked before.
-			*/
-			riscv_cc_branch(thread_data, branch_addr, other_target + 8);
+			riscv_link_branch(thread_data, branch_addr, link_target);
 			thread_data->code_cache_meta[source_index].branch_cache_status |= BOTH_LINKED;
 		}
 
-		__clear_cache(
+		cc_mark_dirty(thread_data,
 			(void *)thread_data->code_cache_meta[source_index].exit_branch_addr, 
 			(void *)branch_addr);
 		break;
   	#endif
+	#if defined(DBM_RAS) || defined(DBM_IBTC) || defined(DBM_JUMP_TABLES)
+	case uncond_reg_riscv:
+		#ifdef DBM_RAS
+		riscv_ras_fill(thread_data, target, block_address);
+		#endif
+		#ifdef DBM_IBTC
+		riscv_ibtc_fill(thread_data, source_index, target, block_address);
+		#endif
+		#ifdef DBM_JUMP_TABLES
+		riscv_jump_table_fill(thread_data, source_index, target, block_address);
+		#endif
+		break;
+	#endif
+	case stub:
+		// The stub has been replaced by the translation of its target
+		break;
+	default:
+		// Nothing to link in this build, the dispatcher trampoline looks up the target
+		thread_data->code_cache_meta[source_index].branch_cache_status = BRANCH_NO_LINK;
+		break;
+	}
+}
+
+#if defined(DBM_LOOKAHEAD) || defined(DBM_SPEC_THREAD)
+/**
+ * Check if a target which hasn't been executed yet can be scanned: it must be
+ * in an executable mapping and start with a valid instruction, the scanner
+ * aborts on an invalid first instruction.
+ */
+static bool riscv_lookahead_target(uintptr_t target)
+{
+	interval_map_entry exec;
+	if (interval_map_search_by_addr(&global_data.exec_allocs, target, &exec) != 1
+		|| target + INST_32BIT > exec.end)
+		return false;
+	riscv_instruction inst = riscv_decode((uint16_t *)target);
+	return inst != RISCV_INVALID && inst != RISCV_C_ILLEGAL;
+}
+#endif
+
+#ifdef DBM_LOOKAHEAD
+void riscv_lookahead(dbm_thread *thread_data, int basic_block)
+{
+	int queue[LOOKAHEAD_BBS + 1];
+	int head = 0;
+	int tail = 0;
+
+	queue[tail++] = basic_block;
+	while (head < tail) {
+		int source = queue[head++];
+		dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[source];
+		branch_type exit_type = bb_meta->exit_branch_type;
+		uintptr_t targets[2] = { bb_meta->branch_taken_addr, bb_meta->branch_skipped_addr };
+		uintptr_t block_address[2];
+		int target_count;
+#ifdef DBM_SPEC_THREAD
+		bool spill = false;
+#endif
+
+		if (exit_type == uncond_imm_riscv)
+			target_count = 1;
+		else if (exit_type == cond_imm_riscv)
+			target_count = 2;
+		else
+			continue;
+
+		for (int i = 0; i < target_count; i++) {
+			block_address[i] = cc_lookup(thread_data, targets[i]);
+			if (block_address[i] != UINT_MAX || !riscv_lookahead_target(targets[i]))
+				continue;
+			if (tail == LOOKAHEAD_BBS + 1) {
+#ifdef DBM_SPEC_THREAD
+				spill = true;
+#endif
+				continue;
+			}
+
+			block_address[i] = scan(thread_data, (uint16_t *)targets[i], ALLOCATE_BB);
+			if (thread_data->was_flushed)
+				return;
+			queue[tail++] = addr_to_bb_id(thread_data, block_address[i]);
+			debug("Lookahead scanned 0x%lx at 0x%lx\n", targets[i], block_address[i]);
+		}
+
+		/* Linking one side of a conditional exit also links the other one if
+		   its target is in the code cache */
+		for (int i = 0; i < target_count; i++) {
+			if (block_address[i] != UINT_MAX && bb_meta->branch_cache_status == 0) {
+				dispatcher_riscv(thread_data, source, exit_type, targets[i], block_address[i]);
+				if (thread_data->was_flushed)
+					return;
+			}
+		}
+
+#ifdef DBM_SPEC_THREAD
+		// The targets beyond the budget are left to the speculative translation thread
+		if (spill)
+			riscv_spec_enqueue(thread_data, source);
+#endif
+	}
+}
+#endif
+
+#ifdef DBM_SPEC_THREAD
+void riscv_spec_enqueue(dbm_thread *thread_data, int basic_block)
+{
+	dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[basic_block];
+	uintptr_t targets[2] = { bb_meta->branch_taken_addr, bb_meta->branch_skipped_addr };
+	int target_count;
+	bool queued = false;
+
+	if (bb_meta->exit_branch_type == uncond_imm_riscv)
+		target_count = 1;
+	else if (bb_meta->exit_branch_type == cond_imm_riscv)
+		target_count = 2;
+	else
+		return;
+
+	for (int i = 0; i < target_count; i++) {
+		if (cc_lookup(thread_data, targets[i]) != UINT_MAX)
+			continue;
+		if (thread_data->spec_tail - thread_data->spec_head == SPEC_QUEUE_SIZE)
+			thread_data->spec_head++;
+		thread_data->spec_queue[thread_data->spec_tail++ % SPEC_QUEUE_SIZE] = targets[i];
+		queued = true;
+	}
+
+	if (queued)
+		pthread_cond_signal(&global_data.spec_cond);
+}
+
+void riscv_spec_translate(dbm_thread *thread_data)
+{
+	uintptr_t target = thread_data->spec_queue[thread_data->spec_head++ % SPEC_QUEUE_SIZE];
+
+	/*
+	 * The target may have been translated since it was queued, or unmapped.
+	 * The exits to it aren't linked: the owner may be executing them, they
+	 * are linked by its dispatcher on the first hash table hit.
+	 */
+	if (cc_lookup(thread_data, target) != UINT_MAX || !riscv_lookahead_target(target))
+		return;
+
+	debug("Speculatively scanning 0x%lx\n", target);
+	scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
+}
+#endif
+
+void riscv_unlink_exit(dbm_thread *thread_data, int fragment_id)
+{
+	dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
+	uint16_t *write_p = bb_meta->exit_branch_addr;
+	uint16_t *end_p;
+
+	if ((bb_meta->branch_cache_status & ~BRANCH_NO_LINK) == 0)
+		return;
+
+	switch (bb_meta->exit_branch_type) {
+	case uncond_imm_riscv:
+		/*
+		 * Restore the code written by the scanner
+		 *              +-------------------------------+
+		 *      NEW     |   NOP                         |   previously JAL block_address+8
+		 *              |                               |
+		 *              |   PUSH    x10, x11, x12       |
+		 *              |   ...                         |
+		 *              +-------------------------------+
+		 */
+		*(uint32_t *)write_p = NOP_INSTRUCTION;
+		end_p = write_p + 2;
+		break;
+	case cond_imm_riscv:
+		/*
+		 * Restore the code written by riscv_branch_jump_cond
+		 *              +-------------------------------+
+		 *      NEW     |   NOP                         |   previously B(cond) .+8
+		 *      NEW     |   NOP                         |   previously JAL
+		 *              |                               |
+		 *      NEW     |   PUSH    x10, x11, x12       |   previously JAL if both linked
+		 *              |   ...                         |
+		 *              +-------------------------------+
+		 */
+		*(uint32_t *)write_p = NOP_INSTRUCTION;
+		*(uint32_t *)(write_p + 2) = NOP_INSTRUCTION;
+		end_p = write_p + 4;
+		if (bb_meta->branch_cache_status & BOTH_LINKED) {
+			riscv_save_regs(&end_p, (m_x10 | m_x11 | m_x12));
+		}
+		break;
+	default:
+		fprintf(stderr, "riscv_unlink_exit(): unknown branch type\n");
+		while(1);
 	}
-}
\ No newline at end of file
+
+	bb_meta->branch_cache_status = 0;
+	cc_mark_dirty(thread_data, (void *)write_p, (void *)end_p);
+}
+
+#ifdef DBM_CC_VENEERS
+/**
+ * Find the veneer at an address.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address in the code cache.
+ * @param region Set to the region of the island containing the veneer.
+ * @return Index of the veneer in the island or -1 if \c addr isn't a veneer.
+ */
+static int riscv_veneer_at(dbm_thread *thread_data, uintptr_t addr, int *region)
+{
+	uintptr_t regions_start = cc_region_start(thread_data, 0);
+	if (addr < regions_start)
+		return -1;
+	*region = (addr - regions_start) / CC_REGION_SIZE;
+	if (*region >= CC_REGION_NO || addr < cc_region_end(thread_data, *region))
+		return -1;
+
+	int veneer = (cc_region_start(thread_data, *region + 1) - addr - 1) / CC_VENEER_SIZE;
+	if (veneer >= thread_data->region_veneers[*region]
+		|| thread_data->veneer_target[*region][veneer] == 0)
+		return -1;
+	return veneer;
+}
+
+uintptr_t riscv_get_veneer(dbm_thread *thread_data, uintptr_t branch_addr,
+	uintptr_t block_address)
+{
+	int region = (branch_addr - cc_region_start(thread_data, 0)) / CC_REGION_SIZE;
+	int veneer = -1;
+
+	if (thread_data->veneer_target == NULL) {
+		thread_data->veneer_target = thread_array_alloc(NULL,
+			sizeof(uintptr_t) * CC_REGION_NO * CC_VENEER_NO);
+		thread_data->veneer_linked_from = thread_array_alloc(NULL,
+			sizeof(ll_entry *) * CC_REGION_NO * CC_VENEER_NO);
+	}
+
+	for (int i = 0; i < thread_data->region_veneers[region]; i++) {
+		if (thread_data->veneer_target[region][i] == block_address)
+			return cc_veneer_addr(thread_data, region, i);
+		if (thread_data->veneer_target[region][i] == 0 && veneer < 0)
+			veneer = i;
+	}
+	if (veneer < 0) {
+		if (thread_data->region_veneers[region] == CC_VENEER_NO)
+			return 0;
+		veneer = thread_data->region_veneers[region]++;
+	}
+
+	/*
+	 * The target basic block starts by popping x10 and x11, so the veneer pushes
+	 * them and uses x10 for the large jump.
+	 *              +-------------------------------+
+	 *              |   PUSH    x10, x11            |
+	 *              |   AUIPC   x10, offset[31:12]  |
+	 *              |   JALR    x0, offset[11:0](x10)
+	 *              +-------------------------------+
+	 * [Size: 16 B]
+	 */
+	uint16_t *veneer_p = (uint16_t *)cc_veneer_addr(thread_data, region, veneer);
+	uint16_t *write_p = veneer_p;
+	riscv_save_regs(&write_p, (m_x10 | m_x11));
+	riscv_large_jump_helper(&write_p, block_address, false, x10);
+	assert((uintptr_t)write_p - (uintptr_t)veneer_p <= CC_VENEER_SIZE);
+	cc_mark_dirty(thread_data, (void *)veneer_p, (void *)write_p);
+
+	thread_data->veneer_target[region][veneer] = block_address;
+	thread_data->veneer_linked_from[region][veneer] = NULL;
+	record_cc_link(thread_data, (uintptr_t)veneer_p, block_address);
+
+	debug("Veneer %d of region %d to 0x%lx\n", veneer, region, block_address);
+	return (uintptr_t)veneer_p;
+}
+
+void riscv_record_veneer_link(dbm_thread *thread_data, uintptr_t branch_addr,
+	uintptr_t link_target)
+{
+	int region;
+	int veneer = riscv_veneer_at(thread_data, link_target, &region);
+	if (veneer < 0)
+		return;
+
+	ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+	assert(entry != NULL);
+	entry->data = branch_addr;
+	entry->next = thread_data->veneer_linked_from[region][veneer];
+	thread_data->veneer_linked_from[region][veneer] = entry;
+}
+
+bool riscv_unlink_veneer(dbm_thread *thread_data, uintptr_t addr)
+{
+	int region;
+	int veneer = riscv_veneer_at(thread_data, addr, &region);
+	if (veneer < 0)
+		return false;
+
+	ll_entry *entry = thread_data->veneer_linked_from[region][veneer];
+	while (entry != NULL) {
+		ll_entry *next = entry->next;
+		int source = addr_to_bb_id(thread_data, entry->data);
+		if (source >= 0) {
+			if (thread_data->code_cache_meta[source].actual_id != 0)
+				source = thread_data->code_cache_meta[source].actual_id;
+			riscv_unlink_exit(thread_data, source);
+		}
+		linked_list_free(thread_data->cc_links, entry);
+		entry = next;
+	}
+
+	thread_data->veneer_target[region][veneer] = 0;
+	thread_data->veneer_linked_from[region][veneer] = NULL;
+	return true;
+}
+
+void riscv_reset_veneers(dbm_thread *thread_data, int region)
+{
+	for (int i = 0; i < thread_data->region_veneers[region]; i++) {
+		ll_entry *entry = thread_data->veneer_linked_from[region][i];
+		while (entry != NULL) {
+			ll_entry *next = entry->next;
+			linked_list_free(thread_data->cc_links, entry);
+			entry = next;
+		}
+	}
+	thread_data->region_veneers[region] = 0;
+}
+
+uintptr_t riscv_veneer_target(dbm_thread *thread_data, uintptr_t addr)
+{
+	int region;
+	int veneer = riscv_veneer_at(thread_data, addr, &region);
+	if (veneer < 0)
+		return 0;
+	return thread_data->veneer_target[region][veneer];
+}
+#endif // DBM_CC_VENEERS
+
+#ifdef DBM_RAS
+void riscv_ras_fill(dbm_thread *thread_data, uintptr_t target, uintptr_t block_address)
+{
+	/* The record was popped by the return that missed, it's just above the
+	 * top. For other indirect branches it's a stale record, which is only used
+	 * if it's for the same target.
+	 */
+	ras_record *record = thread_data->ras[((thread_data->ras_top + sizeof(uintptr_t))
+		& RAS_MASK) / sizeof(uintptr_t)];
+	if (record->spc != target || record->tpc != 0)
+		return;
+
+	record->tpc = block_address;
+	record_cc_link(thread_data, (uintptr_t)&record->tpc, block_address);
+}
+
+bool riscv_ras_unlink(dbm_thread *thread_data, uintptr_t addr)
+{
+	int fragment_id = addr_to_fragment_id(thread_data, addr);
+	if (fragment_id < 0)
+		return false;
+
+	for (ras_record *record = thread_data->code_cache_meta[fragment_id].ras_call;
+		record != NULL; record = record->prev) {
+		if (addr == (uintptr_t)&record->tpc) {
+			record->tpc = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+void riscv_ras_reset(dbm_thread *thread_data, uintptr_t start, uintptr_t end)
+{
+	for (int i = 0; i < RAS_SIZE; i++) {
+		uintptr_t record = (uintptr_t)thread_data->ras[i];
+		if ((record >= start && record < end) || record == 0)
+			thread_data->ras[i] = &thread_data->ras_empty;
+	}
+}
+#endif // DBM_RAS
+
+#ifdef DBM_IBTC
+void riscv_ibtc_fill(dbm_thread *thread_data, uint32_t source_index, uintptr_t target,
+	uintptr_t block_address)
+{
+	ibtc_entry *ibtc = thread_data->code_cache_meta[source_index].ibtc;
+	if (ibtc == NULL)
+		return;
+
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		if (ibtc[i].spc == target)
+			return;
+		if (ibtc[i].spc == 0) {
+			// The translated code only reads tpc once spc matches
+			ibtc[i].tpc = block_address;
+			ibtc[i].spc = target;
+			record_cc_link(thread_data, (uintptr_t)&ibtc[i].tpc, block_address);
+			return;
+		}
+	}
+}
+
+bool riscv_ibtc_unlink(dbm_thread *thread_data, uintptr_t addr)
+{
+	int fragment_id = addr_to_fragment_id(thread_data, addr);
+	if (fragment_id < 0)
+		return false;
+
+	ibtc_entry *ibtc = thread_data->code_cache_meta[fragment_id].ibtc;
+	if (ibtc == NULL)
+		return false;
+
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		if (addr == (uintptr_t)&ibtc[i].tpc) {
+			ibtc[i].spc = 0;
+			ibtc[i].tpc = 0;
+			return true;
+		}
+	}
+	return false;
+}
+#endif // DBM_IBTC
+
+#ifdef DBM_JUMP_TABLES
+void riscv_jump_table_fill(dbm_thread *thread_data, uint32_t source_index, uintptr_t target,
+	uintptr_t block_address)
+{
+	jump_table_entry *table = thread_data->code_cache_meta[source_index].jump_table;
+
+	// Cases sharing a target, e.g. the default, have the same translation
+	for (int i = 0; i < thread_data->code_cache_meta[source_index].jump_table_size; i++) {
+		if (table[i].spc == target && table[i].tpc == 0) {
+			table[i].tpc = block_address;
+			record_cc_link(thread_data, (uintptr_t)&table[i].tpc, block_address);
+		}
+	}
+}
+
+int riscv_jump_table_pool(dbm_thread *thread_data, uintptr_t addr)
+{
+	uintptr_t pools = (uintptr_t)thread_data->jump_tables;
+	if (pools == 0 || addr < pools
+		|| addr >= pools + JT_POOL_NO * sizeof(thread_data->jump_tables[0]))
+		return -1;
+
+	return (addr - pools) / sizeof(thread_data->jump_tables[0]);
+}
+
+bool riscv_jump_table_unlink(dbm_thread *thread_data, uintptr_t addr)
+{
+	if (riscv_jump_table_pool(thread_data, addr) < 0)
+		return false;
+
+	*(uintptr_t *)addr = 0;
+	return true;
+}
+
+void riscv_jump_table_reset(dbm_thread *thread_data, int pool)
+{
+	/* Translated code of other regions can still index the pool, the
+	 * entries must not match anymore until they are allocated again
+	 */
+	if (thread_data->jump_table_free[pool] > 0)
+		memset(thread_data->jump_tables[pool], 0,
+			thread_data->jump_table_free[pool] * sizeof(jump_table_entry));
+	thread_data->jump_table_free[pool] = 0;
+}
+#endif // DBM_JUMP_TABLES
+
+#ifdef DBM_TRACES
+void riscv_link_to_trace(dbm_thread *thread_data, uintptr_t addr, uintptr_t trace_entry)
+{
+#ifdef DBM_JUMP_TABLES
+	if (riscv_jump_table_unlink(thread_data, addr))
+		return;
+#endif
+#ifdef DBM_RAS
+	// The records are set again by the dispatcher
+	if (riscv_ras_unlink(thread_data, addr))
+		return;
+#endif
+#ifdef DBM_IBTC
+	if (riscv_ibtc_unlink(thread_data, addr))
+		return;
+#endif
+	uintptr_t link_target = riscv_link_target(thread_data, (uint16_t *)addr, trace_entry);
+	if (link_target != 0) {
+		riscv_cc_branch(thread_data, (uint16_t *)addr, link_target);
+		return;
+	}
+
+	// Out of JAL range, the exit finds the trace in the hash table
+	int fragment_id = addr_to_fragment_id(thread_data, addr);
+	if (fragment_id >= 0)
+		riscv_unlink_exit(thread_data, fragment_id);
+}
+#endif // DBM_TRACES
@@ -27,5 +27,190 @@ void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, uint16_t **write_p,
 void dispatcher_riscv(dbm_thread *thread_data, uint32_t source_index, 
 	branch_type exit_type, uintptr_t target, uintptr_t block_address);
 
+/**
+ * Restore the unlinked exit of a basic block, so that it calls the dispatcher
+ * again. Used when the target of a linked exit is evicted from the code cache.
+ * @param thread_data Thread data of the code cache.
+ * @param fragment_id Index of the basic block.
+ */
+void riscv_unlink_exit(dbm_thread *thread_data, int fragment_id);
+
+#ifdef DBM_CC_VENEERS
+/**
+ * Get a veneer jumping to a basic block out of JAL range, in the island of the
+ * region containing the branch. Veneers are shared by all the exits of a region
+ * linked to the same basic block.
+ * @param thread_data Thread data of the code cache.
+ * @param branch_addr Address of the exit branch to link.
+ * @param block_address Address of the target basic block.
+ * @return Address of the veneer or 0 if the island is full.
+ */
+uintptr_t riscv_get_veneer(dbm_thread *thread_data, uintptr_t branch_addr,
+	uintptr_t block_address);
+
+/**
+ * Record that an exit branch has been linked to a veneer, does nothing if
+ * \c link_target isn't a veneer.
+ * @param thread_data Thread data of the code cache.
+ * @param branch_addr Address of the linked exit branch.
+ * @param link_target Address the exit branch jumps to.
+ */
+void riscv_record_veneer_link(dbm_thread *thread_data, uintptr_t branch_addr,
+	uintptr_t link_target);
+
+/**
+ * Restore the exits linked through a veneer and free it. Used when the target
+ * of the veneer is evicted from the code cache.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address recorded as linked to the evicted basic block.
+ * @return True if \c addr was a veneer.
+ */
+bool riscv_unlink_veneer(dbm_thread *thread_data, uintptr_t addr);
+
+/**
+ * Free all the veneers of a region being evicted.
+ * @param thread_data Thread data of the code cache.
+ * @param region Index of the region.
+ */
+void riscv_reset_veneers(dbm_thread *thread_data, int region);
+
+/**
+ * Get the target of the veneer containing an address.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address in the code cache.
+ * @return Address of the target basic block or 0 if \c addr isn't in a veneer.
+ */
+uintptr_t riscv_veneer_target(dbm_thread *thread_data, uintptr_t addr);
+#endif
+
+#ifdef DBM_RAS
+/**
+ * Set the translation of the return address in the record of a call, when the
+ * return it was popped by missed because the translation wasn't known yet.
+ * @param thread_data Thread data of current thread.
+ * @param target Branch target in original code space.
+ * @param block_address Address of target block where \c target is instrumented.
+ */
+void riscv_ras_fill(dbm_thread *thread_data, uintptr_t target, uintptr_t block_address);
+
+/**
+ * Clear the translation in the record of a call. Used when the basic block at
+ * the return address is evicted from the code cache.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address recorded as linked to the evicted basic block.
+ * @return True if \c addr was the translation in a call record.
+ */
+bool riscv_ras_unlink(dbm_thread *thread_data, uintptr_t addr);
+
+/**
+ * Remove the records in [start, end) from the shadow return address stack.
+ * @param thread_data Thread data of current thread.
+ * @param start Start of the evicted code cache range.
+ * @param end End of the evicted code cache range (exclusive).
+ */
+void riscv_ras_reset(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+#endif
+
+#ifdef DBM_IBTC
+/**
+ * Add a target to the first free way of the inline target cache of an indirect
+ * branch. Nothing is done if all ways are used.
+ * @param thread_data Thread data of current thread.
+ * @param source_index Index of the basic block ending with the indirect branch.
+ * @param target Branch target in original code space.
+ * @param block_address Address of target block where \c target is instrumented.
+ */
+void riscv_ibtc_fill(dbm_thread *thread_data, uint32_t source_index, uintptr_t target,
+	uintptr_t block_address);
+
+/**
+ * Free the way of an inline target cache. Used when the basic block it
+ * translates to is evicted from the code cache.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address recorded as linked to the evicted basic block.
+ * @return True if \c addr was the translation in an inline target cache.
+ */
+bool riscv_ibtc_unlink(dbm_thread *thread_data, uintptr_t addr);
+#endif
+
+#ifdef DBM_JUMP_TABLES
+/**
+ * Set the translation of a target in the translated jump table of an indirect
+ * branch, in all the entries of the target that aren't set yet.
+ * @param thread_data Thread data of current thread.
+ * @param source_index Index of the basic block ending with the indirect branch.
+ * @param target Branch target in original code space.
+ * @param block_address Address of target block where \c target is instrumented.
+ */
+void riscv_jump_table_fill(dbm_thread *thread_data, uint32_t source_index, uintptr_t target,
+	uintptr_t block_address);
+
+/**
+ * Get the pool of translated jump tables containing an address.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address to look up.
+ * @return Index of the pool or -1 if \c addr isn't in a translated jump table.
+ */
+int riscv_jump_table_pool(dbm_thread *thread_data, uintptr_t addr);
+
+/**
+ * Clear the translation in an entry of a translated jump table. Used when the
+ * basic block it translates to is evicted from the code cache.
+ * @param thread_data Thread data of the code cache.
+ * @param addr Address recorded as linked to the evicted basic block.
+ * @return True if \c addr was the translation in a jump table entry.
+ */
+bool riscv_jump_table_unlink(dbm_thread *thread_data, uintptr_t addr);
+
+/**
+ * Free all the translated jump tables of a pool, the entries are cleared.
+ * @param thread_data Thread data of the code cache.
+ * @param pool Index of the pool (the code cache region).
+ */
+void riscv_jump_table_reset(dbm_thread *thread_data, int pool);
+#endif
+
+#ifdef DBM_LOOKAHEAD
+/**
+ * Translate the direct successors of a newly scanned basic block breadth-first,
+ * up to \c LOOKAHEAD_BBS basic blocks, and link the exits to them. Stops if the
+ * code cache is flushed or a region is evicted (\c was_flushed is set).
+ * @param thread_data Thread data of current thread.
+ * @param basic_block Index of the newly scanned basic block.
+ */
+void riscv_lookahead(dbm_thread *thread_data, int basic_block);
+#endif
+
+#ifdef DBM_SPEC_THREAD
+/**
+ * Queue the untranslated targets of the direct exit of a basic block for the
+ * speculative translation thread and wake it up. The caller holds the code
+ * cache lock. The oldest target is dropped if the queue is full.
+ * @param thread_data Thread data owning the code cache.
+ * @param basic_block Index of the basic block.
+ */
+void riscv_spec_enqueue(dbm_thread *thread_data, int basic_block);
+
+/**
+ * Translate the oldest queued target of a thread, unless it is already in the
+ * code cache or can no longer be scanned. Called by the speculative translation
+ * thread with the code cache lock held and enough free space in the current
+ * region that nothing is evicted.
+ * @param thread_data Thread data owning the code cache.
+ */
+void riscv_spec_translate(dbm_thread *thread_data);
+#endif
+
+#ifdef DBM_TRACES
+/**
+ * Redirect a link to the source basic block of a new trace to the trace entry.
+ * Exits out of JAL range are unlinked, they reach the trace through the hash table.
+ * @param thread_data Thread data of current thread.
+ * @param addr Address recorded as linked to the source basic block.
+ * @param trace_entry Address of the trace entry.
+ */
+void riscv_link_to_trace(dbm_thread *thread_data, uintptr_t addr, uintptr_t trace_entry);
+#endif
+
 #endif
 #endif
\ No newline at end of file
@@ -205,6 +205,81 @@ pop_fp_volatile:
 
 .global dispatcher_trampoline
 dispatcher_trampoline:
+        /*
+         * Fast path: exits which are never linked (source_index 0, or
+         * BRANCH_NO_LINK set by the dispatcher in branch_cache_status) look up
+         * the target in the hash table like the inline hash lookup and return
+         * to the code cache without calling the dispatcher. Misses, stale
+         * entries, linkable exits and pending invalidations take the C path,
+         * and so do the lookups which overlap a modification of the table (odd
+         * or changed seq, only incremented with HASH_SEQLOCK). Misses are
+         * passed to the dispatcher with source_index 0, there is nothing to
+         * link.
+         * x10 = SPC (target), x11 = source_index, x12 is saved at 0(sp)
+         */
+        BEQZ    x11, dispatcher_fast_path
+        C.ADDI  sp, -8
+        SD      x13, 0(sp)
+        LD      x12, code_cache_meta_size
+        MUL     x12, x12, x11
+        LD      x13, branch_status_ptr
+        ADD     x12, x12, x13
+        LD      x13, 0(sp)
+        C.ADDI  sp, 8
+        LD      x12, 0(x12)             # branch_cache_status
+        ANDI    x12, x12, 8             # BRANCH_NO_LINK
+        BEQZ    x12, dispatcher_slow_path
+dispatcher_fast_path:
+        LD      x12, pending_inval_count_ptr
+        LW      x12, 0(x12)
+        BNEZ    x12, dispatcher_slow_path
+        C.ADDI  sp, -8
+        SD      x13, 0(sp)
+        LD      x13, hash_seq_ptr
+        LD      x13, 0(x13)             # seq
+        ANDI    x11, x13, 1
+        BNEZ    x11, dispatcher_seq_miss
+        FENCE   r, r
+        LI      x11, 0x61C88647         # HASH_MULT
+        MUL     x11, x11, x10
+        SRLI    x11, x11, 28            # SRL 32 - SLL 4 for 16 byte struct size
+        LD      x12, hash_index_mask_ptr
+        LD      x12, 0(x12)
+        AND     x11, x11, x12
+        LD      x12, hash_entries_ptr
+        ADD     x11, x11, x12
+1:
+        LD      x12, 0(x11)             # key
+        ADDI    x11, x11, 16
+        BEQZ    x12, dispatcher_seq_miss
+        BNE     x12, x10, 1b
+        LD      x12, -8(x11)            # value
+        FENCE   r, r
+        LD      x11, hash_seq_ptr
+        LD      x11, 0(x11)
+        BNE     x11, x13, dispatcher_seq_miss
+        LD      x13, 0(sp)
+        C.ADDI  sp, 8
+        LD      x11, hash_epoch_ptr
+        LD      x11, 0(x11)
+        SLLI    x11, x11, 48            # HASH_EPOCH_SHIFT
+        SUB     x12, x12, x11           # Clear the epoch of a current entry
+        SRLI    x11, x12, 48
+        BNEZ    x11, dispatcher_miss    # Stale entry
+        MV      x11, x10                # param1: SPC (target)
+        MV      x10, x12                # param0: TCP
+        LD      x12, 0(sp)              # Restore temp jump register
+        C.ADDI  sp, 8
+        J       checked_cc_return
+
+dispatcher_seq_miss:
+        LD      x13, 0(sp)
+        C.ADDI  sp, 8
+
+dispatcher_miss:
+        LI      x11, 0                  # source_index
+
+dispatcher_slow_path:
         # PUSH all general purpose registers but x10, x11
         # x10 and x11 are pushed by the exit stub
         LD      x12, 0(sp)              # Restore temp jump register
@@ -231,6 +306,84 @@ dispatcher_trampoline:
 
 dispatcher_addr: .dword dispatcher
 
+.global exit_trampoline
+exit_trampoline:
+        /*
+         * Shared tail of the direct exits with DBM_COMPACT_EXITS, the target is
+         * loaded from the metadata of the source fragment
+         * x10 = Offset of the target in dbm_code_cache_meta
+         * x11 = source_index
+         * (x10, x11 and x12 are pushed by the exit before)
+         */
+        LD      x12, code_cache_meta_size
+        MUL     x12, x12, x11
+        ADD     x12, x12, x10
+        LD      x10, code_cache_meta_ptr
+        ADD     x12, x12, x10
+        LD      x10, 0(x12)             # param0: SPC (target)
+        J       dispatcher_trampoline
+
+.global trace_head_incr
+trace_head_incr:
+        /*
+         * x11 = Basic Block number
+         * ra = Address to return to in the code cache
+         * (x1 and x11 are pushed by the trace head before)
+         */
+        C.ADDI  sp, -16
+        SD      x12, 8(sp)
+        SD      x13, 0(sp)
+        LD      x12, trace_exec_count   # uint8_t exec_count[]
+        ADD     x12, x12, x11
+        LBU     x13, 0(x12)
+        ADDI    x13, x13, -1
+        SB      x13, 0(x12)
+        BEQZ    x13, create_trace_trampoline
+        LD      x12, 8(sp)
+        LD      x13, 0(sp)
+        C.ADDI  sp, 16
+        RET
+
+create_trace_trampoline:
+        /*
+         * Stack peek:
+         *              ┌───────┐
+         *        sp -> │ x13   │
+         *              │ x12   │
+         *              │ x11   ├ (Pushed by the trace head)
+         *              │ x1    ├ (Pushed by the trace head)
+         *              │.......│
+         */
+        LD      x12, 8(sp)
+        LD      x13, 0(sp)
+        LD      ra, 24(sp)
+        SD      x10, 24(sp)             # x10 and x11 are popped by the trace entry
+        C.ADDI  sp, -16                 # 32 byte allocated with cc_addr_pair
+        SD      ra, 0(sp)
+        JAL     push_volatile
+        JAL     push_fp_volatile
+
+        LD      x10, disp_thread_data   # param0: dbm_thread *thread_data
+                                        # param1: bb_source (x11)
+        ADDI    x12, sp, 224            # param2: cc_addr_pair *ret_addr
+
+        LD      x14, create_trace_addr  # Call very far-away function
+        JALR    ra, 0(x14)
+
+        JAL     pop_fp_volatile
+        JAL     pop_volatile
+        LD      ra, 0(sp)
+        LD      x10, 16(sp)             # param0: TCP (ret_addr->tpc)
+        LD      x11, 24(sp)             # param1: SPC (ret_addr->spc)
+        C.ADDI  sp, 32
+
+        J       checked_cc_return
+
+create_trace_addr: .dword create_trace
+
+.global trace_exec_count
+trace_exec_count: .dword 0              # uint8_t *
+
 .global disp_thread_data
 disp_thread_data: .dword 0
 
@@ -390,6 +543,30 @@ deliver_signals_addr: .dword deliver_signals
 .global th_is_pending_ptr
 th_is_pending_ptr: .dword 0             # uint32 *
 
+.global hash_entries_ptr
+hash_entries_ptr: .dword 0              # hash_entry *
+
+.global hash_index_mask_ptr
+hash_index_mask_ptr: .dword 0           # uintptr_t *
+
+.global hash_epoch_ptr
+hash_epoch_ptr: .dword 0                # uintptr_t *
+
+.global hash_seq_ptr
+hash_seq_ptr: .dword 0                  # uintptr_t *
+
+.global pending_inval_count_ptr
+pending_inval_count_ptr: .dword 0       # int *
+
+.global code_cache_meta_ptr
+code_cache_meta_ptr: .dword 0           # dbm_code_cache_meta *
+
+.global code_cache_meta_size
+code_cache_meta_size: .dword 0          # size_t
+
+.global branch_status_ptr
+branch_status_ptr: .dword 0             # uintptr_t *, code_cache_meta[0].branch_cache_status
+
 .global gp_tp_mambo_ctx
 gp_tp_mambo_ctx: .word 0
 
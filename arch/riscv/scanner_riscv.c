@@ -1,6 +1,7 @@
 #ifdef DBM_ARCH_RISCV64
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "../../dbm.h"
@@ -20,13 +21,64 @@
  */
 #define NOP_INSTRUCTION 0x00010001		// 2x C.NOP
 #define C_NOP_INSTRUCTION 0x0001		// C.NOP
+#define FENCE_R_R_INSTRUCTION 0x0220000f	// FENCE r, r
 
 #define MIN_FSPACE 68
+#define CONT_JUMP_SIZE 12 // worst case jump to a continuation block, see riscv_check_free_space()
+#define MAX_INLINE 8 // direct jumps inlined into one fragment
+#define MAX_LIVENESS_INST 16 // instructions analysed by riscv_dead_regs()
+#define STUB_BB_SIZE 64 // space of a stub fragment, for the start of the fragment replacing it
+#ifdef HASH_SEQLOCK
+#define IHL_MAX_SIZE 194 // worst case inline hash lookup
+#else
+#define IHL_MAX_SIZE 160 // worst case inline hash lookup
+#endif
+#ifdef DBM_RAS
+#define RAS_MAX_SIZE 80 // worst case shadow return address stack push or pop
+#else
+#define RAS_MAX_SIZE 0
+#endif
+#ifdef DBM_IBTC
+#define IBTC_MAX_SIZE (18 + 36 * IBTC_WAYS) // worst case inline target cache
+#else
+#define IBTC_MAX_SIZE 0
+#endif
+#ifdef DBM_LINK_PLT
+#define PLT_EXIT_MAX_SIZE 120 // worst case guarded exit of a PLT stub, without the IHL
+#endif
+#ifdef DBM_JUMP_TABLES
+#define JT_LOOKUP_MAX_SIZE 114 // worst case translated jump table lookup
+#else
+#define JT_LOOKUP_MAX_SIZE 0
+#endif
+
+#ifdef DBM_JUMP_TABLES
+/*
+ * Jump table of a switch statement in read-only data, dispatched by:
+ * 	LW/LD	rT, 0(rP)
+ * 	ADD		rT, rT, rB		for tables of offsets, rB is the address of the table
+ * 	C.JR	rT
+ * The address of the table is the last one built with AUIPC or LUI and ADDI.
+ */
+typedef struct {
+	enum reg base_reg;		// register last set to an address, x0 if none
+	uintptr_t base_value;
+	uint16_t *jr_address;	// indirect branch dispatching the table, NULL if none
+	enum reg rt;
+	enum reg rp;
+	uintptr_t base;
+	int entries;
+	int entry_size;			// 4 or 8 bytes
+	bool relative;
+} riscv_jump_table;
+#endif
 
 #ifdef MODULE_ONLY
 	// TODO: rather mock these functions
 	#define record_cc_link(...)
 	#define allocate_bb(...) 0
+	#define trim_bb(...)
+	#define cc_add_source_range(...)
 #endif
 
 #ifdef DEBUG
@@ -180,11 +232,14 @@ int riscv_large_jump_helper(uint16_t **write_p, uint64_t target, bool link, enum
 	return 0;
 }
 
-void riscv_cc_branch(dbm_thread *thread_data, uint16_t *write_p, uint64_t target)
+int riscv_cc_branch(dbm_thread *thread_data, uint16_t *write_p, uint64_t target)
 {
-	riscv_branch_imm_helper(&write_p, target, false);
+	uint16_t *branch = write_p;
+	if (riscv_branch_imm_helper(&write_p, target, false) != 0)
+		return -1;
 
-	record_cc_link(thread_data, (uintptr_t)write_p, target);
+	record_cc_link(thread_data, (uintptr_t)branch, target);
+	return 0;
 }
 
 int riscv_b_cond_helper(uint16_t **write_p, uint64_t target, mambo_cond *cond)
@@ -384,6 +439,14 @@ void riscv_branch_jump(dbm_thread *thread_data, uint16_t **write_p, int basic_bl
 	 *
 	 * ** if REPLACE_TARGET
 	 * ## if INSERT_BRANCH
+	 *
+	 * With DBM_COMPACT_EXITS and both flags, the target is stored in the
+	 * metadata of basic_block and loaded by the shared exit trampoline:
+	 *					+-------------------------------+
+	 *					|	LI		x10, &meta.branch_taken_addr - &meta
+	 *					|	LI		x11, basic_block	|	dispatcher: source_index
+	 *					|	J		EXIT_TRAMPOLINE		|	Large jump
+	 *					+-------------------------------+
 	 * 
 	 * //! WARNING: Inserted code may override registers x10, x11 and x12!
 	 * 
@@ -391,6 +454,17 @@ void riscv_branch_jump(dbm_thread *thread_data, uint16_t **write_p, int basic_bl
 	 */
 	debug("riscv_branch_jump: RISC-V branch target: 0x%lx\n", target);
 
+#ifdef DBM_COMPACT_EXITS
+	if ((flags & REPLACE_TARGET) && (flags & INSERT_BRANCH)) {
+		thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
+		riscv_copy_to_reg_32bits(write_p, x10, offsetof(dbm_code_cache_meta,
+			branch_taken_addr));
+		riscv_copy_to_reg_32bits(write_p, x11, basic_block);
+		riscv_large_jump_helper(write_p, thread_data->exit_trampoline_addr, false, x12);
+		return;
+	}
+#endif
+
 	if (flags & REPLACE_TARGET) {
 		riscv_copy_to_reg_64bits(write_p, x10, target);
 	}
@@ -438,7 +512,12 @@ void riscv_branch_jump_cond(dbm_thread *thread_data, uint16_t **write_p,
 	 * 					|	LI		x11, basic_block	|	dispatcher: source_index
 	 * 					|	J		DISPATCHER			|	Long jump
 	 * 					+-------------------------------+
-	 * [Size: 78 B]
+	 *
+	 * With DBM_COMPACT_EXITS, both targets are stored in the metadata of
+	 * basic_block, the LI x10 load their offset in it instead and the exit jumps
+	 * to the shared exit trampoline, which loads the target.
+	 *
+	 * [Size: 78 B, 50 B with DBM_COMPACT_EXITS]
 	 */
 	uint16_t *cond_branch, *branch_disp;
 
@@ -460,8 +539,17 @@ void riscv_branch_jump_cond(dbm_thread *thread_data, uint16_t **write_p,
 	**(uint32_t **)write_p = NOP_INSTRUCTION;
 	*write_p += 2;
 
+#ifdef DBM_COMPACT_EXITS
+	thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
+	thread_data->code_cache_meta[basic_block].branch_skipped_addr =
+		(uint64_t)read_address + len;
+	// LI x10, &meta.branch_skipped_addr - &meta
+	riscv_copy_to_reg_32bits(write_p, x10, offsetof(dbm_code_cache_meta,
+		branch_skipped_addr));
+#else
 	// LI x10, read_address+len
 	riscv_copy_to_reg_64bits(write_p, x10, (uint64_t)read_address + len);
+#endif
 	// C.J branch (added later)
 	branch_disp = *write_p;
 	(*write_p)++;
@@ -469,16 +557,27 @@ void riscv_branch_jump_cond(dbm_thread *thread_data, uint16_t **write_p,
 	// branch_target:
 	// Insert "B(cond) branch_target" at cond_branch
 	riscv_b_cond_helper(&cond_branch, (uint64_t)*write_p, cond);
+#ifdef DBM_COMPACT_EXITS
+	// LI x10, &meta.branch_taken_addr - &meta
+	riscv_copy_to_reg_32bits(write_p, x10, offsetof(dbm_code_cache_meta,
+		branch_taken_addr));
+#else
 	// LI x10, target
 	riscv_copy_to_reg_64bits(write_p, x10, target);
+#endif
 
 	// branch:
 	// Insert "C.J branch" at branch_disp
 	riscv_branch_imm_helper(&branch_disp, (uint64_t)*write_p, false);
 	// LI x11, basic_block
 	riscv_copy_to_reg_32bits(write_p, x11, basic_block);
+#ifdef DBM_COMPACT_EXITS
+	// J EXIT_TRAMPOLINE
+	riscv_large_jump_helper(write_p, thread_data->exit_trampoline_addr, false, x12);
+#else
 	// J DISPATCHER
 	riscv_large_jump_helper(write_p, thread_data->dispatcher_addr, false, x12);
+#endif
 }
 
 void riscv_check_free_space(dbm_thread *thread_data, uint16_t **write_p,
@@ -486,42 +585,154 @@ void riscv_check_free_space(dbm_thread *thread_data, uint16_t **write_p,
 {
 	int basic_block;
 
-	if ((((uint64_t)*write_p) + size) >= (uint64_t)*data_p) {
+	// The continuation block can be in another region, reserve space for a large jump
+	if ((((uint64_t)*write_p) + size + CONT_JUMP_SIZE) >= (uint64_t)*data_p) {
 		basic_block = allocate_bb(thread_data);
 		thread_data->code_cache_meta[basic_block].actual_id = cur_block;
-		if ((uint16_t *)&thread_data->code_cache->blocks[basic_block] != *data_p) {
-			riscv_branch_imm_helper(write_p,
-				(uint64_t)&thread_data->code_cache->blocks[basic_block], false);
-			*write_p = (uint16_t *)&thread_data->code_cache->blocks[basic_block];
+		uint16_t *cont = (uint16_t *)cc_bb_addr(thread_data, basic_block);
+		if (cont != *data_p) {
+			if (riscv_branch_imm_helper(write_p, (uint64_t)cont, false) == 0) {
+				*write_p = cont;
+			} else {
+				/*
+				 * The continuation is in another region, out of range of JAL.
+				 * No register is free at this point, x10 is spilled.
+				 * 					+-------------------------------+
+				 * 					|	PUSH	x10					|
+				 * 					|	AUIPC	x10, offset[31:12]	|
+				 * 					|	JALR	x0, offset[11:0](x10)
+				 * 					+-------------------------------+
+				 * cont:			|	POP		x10					|
+				 * 					+-------------------------------+
+				 */
+				uint16_t *jump = *write_p;
+				riscv_push_helper(write_p, x10);
+				int ret = riscv_large_jump_helper(write_p, (uint64_t)cont, false, x10);
+				assert(ret == 0 && *write_p - jump <= CONT_JUMP_SIZE / 2);
+				*write_p = cont;
+				riscv_pop_helper(write_p, x10);
+			}
+		}
+		*data_p = (uint16_t *)cc_bb_end(thread_data, basic_block);
+	}
+}
+
+/*
+ * Target of JAL, C.J or C.JAL at read_address.
+ */
+static uint64_t riscv_jump_target(riscv_instruction inst, uint16_t *read_address)
+{
+	enum reg x;
+	unsigned int rawimm;
+	uint64_t branch_offset;
+	int imm_size;
+
+	if (inst == RISCV_JAL) {
+		riscv_jal_decode_fields(read_address, &x, &rawimm);
+		riscv_calc_j_imm(rawimm, &branch_offset);
+		imm_size = 21;
+	} else if (inst == RISCV_C_JAL) {
+		riscv_c_jal_decode_fields(read_address, &rawimm);
+		riscv_calc_cj_imm(rawimm, &branch_offset);
+		imm_size = 12;
+	} else { // RISCV_C_J
+		riscv_c_j_decode_fields(read_address, &rawimm);
+		riscv_calc_cj_imm(rawimm, &branch_offset);
+		imm_size = 12;
+	}
+
+	branch_offset = sign_extend64(imm_size, branch_offset);
+	return (uint64_t)read_address + branch_offset;
+}
+
+#ifdef DBM_INLINE_UNCOND_IMM
+/*
+ * Decide whether scanning continues at the target of a direct jump instead of
+ * ending the fragment. At most MAX_INLINE jumps are inlined in a fragment, of
+ * which MAX_BACK_INLINE backward jumps to bound the unrolling of loops.
+ */
+static bool riscv_inline_uncond_imm(uint16_t *read_address, uint64_t target,
+	int *inlined_count, int *inlined_back_count)
+{
+	if (*inlined_count >= MAX_INLINE)
+		return false;
+	if (target <= (uint64_t)read_address) {
+		if (*inlined_back_count >= MAX_BACK_INLINE)
+			return false;
+		(*inlined_back_count)++;
+	}
+	(*inlined_count)++;
+	return true;
+}
+
+/*
+ * Add the source range [start, end) to the ranges of the fragment being scanned.
+ * It's merged with the ranges it overlaps or is adjacent to, so the ranges
+ * stay disjoint. There are at most MAX_INLINE + 1 of them.
+ */
+static void riscv_add_source_range(uintptr_t ranges[][2], int *count,
+	uintptr_t start, uintptr_t end)
+{
+	int merged = -1;
+
+	for (int i = 0; i < *count; i++) {
+		if (start > ranges[i][1] || end < ranges[i][0])
+			continue;
+		if (ranges[i][0] < start)
+			start = ranges[i][0];
+		if (ranges[i][1] > end)
+			end = ranges[i][1];
+		if (merged < 0) {
+			merged = i;
+		} else {
+			// Already merged into an earlier range, remove this one
+			for (int j = i + 1; j < *count; j++) {
+				ranges[j - 1][0] = ranges[j][0];
+				ranges[j - 1][1] = ranges[j][1];
+			}
+			(*count)--;
+			i--;
 		}
-		*data_p = (uint16_t *)&thread_data->code_cache->blocks[basic_block];
-		*data_p += BASIC_BLOCK_SIZE;
 	}
+	if (merged < 0)
+		merged = (*count)++;
+	ranges[merged][0] = start;
+	ranges[merged][1] = end;
 }
+#endif
 
 void pass1_riscv(uint16_t *read_address, branch_type *bb_type)
 {
 	*bb_type = unknown;
+#ifdef DBM_INLINE_UNCOND_IMM
+	int inlined_count = 0;
+	int inlined_back_count = 0;
+#endif
 
 	while (*bb_type == unknown) {
 		riscv_instruction inst = riscv_decode(read_address);
 
 		switch (inst) {
 		case RISCV_JAL:
+		case RISCV_C_J:
+		case RISCV_C_JAL: {
+#ifdef DBM_INLINE_UNCOND_IMM
+			uint64_t target = riscv_jump_target(inst, read_address);
+			if (riscv_inline_uncond_imm(read_address, target, &inlined_count,
+				&inlined_back_count)) {
+				read_address = (uint16_t *)target;
+				continue;
+			}
+#endif
 			*bb_type = uncond_imm_riscv;
 			break;
+		}
 		case RISCV_JALR:
 			*bb_type = uncond_reg_riscv;
 			break;
-		case RISCV_C_J:
-			*bb_type = uncond_imm_riscv;
-			break;
 		case RISCV_C_JR:
 			*bb_type = uncond_reg_riscv;
 			break;
-		case RISCV_C_JAL:
-			*bb_type = uncond_imm_riscv;
-			break;
 		case RISCV_C_JALR:
 			*bb_type = uncond_reg_riscv;
 			break;
@@ -539,8 +750,129 @@ void pass1_riscv(uint16_t *read_address, branch_type *bb_type)
 		case RISCV_C_ILLEGAL:
 			return;
 		}
-		read_address += riscv_get_inst_length(inst);
+		read_address += riscv_get_inst_length(inst) / 2;
+	}
+}
+
+uint32_t riscv_dead_regs(uint16_t *read_address)
+{
+	uint32_t read = 0;
+	uint32_t dead = 0;
+
+	for (int i = 0; i < MAX_LIVENESS_INST; i++) {
+		uint32_t word = *read_address;
+		uint32_t uses = 0;
+		uint32_t defs = 0;
+		int len;
+
+		if ((word & 3) == 3) {
+			word |= (uint32_t)read_address[1] << 16;
+			uint32_t rd = 1 << ((word >> 7) & 0x1F);
+			uint32_t rs1 = 1 << ((word >> 15) & 0x1F);
+			uint32_t rs2 = 1 << ((word >> 20) & 0x1F);
+			len = INST_32BIT;
+
+			switch (word & 0x7F) {
+			case 0x37: // LUI
+			case 0x17: // AUIPC
+				defs = rd;
+				break;
+			case 0x03: // LOAD
+			case 0x13: // OP-IMM
+			case 0x1B: // OP-IMM-32
+				uses = rs1;
+				defs = rd;
+				break;
+			case 0x33: // OP
+			case 0x3B: // OP-32
+				uses = rs1 | rs2;
+				defs = rd;
+				break;
+			case 0x23: // STORE
+				uses = rs1 | rs2;
+				break;
+			case 0x07: // LOAD-FP
+			case 0x27: // STORE-FP
+				uses = rs1;
+				break;
+			default:
+				// Branches, jumps, system, atomic and other floating point instructions
+				return dead;
+			}
+		} else {
+			if (word == 0) // illegal instruction
+				return dead;
+			uint32_t funct3 = word >> 13;
+			uint32_t rd = 1 << ((word >> 7) & 0x1F);
+			uint32_t rs2 = 1 << ((word >> 2) & 0x1F);
+			uint32_t rd_c = 1 << (((word >> 7) & 7) + 8);	// rd' / rs1'
+			uint32_t rs2_c = 1 << (((word >> 2) & 7) + 8);	// rd' / rs2'
+			len = INST_16BIT;
+
+			switch (((word & 3) << 3) | funct3) {
+			case 0x00: // C.ADDI4SPN
+				uses = m_x2;
+				defs = rs2_c;
+				break;
+			case 0x01: // C.FLD
+			case 0x05: // C.FSD
+				uses = rd_c;
+				break;
+			case 0x02: // C.LW
+			case 0x03: // C.LD
+				uses = rd_c;
+				defs = rs2_c;
+				break;
+			case 0x06: // C.SW
+			case 0x07: // C.SD
+				uses = rd_c | rs2_c;
+				break;
+			case 0x08: // C.ADDI
+			case 0x09: // C.ADDIW
+			case 0x10: // C.SLLI
+				uses = rd;
+				defs = rd;
+				break;
+			case 0x0A: // C.LI
+			case 0x0B: // C.LUI, C.ADDI16SP
+				uses = (rd == m_x2) ? m_x2 : 0;
+				defs = rd;
+				break;
+			case 0x0C: // C.SRLI, C.SRAI, C.ANDI, C.SUB, C.XOR, C.OR, C.AND, C.SUBW, C.ADDW
+				uses = (((word >> 10) & 3) == 3) ? (rd_c | rs2_c) : rd_c;
+				defs = rd_c;
+				break;
+			case 0x11: // C.FLDSP
+			case 0x15: // C.FSDSP
+				uses = m_x2;
+				break;
+			case 0x12: // C.LWSP
+			case 0x13: // C.LDSP
+				uses = m_x2;
+				defs = rd;
+				break;
+			case 0x14: // C.MV, C.ADD
+				// C.JR, C.JALR and C.EBREAK have rs2 = 0
+				if (rs2 == m_x0)
+					return dead;
+				uses = (word & (1 << 12)) ? (rd | rs2) : rs2;
+				defs = rd;
+				break;
+			case 0x16: // C.SWSP
+			case 0x17: // C.SDSP
+				uses = m_x2 | rs2;
+				break;
+			default:
+				// C.J, C.BEQZ, C.BNEZ and the reserved encodings
+				return dead;
+			}
+		}
+
+		read |= uses & ~dead;
+		dead |= defs & ~read & ~m_x0;
+		read_address += len / 2;
 	}
+	return dead;
 }
 
 int riscv_get_mambo_cond(riscv_instruction inst, uint16_t *read_address, 
@@ -603,6 +935,92 @@ int riscv_get_mambo_cond(riscv_instruction inst, uint16_t *read_address,
 	return 0;
 }
 
+#ifdef DBM_DECODE_CACHE
+/**
+ * Find the entry of an instruction in the decode table of its mapping.
+ * @param thread_data Thread data owning the code cache.
+ * @param read_address Address of the instruction.
+ * @return Entry, or \c NULL if the mapping has no decode table.
+ */
+static decode_cache_entry *riscv_decode_table_entry(dbm_thread *thread_data,
+	uint16_t *read_address)
+{
+	uintptr_t addr = (uintptr_t)read_address;
+	decode_table *table = thread_data->decode_table;
+	if (table == NULL || addr < table->start || addr >= table->end) {
+		table = decode_table_find(addr);
+		thread_data->decode_table = table;
+		if (table == NULL)
+			return NULL;
+	}
+	return &table->entries[(addr - table->start) / 2];
+}
+
+/**
+ * Copy the decoded instruction at an address from the decode table. The
+ * tables are shared, the entry is checked again after it has been copied.
+ * @param thread_data Thread data owning the code cache.
+ * @param read_address Address of the instruction.
+ * @param word Current encoding of the instruction.
+ * @param decoded Copy of the entry.
+ * @return The entry holds the instruction.
+ */
+static bool riscv_decode_cache_lookup(dbm_thread *thread_data, uint16_t *read_address,
+	uint32_t word, decode_cache_entry *decoded)
+{
+	decode_cache_entry *entry = riscv_decode_table_entry(thread_data, read_address);
+	if (entry == NULL || __atomic_load_n(&entry->word, __ATOMIC_ACQUIRE) != word)
+		return false;
+	*decoded = *entry;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return decoded->word == word && __atomic_load_n(&entry->word, __ATOMIC_RELAXED) == word;
+}
+
+static uint32_t riscv_inst_word(uint16_t *read_address)
+{
+	uint32_t word = *read_address;
+	if ((word & 3) == 3)
+		word |= (uint32_t)read_address[1] << 16;
+	return word;
+}
+
+/**
+ * Decode an instruction through the decode table of its mapping, which saves
+ * decoding it again when it is scanned after a flush, an eviction, in place of
+ * a stub or by another thread. Entries are matched by encoding, so they are
+ * never stale if the code is modified. The length, the branch type and the
+ * load or store size are cached with it for the plugin API.
+ * @param thread_data Thread data owning the code cache.
+ * @param read_address Address of the instruction.
+ * @return Decoded instruction.
+ */
+static riscv_instruction riscv_decode_cached(dbm_thread *thread_data, uint16_t *read_address)
+{
+	uint32_t word = riscv_inst_word(read_address);
+
+	decode_cache_entry decoded;
+	if (riscv_decode_cache_lookup(thread_data, read_address, word, &decoded))
+		return decoded.inst;
+
+	riscv_instruction inst = riscv_decode(read_address);
+	decode_cache_entry *entry = riscv_decode_table_entry(thread_data, read_address);
+	if (entry == NULL || word == 0)
+		return inst;
+
+	// Other threads may be reading it, it's free while it's being written
+	__atomic_store_n(&entry->word, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->inst = inst;
+	entry->len = riscv_get_inst_length(inst);
+#ifdef PLUGINS_NEW
+	entry->branch_type = _riscv_get_branch_type(inst, read_address);
+	entry->ld_st_size = _riscv_get_ld_st_size(inst);
+#endif
+	__atomic_store_n(&entry->word, word, __ATOMIC_RELEASE);
+	return inst;
+}
+#endif
+
 /**
  * Deliver callbacks to registered plugins.
  * @param thread_data Thread data of current thread.
@@ -634,6 +1052,12 @@ bool riscv_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id
 		mambo_context ctx;
 		set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, 
 			RISCV64_INST, inst, cond, read_address, write_p, data_p, stop);
+#ifdef DBM_DECODE_CACHE
+		decode_cache_entry decoded;
+		if (inst != -1 && riscv_decode_cache_lookup(thread_data, read_address,
+				riscv_inst_word(read_address), &decoded) && decoded.inst == inst)
+			ctx.code.decoded = &decoded;
+#endif
 		
 		for (int i = 0; i < global_data.free_plugin; i++) {
 			if (global_data.plugins[i].cbs[cb_id] != NULL) {
@@ -696,6 +1120,727 @@ bool riscv_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id
 	return replaced;
 }
 
+#ifdef DBM_RAS
+/*
+ * Pick a dead register to use as temporary without saving it, x0 if none.
+ * The registers of the ABI with a fixed use and x31, which holds the value
+ * loaded by LR for the following SC, are never picked.
+ */
+static enum reg riscv_dead_temp(uint32_t dead)
+{
+	for (enum reg reg = x5; reg < x31; reg++) {
+		if (dead & (1 << reg))
+			return reg;
+	}
+	return x0;
+}
+
+/**
+ * Push the record of a call on the shadow return address stack. The record holds
+ * the return address and its translation, which is set by the dispatcher when
+ * the first return to it misses.
+ * @param thread_data Thread data of current thread.
+ * @param basic_block Index of the basic block ending with the call.
+ * @param write_p Pointer to the writing location.
+ * @param return_addr Return address of the call (SPC).
+ * @param x_base Register used as temporary (needs to be saved).
+ * @param x_tmp Register used as temporary (needs to be saved).
+ */
+static void riscv_ras_push(dbm_thread *thread_data, int basic_block, uint16_t **write_p,
+	uintptr_t return_addr, enum reg x_base, enum reg x_tmp)
+{
+	/*
+	 * 					+-------------------------------+
+	 * 					|	C.J		push				|
+	 * 				**	|	C.NOP						|
+	 * 					| record:						|
+	 * 					|	.dword	return_addr			|
+	 * 					|	.dword	0					|	translation of return_addr
+	 * 					|	.dword	prev				|	previous record of the fragment
+	 * 					| push:							|
+	 * 					|	LI		x_base, &ras_top	|
+	 * 					|	LD		x_tmp, 0(x_base)	|
+	 * 					|	ADDI	x_tmp, x_tmp, 8		|
+	 * 					|	SD		x_tmp, 0(x_base)	|	ras_top += 8
+	 * 					|	ANDI	x_tmp, x_tmp, RAS_MASK
+	 * 					|	C.ADD	x_base, x_tmp		|
+	 * 					|	AUIPC	x_tmp, 0			|
+	 * 					|	ADDI	x_tmp, x_tmp, record|
+	 * 					|	SD		x_tmp, 8(x_base)	|	ras[ras_top] = &record
+	 * 					+-------------------------------+
+	 *
+	 * ** up to 3 times, the record is 8 byte aligned for the loads and stores
+	 *
+	 * [Size: 74-80 B]
+	 */
+	uint16_t *branch_to_push = (*write_p)++;
+	int ras_offset = offsetof(dbm_thread, ras) - offsetof(dbm_thread, ras_top);
+	while (((uintptr_t)*write_p & 7) != 0) {
+		**write_p = C_NOP_INSTRUCTION;
+		(*write_p)++;
+	}
+
+	ras_record *record = (ras_record *)*write_p;
+	record->spc = return_addr;
+	record->tpc = 0;
+	record->prev = thread_data->code_cache_meta[basic_block].ras_call;
+	*write_p += sizeof(ras_record) / 2;
+	thread_data->code_cache_meta[basic_block].ras_call = record;
+
+	// Insert "C.J push" at branch_to_push (above)
+	riscv_branch_imm_helper(&branch_to_push, (uint64_t)*write_p, false);
+
+	// LI x_base, &ras_top
+	riscv_copy_to_reg_64bits(write_p, x_base, (uint64_t)&thread_data->ras_top);
+	// LD x_tmp, 0(x_base)
+	riscv_ld(write_p, x_tmp, x_base, 0);
+	*write_p += 2;
+	// ADDI x_tmp, x_tmp, 8
+	riscv_addi(write_p, x_tmp, x_tmp, sizeof(uintptr_t));
+	*write_p += 2;
+	// SD x_tmp, 0(x_base)
+	riscv_sd(write_p, x_tmp, x_base, 0, 0);
+	*write_p += 2;
+	// ANDI x_tmp, x_tmp, RAS_MASK
+	riscv_andi(write_p, x_tmp, x_tmp, RAS_MASK);
+	*write_p += 2;
+	// C.ADD x_base, x_tmp
+	riscv_c_add(write_p, x_base, x_tmp);
+	(*write_p)++;
+	// AUIPC x_tmp, 0
+	int record_offset = (uintptr_t)record - (uintptr_t)*write_p;
+	riscv_auipc(write_p, x_tmp, 0);
+	*write_p += 2;
+	// ADDI x_tmp, x_tmp, record
+	riscv_addi(write_p, x_tmp, x_tmp, record_offset & 0xFFF);
+	*write_p += 2;
+	// SD x_tmp, 8(x_base)
+	riscv_sd(write_p, x_tmp, x_base, (ras_offset >> 5) & 0x7F, ras_offset & 0x1F);
+	*write_p += 2;
+}
+
+/**
+ * Pop the shadow return address stack and jump to the translation of the return
+ * address if the popped record is for the return target. Must be inserted after
+ * pushing x10, x11 and x12, falls through if the record doesn't match.
+ * @param thread_data Thread data of current thread.
+ * @param write_p Pointer to the writing location.
+ * @param rn Register containing the return target.
+ */
+static void riscv_ras_pop(dbm_thread *thread_data, uint16_t **write_p, enum reg rn)
+{
+	/*
+	 * 					+-------------------------------+
+	 * 					|	LI		x10, &ras_top		|
+	 * 					|	LD		x11, 0(x10)			|
+	 * 					|	ANDI	x12, x11, RAS_MASK	|
+	 * 					|	ADDI	x11, x11, -8		|
+	 * 					|	SD		x11, 0(x10)			|	ras_top -= 8
+	 * 					|	C.ADD	x10, x12			|
+	 * 					|	LD		x10, 8(x10)			|	x10 = record
+	 * 					|	LD		x11, 0(x10)			|
+	 * 					|	BNE		x11, rn, miss		|
+	 * 					|	LD		x10, 8(x10)			|	translation of rn
+	 * 					|	C.BEQZ	x10, miss			|
+	 * 					|	POP		x12					|	(Pseudo instruction)
+	 * 					|	C.JR	x10					|
+	 * 					| miss:							|
+	 * 					+-------------------------------+
+	 *
+	 * [Size: 62 B]
+	 */
+	uint16_t *branch_mismatch;
+	uint16_t *branch_unset;
+	int ras_offset = offsetof(dbm_thread, ras) - offsetof(dbm_thread, ras_top);
+
+	// LI x10, &ras_top
+	riscv_copy_to_reg_64bits(write_p, x10, (uint64_t)&thread_data->ras_top);
+	// LD x11, 0(x10)
+	riscv_ld(write_p, x11, x10, 0);
+	*write_p += 2;
+	// ANDI x12, x11, RAS_MASK
+	riscv_andi(write_p, x12, x11, RAS_MASK);
+	*write_p += 2;
+	// ADDI x11, x11, -8
+	riscv_addi(write_p, x11, x11, (-sizeof(uintptr_t)) & 0xFFF);
+	*write_p += 2;
+	// SD x11, 0(x10)
+	riscv_sd(write_p, x11, x10, 0, 0);
+	*write_p += 2;
+	// C.ADD x10, x12
+	riscv_c_add(write_p, x10, x12);
+	(*write_p)++;
+	// LD x10, 8(x10)
+	riscv_ld(write_p, x10, x10, ras_offset);
+	*write_p += 2;
+	// LD x11, 0(x10)
+	riscv_ld(write_p, x11, x10, offsetof(ras_record, spc));
+	*write_p += 2;
+	// BNE x11, rn, miss (added later)
+	branch_mismatch = *write_p;
+	*write_p += 2;
+	// LD x10, 8(x10)
+	riscv_ld(write_p, x10, x10, offsetof(ras_record, tpc));
+	*write_p += 2;
+	// C.BEQZ x10, miss (added later)
+	branch_unset = (*write_p)++;
+	// POP x12
+	riscv_pop_helper(write_p, x12);
+	// C.JR x10
+	riscv_c_jr(write_p, x10);
+	(*write_p)++;
+
+	// miss:
+	{
+		mambo_cond cond = {x11, rn, NE};
+		riscv_b_cond_helper(&branch_mismatch, (uint64_t)*write_p, &cond);
+	}
+	riscv_bez_helper(&branch_unset, x10, (uint64_t)*write_p);
+}
+#endif
+
+#ifdef DBM_IBTC
+/**
+ * Emit the inline target cache of an indirect branch, IBTC_WAYS pairs of a target
+ * and its translation, which are set by the dispatcher. Must be inserted after
+ * pushing x10, x11 and x12, falls through if no way matches.
+ * @param thread_data Thread data of current thread.
+ * @param basic_block Index of the basic block ending with the indirect branch.
+ * @param write_p Pointer to the writing location.
+ * @param x_spc Register containing the branch target.
+ * @param x_tmp Register used as temporary (needs to be saved).
+ * @return Location of the branch to insert for the miss while a way is free
+ * ("C.BEQZ x_tmp, not_found").
+ */
+static uint16_t *riscv_ibtc_lookup(dbm_thread *thread_data, int basic_block,
+	uint16_t **write_p, enum reg x_spc, enum reg x_tmp)
+{
+	/*
+	 * 					+-------------------------------+
+	 * 					|	C.J		lookup				|
+	 * 				**	|	C.NOP						|
+	 * 					| ibtc:							|
+	 * 				##	|	.dword	target				|	0 if the way is free
+	 * 				##	|	.dword	translation			|
+	 * 					| lookup:						|
+	 * 					|	AUIPC	x10, 0				|
+	 * 					|	ADDI	x10, x10, ibtc		|
+	 * 				##	|	LD		x_tmp, 16*i(x10)	|
+	 * 				##	|	BNE		x_tmp, x_spc, next	|
+	 * 				##	|	LD		x10, 16*i+8(x10)	|
+	 * 				##	|	POP		x12					|	(Pseudo instruction)
+	 * 				##	|	C.JR	x10					|
+	 * 				##	| next:							|
+	 * 					|	C.BEQZ	x_tmp, not_found	|	(added by the caller)
+	 * 					+-------------------------------+
+	 *
+	 * ** up to 3 times, the ways are 8 byte aligned for the loads
+	 * ## IBTC_WAYS times
+	 *
+	 * [Size: 84-90 B for 2 ways]
+	 */
+	uint16_t *branch_to_lookup = (*write_p)++;
+	while (((uintptr_t)*write_p & 7) != 0) {
+		**write_p = C_NOP_INSTRUCTION;
+		(*write_p)++;
+	}
+
+	ibtc_entry *ibtc = (ibtc_entry *)*write_p;
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		ibtc[i].spc = 0;
+		ibtc[i].tpc = 0;
+	}
+	*write_p += IBTC_WAYS * sizeof(ibtc_entry) / 2;
+	thread_data->code_cache_meta[basic_block].ibtc = ibtc;
+
+	// Insert "C.J lookup" at branch_to_lookup (above)
+	riscv_branch_imm_helper(&branch_to_lookup, (uint64_t)*write_p, false);
+
+	// AUIPC x10, 0
+	int ibtc_offset = (uintptr_t)ibtc - (uintptr_t)*write_p;
+	riscv_auipc(write_p, x10, 0);
+	*write_p += 2;
+	// ADDI x10, x10, ibtc
+	riscv_addi(write_p, x10, x10, ibtc_offset & 0xFFF);
+	*write_p += 2;
+
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		// LD x_tmp, 16*i(x10)
+		riscv_ld(write_p, x_tmp, x10, i * sizeof(ibtc_entry) + offsetof(ibtc_entry, spc));
+		*write_p += 2;
+		// BNE x_tmp, x_spc, next (added later)
+		uint16_t *branch_to_next = *write_p;
+		*write_p += 2;
+		// LD x10, 16*i+8(x10)
+		riscv_ld(write_p, x10, x10, i * sizeof(ibtc_entry) + offsetof(ibtc_entry, tpc));
+		*write_p += 2;
+		// POP x12
+		riscv_pop_helper(write_p, x12);
+		// C.JR x10
+		riscv_c_jr(write_p, x10);
+		(*write_p)++;
+
+		// next:
+		mambo_cond cond = {x_tmp, x_spc, NE};
+		riscv_b_cond_helper(&branch_to_next, (uint64_t)*write_p, &cond);
+	}
+
+	// C.BEQZ x_tmp, not_found (added by the caller)
+	return (*write_p)++;
+}
+#endif
+
+#ifdef DBM_JUMP_TABLES
+/*
+ * Target of entry i of a jump table.
+ */
+static uintptr_t riscv_jump_table_target(uintptr_t base, int i, int entry_size,
+	bool relative)
+{
+	int64_t entry = (entry_size == 4) ? ((int32_t *)base)[i] : ((int64_t *)base)[i];
+	return relative ? base + entry : (uintptr_t)entry;
+}
+
+/*
+ * Track the last address built in a register, the candidate jump table base.
+ */
+static void riscv_jump_table_track(riscv_jump_table *jt, riscv_instruction inst,
+	uint16_t *read_address)
+{
+	uint32_t word;
+
+	switch (inst) {
+	case RISCV_AUIPC: {
+		enum reg rd;
+		unsigned int imm;
+
+		riscv_auipc_decode_fields(read_address, &rd, &imm);
+		jt->base_reg = rd;
+		jt->base_value = (uintptr_t)read_address + sign_extend64(32, imm << 12);
+		break;
+	}
+	case RISCV_LUI:
+		word = *(uint32_t *)read_address;
+		jt->base_reg = (word >> 7) & 0x1F;
+		jt->base_value = (int64_t)(int32_t)(word & 0xFFFFF000);
+		break;
+	case RISCV_ADDI:
+		// ADDI base, base, lo
+		word = *(uint32_t *)read_address;
+		if (jt->base_reg != x0 && ((word >> 7) & 0x1F) == jt->base_reg
+			&& ((word >> 15) & 0x1F) == jt->base_reg)
+			jt->base_value += (int64_t)(int32_t)word >> 20;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Check if a load is the load of a jump table entry, followed by the indirect
+ * branch to the loaded target. The table is found from the tracked base, its
+ * entries are read up to the first one which doesn't point into the same
+ * executable mapping as the first.
+ * The base is only a hint: the translated code checks the loaded target.
+ * @param jt Scan state, set to the found table.
+ * @param inst Instruction at \c read_address.
+ * @param read_address Address of the load.
+ * @return True if a table of at least JT_MIN_ENTRIES entries was found.
+ */
+static bool riscv_jump_table_find(riscv_jump_table *jt, riscv_instruction inst,
+	uint16_t *read_address)
+{
+	unsigned int rd, rs1, imm, imm2;
+	enum reg rb = x0;
+	uint16_t *next;
+	int entry_size;
+	interval_map_entry rodata, exec;
+
+#ifdef PLUGINS_NEW
+	// A plugin skipping the indirect branch would leave the entry address on the stack
+	if (global_data.free_plugin > 0)
+		return false;
+#endif
+
+	switch (inst) {
+	case RISCV_LW:
+	case RISCV_LD:
+		riscv_ld_decode_fields(read_address, &rd, &rs1, &imm);
+		if (imm != 0)
+			return false;
+		next = read_address + INST_32BIT / 2;
+		break;
+	case RISCV_C_LW:
+		riscv_c_lw_decode_fields(read_address, &rd, &rs1, &imm, &imm2);
+		if (imm != 0 || imm2 != 0)
+			return false;
+		rd += 8;
+		rs1 += 8;
+		next = read_address + INST_16BIT / 2;
+		break;
+	case RISCV_C_LD:
+		riscv_c_ld_decode_fields(read_address, &rd, &rs1, &imm, &imm2);
+		if (imm != 0 || imm2 != 0)
+			return false;
+		rd += 8;
+		rs1 += 8;
+		next = read_address + INST_16BIT / 2;
+		break;
+	default:
+		return false;
+	}
+	entry_size = (inst == RISCV_LW || inst == RISCV_C_LW) ? 4 : 8;
+
+	// C.JR ra is a return for the shadow return address stack, pushing rP moves sp
+	if (rd == x0 || rd == ra || rd == sp || rs1 == x0 || rs1 == sp)
+		return false;
+
+	// ADD rT, rT, rB
+	inst = riscv_decode(next);
+	if (inst == RISCV_ADD) {
+		uint32_t word = *(uint32_t *)next;
+		unsigned int add_rs1 = (word >> 15) & 0x1F;
+		unsigned int add_rs2 = (word >> 20) & 0x1F;
+		if (((word >> 7) & 0x1F) != rd || (add_rs1 != rd && add_rs2 != rd))
+			return false;
+		rb = (add_rs1 == rd) ? add_rs2 : add_rs1;
+		next += INST_32BIT / 2;
+	} else if (inst == RISCV_C_ADD) {
+		if (((*next >> 7) & 0x1F) != rd)
+			return false;
+		rb = (*next >> 2) & 0x1F;
+		next += INST_16BIT / 2;
+	}
+	if (rb != x0 && (rb != jt->base_reg || rb == rd || rb == sp))
+		return false;
+
+	// C.JR rT or JALR x0, 0(rT)
+	inst = riscv_decode(next);
+	if (inst == RISCV_C_JR) {
+		enum reg rs;
+		riscv_c_jr_decode_fields(next, &rs);
+		if (rs != rd)
+			return false;
+	} else if (inst == RISCV_JALR) {
+		enum reg jalr_rd, jalr_rs1;
+		unsigned int imm12;
+		riscv_jalr_decode_fields(next, &jalr_rd, &jalr_rs1, &imm12);
+		if (jalr_rd != x0 || jalr_rs1 != rd || imm12 != 0)
+			return false;
+	} else {
+		return false;
+	}
+
+	uintptr_t base = jt->base_value;
+	if (jt->base_reg == x0 || (base & (entry_size - 1)) != 0
+		|| interval_map_search_by_addr(&global_data.rodata_allocs, base, &rodata) != 1)
+		return false;
+
+	int entries = 0;
+	while (entries < JT_MAX_ENTRIES && base + (entries + 1) * entry_size <= rodata.end) {
+		uintptr_t target = riscv_jump_table_target(base, entries, entry_size, rb != x0);
+		if ((target & 1) != 0)
+			break;
+		if (entries == 0) {
+			if (interval_map_search_by_addr(&global_data.exec_allocs, target, &exec) != 1)
+				return false;
+		} else if (target < exec.start || target >= exec.end) {
+			break;
+		}
+		entries++;
+	}
+	if (entries < JT_MIN_ENTRIES)
+		return false;
+
+	jt->jr_address = next;
+	jt->rt = rd;
+	jt->rp = rs1;
+	jt->base = base;
+	jt->entries = entries;
+	jt->entry_size = entry_size;
+	jt->relative = (rb != x0);
+	return true;
+}
+
+/**
+ * Emit the lookup of the translated jump table of an indirect branch. The
+ * address of the loaded entry must have been pushed before its load. The
+ * table is indexed by this address and the entry is only used if its target
+ * is the loaded one, falls through to the indirect branch lookup otherwise.
+ * @param thread_data Thread data of current thread.
+ * @param basic_block Index of the basic block ending with the indirect branch.
+ * @param write_p Pointer to the writing location.
+ * @param jt Jump table found at the load.
+ */
+static void riscv_jump_table_lookup(dbm_thread *thread_data, int basic_block,
+	uint16_t **write_p, riscv_jump_table *jt)
+{
+	/*
+	 * 					+-------------------------------+
+	 * 					|	PUSH	x11, x12			|	(Pseudo instruction)
+	 * 					|	LD		x12, 16(sp)			|	x12 = address of the entry
+	 * 					|	SD		x10, 16(sp)			|	as PUSH x10, x11, x12
+	 * 					|	LI		x11, base			|
+	 * 					|	SUB		x12, x12, x11		|
+	 * 					|	LI		x11, size			|	entries * entry_size
+	 * 					|	BGEU	x12, x11, miss		|
+	 * 					|	SLLI	x12, x12, 2 or 1	|	16 byte translated entries
+	 * 					|	ANDI	x12, x12, -16		|
+	 * 					|	LI		x11, &table			|
+	 * 					|	C.ADD	x12, x11			|
+	 * 					|	LD		x11, 0(x12)			|	x11 = target of the entry
+	 * 				**	|	LD		x10, slot(sp)		|
+	 * 					|	BNE		x11, rT, miss		|	rT is x10 if reloaded
+	 * 					|	LD		x10, 8(x12)			|
+	 * 					|	C.BEQZ	x10, miss			|	translation not set yet
+	 * 					|	POP		x12					|	(Pseudo instruction)
+	 * 					|	C.JR	x10					|
+	 * 					| miss:							|
+	 * 					|	POP		x10, x11, x12		|	(Pseudo instruction)
+	 * 					+-------------------------------+
+	 *
+	 * ** if rT is x11 or x12, it's reloaded from the stack
+	 *
+	 * If the pool of the region is full, only "C.ADDI sp, 8" is emitted.
+	 *
+	 * [Size: 2-114 B]
+	 */
+	uint16_t *branch_out_of_range;
+	uint16_t *branch_mismatch;
+	uint16_t *branch_unset;
+	enum reg x_target = jt->rt;
+#ifdef DBM_CC_REGIONS
+	int pool = thread_data->cc_region;
+#else
+	int pool = 0;
+#endif
+
+	jt->jr_address = NULL;
+	if (thread_data->jump_table_free[pool] + jt->entries > JT_POOL_SIZE) {
+		// C.ADDI sp, 8
+		riscv_c_addi(write_p, sp, 0, 8);
+		(*write_p)++;
+		return;
+	}
+
+	if (thread_data->jump_tables == NULL)
+		thread_data->jump_tables = thread_array_alloc(NULL,
+			sizeof(jump_table_entry) * JT_POOL_NO * JT_POOL_SIZE);
+	jump_table_entry *table = &thread_data->jump_tables[pool][thread_data->jump_table_free[pool]];
+	thread_data->jump_table_free[pool] += jt->entries;
+	for (int i = 0; i < jt->entries; i++) {
+		table[i].tpc = 0;
+		table[i].spc = riscv_jump_table_target(jt->base, i, jt->entry_size, jt->relative);
+	}
+	thread_data->code_cache_meta[basic_block].jump_table = table;
+	thread_data->code_cache_meta[basic_block].jump_table_size = jt->entries;
+
+	// PUSH x11, x12
+	riscv_save_regs(write_p, (m_x11 | m_x12));
+	// LD x12, 16(sp)
+	riscv_ld(write_p, x12, sp, 16);
+	*write_p += 2;
+	// SD x10, 16(sp)
+	riscv_sd(write_p, x10, sp, 0, 16);
+	*write_p += 2;
+
+	// LI x11, base
+	riscv_copy_to_reg_64bits(write_p, x11, jt->base);
+	// SUB x12, x12, x11
+	riscv_sub(write_p, x12, x12, x11);
+	*write_p += 2;
+	// LI x11, size
+	riscv_copy_to_reg_32bits(write_p, x11, jt->entries * jt->entry_size);
+	// BGEU x12, x11, miss (added later)
+	branch_out_of_range = *write_p;
+	*write_p += 2;
+
+	// SLLI x12, x12, 2 or 1
+	riscv_slli(write_p, x12, x12, (jt->entry_size == 4) ? 2 : 1);
+	*write_p += 2;
+	// ANDI x12, x12, -16
+	riscv_andi(write_p, x12, x12, -(int)sizeof(jump_table_entry) & 0xFFF);
+	*write_p += 2;
+	// LI x11, &table
+	riscv_copy_to_reg_64bits(write_p, x11, (uintptr_t)table);
+	// C.ADD x12, x11
+	riscv_c_add(write_p, x12, x11);
+	(*write_p)++;
+
+	// LD x11, 0(x12)
+	riscv_ld(write_p, x11, x12, offsetof(jump_table_entry, spc));
+	*write_p += 2;
+	if (jt->rt == x11 || jt->rt == x12) {
+		// LD x10, slot(sp)
+		riscv_ld(write_p, x10, sp, (jt->rt == x11) ? 8 : 0);
+		*write_p += 2;
+		x_target = x10;
+	}
+	// BNE x11, rT, miss (added later)
+	branch_mismatch = *write_p;
+	*write_p += 2;
+
+	// LD x10, 8(x12)
+	riscv_ld(write_p, x10, x12, offsetof(jump_table_entry, tpc));
+	*write_p += 2;
+	// C.BEQZ x10, miss (added later)
+	branch_unset = (*write_p)++;
+	// POP x12
+	riscv_pop_helper(write_p, x12);
+	// C.JR x10
+	riscv_c_jr(write_p, x10);
+	(*write_p)++;
+
+	// miss:
+	{
+		mambo_cond cond = {x12, x11, GEU};
+		riscv_b_cond_helper(&branch_out_of_range, (uint64_t)*write_p, &cond);
+	}
+	{
+		mambo_cond cond = {x11, x_target, NE};
+		riscv_b_cond_helper(&branch_mismatch, (uint64_t)*write_p, &cond);
+	}
+	riscv_bez_helper(&branch_unset, x10, (uint64_t)*write_p);
+
+	// POP x10, x11, x12
+	riscv_restore_regs(write_p, (m_x10 | m_x11 | m_x12));
+}
+#endif
+
+#ifdef DBM_LINK_PLT
+/**
+ * Check if an AUIPC starts a call through a pointer in memory, the code of a
+ * PLT stub, with the pointer already set to executable code:
+ * 	AUIPC	rX, hi
+ * 	LD		rX, lo(rX)		load the GOT slot
+ * 	JALR	rL, 0(rX)
+ * A lazily bound GOT slot pointing to the PLT header isn't resolved yet.
+ * @param read_address Address of the AUIPC.
+ * @param target Set to the current value of the pointer.
+ * @return Address of the JALR or NULL.
+ */
+static uint16_t *riscv_plt_find(uint16_t *read_address, uintptr_t *target)
+{
+	enum reg rx, jalr_rd, jalr_rs1;
+	unsigned int imm, rd, rs1, ld_imm, imm12;
+	interval_map_entry exec;
+	uint16_t *ld = read_address + INST_32BIT / 2;
+	uint16_t *jalr = ld + INST_32BIT / 2;
+
+	if (riscv_decode(ld) != RISCV_LD || riscv_decode(jalr) != RISCV_JALR)
+		return NULL;
+
+	riscv_auipc_decode_fields(read_address, &rx, &imm);
+	riscv_ld_decode_fields(ld, &rd, &rs1, &ld_imm);
+	riscv_jalr_decode_fields(jalr, &jalr_rd, &jalr_rs1, &imm12);
+	if (rx == x0 || rd != rx || rs1 != rx || jalr_rs1 != rx || imm12 != 0)
+		return NULL;
+
+	uintptr_t got = (uintptr_t)read_address + sign_extend64(32, imm << 12)
+		+ sign_extend64(12, ld_imm);
+	if ((got & 7) != 0)
+		return NULL;
+	*target = *(uintptr_t *)got;
+	if ((*target & 1) != 0
+		|| interval_map_search_by_addr(&global_data.exec_allocs, *target, &exec) != 1)
+		return NULL;
+
+	// The PLT header starts with AUIPC t2, %pcrel_hi(.got.plt)
+	if (riscv_decode((uint16_t *)*target) == RISCV_AUIPC) {
+		riscv_auipc_decode_fields((uint16_t *)*target, &rx, &imm);
+		if (rx == x7)
+			return NULL;
+	}
+	return jalr;
+}
+
+/**
+ * Emit the exit of a fragment ending with the JALR of a PLT stub. If the
+ * loaded target is the one found by riscv_plt_find(), the exit is a direct
+ * branch to it, linked by the dispatcher. Other targets are looked up in the
+ * hash table without linking.
+ * @param thread_data Thread data of current thread.
+ * @param basic_block Index of the basic block.
+ * @param write_p Pointer to the writing location.
+ * @param read_address Address of the JALR.
+ * @param rn Register containing the loaded target.
+ * @param link Link register of the JALR.
+ * @param target Target found when scanning the stub.
+ */
+static void riscv_plt_exit(dbm_thread *thread_data, int basic_block, uint16_t **write_p,
+	uint16_t *read_address, enum reg rn, enum reg link, uintptr_t target)
+{
+	/*
+	 * 					+-------------------------------+
+	 * 				**	|	LI		link, read_address+4|
+	 * 				##	|	PUSH	x_tmp				|	(Pseudo instruction)
+	 * 					|	LI		x_tmp, target		|
+	 * 					|	BNE		x_tmp, rn, miss		|
+	 * 				##	|	POP		x_tmp				|	(Pseudo instruction)
+	 * 				$$	|	LI		link, read_address+4|
+	 * 					|	NOP							|	linked to the target block
+	 * 					|	PUSH	x10, x11, x12		|	(Pseudo instruction)
+	 * 					|	(riscv_branch_jump)			|	dispatcher: target
+	 * 					| miss:							|
+	 * 				##	|	POP		x_tmp				|	(Pseudo instruction)
+	 * 					|	(riscv_inline_hash_lookup)	|	with source_index 0
+	 * 					+-------------------------------+
+	 *
+	 * x_tmp is the link register if it isn't x0 or rn, it's dead before the jump
+	 * writes it. The lookup of the miss then sets it.
+	 * ** if link isn't x0 or x_tmp
+	 * ## if x_tmp isn't the link register
+	 * $$ if x_tmp is the link register
+	 *
+	 * [Size: at most 120 B, without the inline hash lookup]
+	 */
+	uint16_t *branch_to_miss;
+	bool link_tmp = (link != x0 && link != rn);
+	enum reg x_tmp = link_tmp ? link : ((rn == x10) ? x11 : x10);
+
+	if (link != x0 && !link_tmp)
+		// LI link, read_address+4
+		riscv_copy_to_reg_64bits(write_p, link, (uint64_t)read_address + INST_32BIT);
+
+	if (!link_tmp)
+		// PUSH x_tmp
+		riscv_push_helper(write_p, x_tmp);
+	// LI x_tmp, target
+	riscv_copy_to_reg_64bits(write_p, x_tmp, target);
+	// BNE x_tmp, rn, miss (added later)
+	branch_to_miss = *write_p;
+	*write_p += 2;
+	if (link_tmp)
+		// LI link, read_address+4
+		riscv_copy_to_reg_64bits(write_p, link, (uint64_t)read_address + INST_32BIT);
+	else
+		// POP x_tmp
+		riscv_pop_helper(write_p, x_tmp);
+
+	thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_riscv;
+	thread_data->code_cache_meta[basic_block].exit_branch_addr = *write_p;
+	thread_data->code_cache_meta[basic_block].branch_taken_addr = target;
+	*(uint32_t *)*write_p = NOP_INSTRUCTION; // Reserves space for linking branch.
+	*write_p += 2;
+	riscv_save_regs(write_p, (m_x10 | m_x11 | m_x12));
+	riscv_branch_jump(thread_data, write_p, basic_block, target,
+		(REPLACE_TARGET | INSERT_BRANCH));
+
+	// miss:
+	{
+		mambo_cond cond = {x_tmp, rn, NE};
+		riscv_b_cond_helper(&branch_to_miss, (uint64_t)*write_p, &cond);
+	}
+	if (!link_tmp)
+		// POP x_tmp
+		riscv_pop_helper(write_p, x_tmp);
+
+	// The dispatcher must not link the exit to another target
+	riscv_inline_hash_lookup(thread_data, 0, write_p, read_address, rn, 0,
+		link_tmp ? link : x0, false, INST_32BIT);
+}
+#endif
+
 void riscv_inline_hash_lookup(dbm_thread *thread_data, int basic_block,
 	uint16_t **write_p, uint16_t *read_address, enum reg rn, uint32_t offset, 
 	enum reg link, bool set_meta, int len)
@@ -704,84 +1849,220 @@ void riscv_inline_hash_lookup(dbm_thread *thread_data, int basic_block,
 	 * Indirect Branch Lookup
 	 * 
 	 * 					+-------------------------------+
-	 * 					|	PUSH	x10, x11, x12		|	(Pseudo instruction)
-	 * 				**	|	ADDI	x11, rn, offset		|	x11 = rn + offset
+	 * 				!!	|	PUSH	x10, x11, x12		|	(Pseudo instruction)
+	 * 				&&	|	(riscv_ras_pop)				|
+	 * 				**	|	ADDI	x_spc, rn, offset	|	x_spc = rn + offset
 	 * 				##	|	LI		link, read_address+len	len is 2 or 4
-	 * 					|	LI		x10, &hash_table	|
-	 * 					|	LI		x_tmp, HASH_MASK<<1	|	HASH_MASK = 0x7FFFF
-	 * 					|	AND		x_tmp, x_tmp, rn	|
-	 * 					|	C.SLLI	x_tmp, 3			|	SLL 3 + SLL 1 (from mask)
-	 * 					|	C.ADD	x10, x_tmp			|		= SLL 4 for 16 byte
+	 * 				$$	|	(riscv_ras_push)			|
+	 * 				@@	|	(riscv_ibtc_lookup)			|
+	 * 				^^	|	PUSH	x13					|	if x12 isn't free
+	 * 					|	LI		x_tmp, HASH_MULT	|
+	 * 					|	MUL		x_tmp, x_tmp, rn	|
+	 * 					|	SRLI	x_tmp, x_tmp, 28	|	SRL 32 - SLL 4 for 16 byte
 	 * 					|								|		struct size
+	 * 					|	LI		x10, &entries		|	(literal)
+	 * 				^^	|	LD		x_seq, -16(x10)		|	x_seq = seq
+	 * 					|	LD		x10, -8(x10)		|	x10 = index_mask, changes
+	 * 					|	AND		x_tmp, x_tmp, x10	|		when the table grows
+	 * 				^^	|	ANDI	x10, x_seq, 1		|
+	 * 				^^	|	C.BNEZ	x10, seq_miss		|	table being modified
+	 * 				^^	|	FENCE	r, r				|
+	 * 					|	AUIPC	x10, 0				|	reload &entries from the
+	 * 					|	LD		x10, literal(x10)	|		literal
+	 * 					|	C.ADD	x10, x_tmp			|
 	 * 					| lin_probing:					|
 	 * 					|	C.LD	x_tmp, 0(x10)		|
 	 * 					|	C.ADDI	x10, 16				|
-	 * 					|	C.BEQZ	x_tmp, not_found	|
+	 * 					|	C.BEQZ	x_tmp, seq_miss		|
 	 * 					|	BNE		x_tmp, rn, lin_probing
 	 * 					|	LD		x10, -8(x10)		|	load code_cache_address
-	 * 					|	POP		x12					|	(Pseudo instruction)
+	 * 				^^	|	FENCE	r, r				|
+	 * 				^^	|	AUIPC	x_tmp, 0			|
+	 * 				^^	|	LD		x_tmp, literal(x_tmp)
+	 * 				^^	|	LD		x_tmp, -16(x_tmp)	|
+	 * 				^^	|	BNE		x_tmp, x_seq, seq_miss	the entry may have moved
+	 * 				^^	|	POP		x13					|	if pushed
+	 * 				%%	|	SRLI	x_tmp, x10, 48		|	x_tmp = entry epoch
+	 * 				%%	|	ADDI	x_tmp, x_tmp, -epoch|
+	 * 				%%	|	C.BNEZ	x_tmp, not_found	|	stale entry
+	 * 				%%	|	SLLI	x10, x10, 16		|	clear entry epoch
+	 * 				%%	|	SRLI	x10, x10, 16		|
+	 * 				++	|	LI		link, read_address+len
+	 * 				!!	|	POP		x12					|	(Pseudo instruction)
 	 * 					|	C.JR	x10					|
 	 * 					|								|
+	 * 					| seq_miss:						|
+	 * 				^^	|	POP		x13					|	if pushed
 	 * 					| not_found:					|
-	 * 					|	C.MV	x10, rn				|	dispatcher: target
+	 * 					|	C.MV	x10, x_spc			|	dispatcher: target
+	 * 				++	|	LI		link, read_address+len
+	 * 				!!	|	PUSH	x12					|	if it wasn't pushed above
 	 * 					|	LI		x11, basic_block	|	dispatcher: source_index
 	 * 					|	J		DISPATCHER			|	Large jump
 	 * 					+-------------------------------+
 	 * 
 	 * ** if rn is x10, x11, or return address register (if JALR or C.JALR), 
-	 * 	  or offset != 0
-	 * ## for JALR or C.JALR
+	 * 	  or offset != 0. x_spc is the link register if it isn't rn and there is
+	 * 	  no inline target cache, x11 otherwise, and rn otherwise.
+	 * ## for JALR or C.JALR, unless x_spc is the link register
+	 * ++ if x_spc is the link register, it's dead before the jump writes it
+	 * !! x12 is pushed at the start if the lookup uses it (x_tmp, x_seq, the
+	 *    shadow return address stack or the inline target cache), the hits
+	 *    then pop it. Otherwise it's only pushed for the dispatcher.
+	 * %% if the hash table has been flushed (epoch != 0), code emitted before
+	 *    a flush is never executed after it
+	 * && with DBM_RAS, for returns (JALR x0, 0(ra) or C.JR ra)
+	 * $$ with DBM_RAS, if link is the return address register
+	 * @@ with DBM_IBTC, except for returns. The miss of its last way jumps to
+	 *    not_found while the way is free, so the dispatcher can fill it.
+	 * ^^ with HASH_SEQLOCK, the entries can be moved by another thread. x_seq
+	 *    is x12 if it's free, x13 otherwise.
 	 * 
-	 * [Size: 80-104 B]
+	 * [Size: 102-160 B, 136-194 B with HASH_SEQLOCK, without the shadow return
+	 *  address stack and the inline target cache]
 	 */
 
 	uint16_t *lin_probing;
+	uint16_t *entries_literal;
+	int literal_offset;
 	uint16_t *branch_to_not_found;
+	uint16_t *branch_stale = NULL;
+	uint16_t *branch_ibtc_free = NULL;
 	enum reg x_spc, x_tmp;
+	bool copy_spc = true;
 	bool use_x12 = false;
+	bool late_link = false;
+#if defined(DBM_RAS) || defined(DBM_IBTC)
+	bool returns = (rn == x1 && offset == 0 && link == x0);
+#endif
+	bool ibtc = false;
+#ifdef DBM_IBTC
+	ibtc = set_meta && !returns;
+#endif
+#ifdef HASH_SEQLOCK
+	uint16_t *branch_seq_busy;
+	uint16_t *branch_seq_changed;
+	enum reg x_seq;
+	int seq_offset = (int)(offsetof(hash_table, seq) - offsetof(hash_table, entries));
+#endif
 
 	if ((rn == x10) || (rn == x11) || (rn == link) || offset != 0) {
-		x_spc = x11;
-		x_tmp = x12;
-		use_x12 = true;
+		if (link != x0 && link != rn && !ibtc) {
+			/* The link register is written by the jump, it holds the target
+			   until the lookup leaves and x12 stays free */
+			x_spc = link;
+			x_tmp = x11;
+			late_link = true;
+		} else {
+			x_spc = x11;
+			x_tmp = x12;
+			use_x12 = true;
+		}
 	} else {
 		x_spc = rn;
 		x_tmp = x11;
+		copy_spc = false;
 	}
 
+	/* x12 is only saved on the way to the dispatcher if the lookup doesn't use
+	   it, the stack is then the same as after PUSH x10, x11, x12 */
+	bool save_x12 = use_x12 || ibtc;
+#ifdef HASH_SEQLOCK
+	save_x12 = true;
+#endif
+#ifdef DBM_RAS
+	save_x12 = save_x12 || (set_meta && returns);
+#endif
+
 	if (set_meta) {
 		thread_data->code_cache_meta[basic_block].rn = x_spc;
 	}
 
 	// PUSH x10, x11, x12
-	riscv_save_regs(write_p, (m_x10 | m_x11 | m_x12));
+	riscv_save_regs(write_p, save_x12 ? (m_x10 | m_x11 | m_x12) : (m_x10 | m_x11));
+
+#ifdef DBM_RAS
+	// Returns are predicted by the shadow return address stack
+	if (set_meta && returns)
+		riscv_ras_pop(thread_data, write_p, x_spc);
+#endif
 
-	if (use_x12) {
-		//ADDI x11, rn, offset
+	if (copy_spc) {
+		//ADDI x_spc, rn, offset
 		riscv_addi(write_p, x_spc, rn, offset);
 		*write_p += 2;
 	}
 
-	if (link)
+	if (link && !late_link)
 		//LI link, read_address+len
 		riscv_copy_to_reg_64bits(write_p, link, (uint64_t)read_address + len);
-	
-	// LI x10, &hash_table
-	riscv_copy_to_reg_64bits(write_p, x10, 
-		(uint64_t)&thread_data->entry_address.entries);
 
-	// LI x_tmp, HASH_MASK << 1
-	/* Hash mask shifted here because of 16 bit alignment making the least segnificant
-	 * bit always 0.
-	 */
-	riscv_copy_to_reg_32bits(write_p, x_tmp, CODE_CACHE_HASH_SIZE << 1);
-	// AND x_tmp, x_tmp, rn
-	riscv_and(write_p, x_tmp, x_tmp, x_spc);
+#ifdef DBM_RAS
+	if (set_meta && link == x1)
+		riscv_ras_push(thread_data, basic_block, write_p, (uintptr_t)read_address + len,
+			x10, x_tmp);
+#endif
+
+#ifdef DBM_IBTC
+	// Returns are megamorphic, they are only looked up in the hash table
+	if (ibtc)
+		branch_ibtc_free = riscv_ibtc_lookup(thread_data, basic_block, write_p, x_spc, x_tmp);
+#endif
+
+#ifdef HASH_SEQLOCK
+	bool seq_x13 = (x_spc == x12 || x_tmp == x12);
+	if (seq_x13) {
+		x_seq = x13;
+		// PUSH x13
+		riscv_push_helper(write_p, x13);
+	} else {
+		x_seq = x12;
+	}
+#endif
+
+	// LI x_tmp, HASH_MULT
+	riscv_copy_to_reg_32bits(write_p, x_tmp, HASH_MULT);
+	// MUL x_tmp, x_tmp, rn
+	riscv_mul(write_p, x_tmp, x_tmp, x_spc);
+	*write_p += 2;
+	// SRLI x_tmp, x_tmp, HASH_MULT_SHIFT - 4
+	riscv_srli(write_p, x_tmp, x_tmp, HASH_MULT_SHIFT - 4);
 	*write_p += 2;
 
-	// C.SLLI x_tmp, 3
-	riscv_c_slli(write_p, x_tmp, 0, 3);
-	(*write_p)++;
+	// LI x10, &entries
+	entries_literal = *write_p + 1;
+	riscv_copy_to_reg_64bits(write_p, x10, 
+		(uint64_t)thread_data->entry_address->entries);
+#ifdef HASH_SEQLOCK
+	// LD x_seq, -16(x10)
+	riscv_ld(write_p, x_seq, x10, seq_offset);
+	*write_p += 2;
+#endif
+	// LD x10, -8(x10)
+	riscv_ld(write_p, x10, x10, (int)(offsetof(hash_table, index_mask)
+		- offsetof(hash_table, entries)));
+	*write_p += 2;
+	// AND x_tmp, x_tmp, x10
+	riscv_and(write_p, x_tmp, x_tmp, x10);
+	*write_p += 2;
+#ifdef HASH_SEQLOCK
+	// ANDI x10, x_seq, 1
+	riscv_andi(write_p, x10, x_seq, 1);
+	*write_p += 2;
+	// C.BNEZ x10, seq_miss (added later)
+	branch_seq_busy = (*write_p)++;
+	// FENCE r, r
+	**(uint32_t **)write_p = FENCE_R_R_INSTRUCTION;
+	*write_p += 2;
+#endif
+
+	// AUIPC x10, 0
+	literal_offset = (uint64_t)entries_literal - (uint64_t)*write_p;
+	riscv_auipc(write_p, x10, 0);
+	*write_p += 2;
+	// LD x10, literal(x10)
+	riscv_ld(write_p, x10, x10, literal_offset);
+	*write_p += 2;
 	// C.ADD x10, x_tmp
 	riscv_c_add(write_p, x10, x_tmp);
 	(*write_p)++;
@@ -809,20 +2090,97 @@ void riscv_inline_hash_lookup(dbm_thread *thread_data, int basic_block,
 	riscv_ld(write_p, x10, x10, -8);
 	*write_p += 2;
 
-	// POP x12
-	riscv_pop_helper(write_p, x12);
+#ifdef HASH_SEQLOCK
+	// FENCE r, r
+	**(uint32_t **)write_p = FENCE_R_R_INSTRUCTION;
+	*write_p += 2;
+	// AUIPC x_tmp, 0
+	literal_offset = (uint64_t)entries_literal - (uint64_t)*write_p;
+	riscv_auipc(write_p, x_tmp, 0);
+	*write_p += 2;
+	// LD x_tmp, literal(x_tmp)
+	riscv_ld(write_p, x_tmp, x_tmp, literal_offset);
+	*write_p += 2;
+	// LD x_tmp, -16(x_tmp)
+	riscv_ld(write_p, x_tmp, x_tmp, seq_offset);
+	*write_p += 2;
+	// BNE x_tmp, x_seq, seq_miss (added later)
+	branch_seq_changed = *write_p;
+	*write_p += 2;
+	if (seq_x13)
+		// POP x13
+		riscv_pop_helper(write_p, x13);
+#endif
+
+#ifdef HASH_EPOCHS
+	if (thread_data->entry_address->epoch != 0) {
+		// SRLI x_tmp, x10, HASH_EPOCH_SHIFT
+		riscv_srli(write_p, x_tmp, x10, HASH_EPOCH_SHIFT);
+		*write_p += 2;
+		// ADDI x_tmp, x_tmp, -epoch
+		riscv_addi(write_p, x_tmp, x_tmp, (-thread_data->entry_address->epoch) & 0xFFF);
+		*write_p += 2;
+		// C.BNEZ x_tmp, not_found (added later)
+		branch_stale = (*write_p)++;
+		// SLLI x10, x10, 64 - HASH_EPOCH_SHIFT
+		riscv_slli(write_p, x10, x10, 64 - HASH_EPOCH_SHIFT);
+		*write_p += 2;
+		// SRLI x10, x10, 64 - HASH_EPOCH_SHIFT
+		riscv_srli(write_p, x10, x10, 64 - HASH_EPOCH_SHIFT);
+		*write_p += 2;
+	}
+#endif
+
+	if (late_link)
+		//LI link, read_address+len
+		riscv_copy_to_reg_64bits(write_p, link, (uint64_t)read_address + len);
+
+	if (save_x12)
+		// POP x12
+		riscv_pop_helper(write_p, x12);
 	
 	// C.JR x10
 	riscv_c_jr(write_p, x10);
 	(*write_p)++;
 
+#ifdef HASH_SEQLOCK
+	// seq_miss:
+	// Insert "C.BNEZ x10, seq_miss" at branch_seq_busy (above)
+	riscv_bnez_helper(&branch_seq_busy, x10, (uint64_t)(*write_p));
+	// Insert "BNE x_tmp, x_seq, seq_miss" at branch_seq_changed (above)
+	{
+		mambo_cond cond = {x_tmp, x_seq, NE};
+		riscv_b_cond_helper(&branch_seq_changed, (uint64_t)(*write_p), &cond);
+	}
+	// Insert "C.BEQZ x_tmp, seq_miss" at branch_to_not_found (above)
+	riscv_bez_helper(&branch_to_not_found, x_tmp, (uint64_t)(*write_p));
+	if (seq_x13)
+		// POP x13
+		riscv_pop_helper(write_p, x13);
+#else
 	// Insert "C.BEQZ x_tmp, not_found" at branch_to_not_found (above)
 	riscv_bez_helper(&branch_to_not_found, x_tmp, (uint64_t)(*write_p));
+#endif
+	// not_found:
+	if (branch_stale != NULL)
+		// Insert "C.BNEZ x_tmp, not_found" at branch_stale (above)
+		riscv_bnez_helper(&branch_stale, x_tmp, (uint64_t)(*write_p));
+	if (branch_ibtc_free != NULL)
+		// Insert "C.BEQZ x_tmp, not_found" at branch_ibtc_free (above)
+		riscv_bez_helper(&branch_ibtc_free, x_tmp, (uint64_t)(*write_p));
 
 	// C.MV x10, rn
 	riscv_c_mv(write_p, x10, x_spc);
 	(*write_p)++;
 
+	if (late_link)
+		//LI link, read_address+len
+		riscv_copy_to_reg_64bits(write_p, link, (uint64_t)read_address + len);
+
+	if (!save_x12)
+		// PUSH x12
+		riscv_push_helper(write_p, x12);
+
 	// LI x11, basic_block
 	riscv_copy_to_reg_32bits(write_p, x11, basic_block);
 
@@ -830,6 +2188,47 @@ void riscv_inline_hash_lookup(dbm_thread *thread_data, int basic_block,
 	riscv_large_jump_helper(write_p, (uint64_t)thread_data->dispatcher_addr, false, x12);
 }
 
+void riscv_encode_stub_bb(dbm_thread *thread_data, int basic_block, uintptr_t target)
+{
+	/*
+	 * Stub basic block, scanned in place when the dispatcher is called from it
+	 *					+-------------------------------+
+	 *					|	POP		x10, x11			|	(Pseudo instruction)
+	 *					|	PUSH	x10, x11, x12		|	(Pseudo instruction)
+	 *					|	LI		x10, target			|	dispatcher: target
+	 *					|	LI		x11, basic_block	|	dispatcher: source_index
+	 *					|	J		DISPATCHER			|	Large jump
+	 *					+-------------------------------+
+	 *
+	 * Exits linked to the stub jump over the pops like for any other fragment.
+	 *
+	 * [Size: 36-50 B, STUB_BB_SIZE B are reserved]
+	 */
+	uint16_t *write_p = (uint16_t *)cc_bb_addr(thread_data, basic_block);
+	uint16_t *start_address = write_p;
+	dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[basic_block];
+
+	debug("Stub BB: %p\n", write_p);
+	debug("RISC-V stub target: 0x%lx\n", target);
+
+	bb_meta->source_addr = (uint16_t *)target;
+	// Nothing is translated yet, invalidations of the target don't concern the stub
+	bb_meta->source_start = (uint16_t *)target;
+	bb_meta->source_end = (uint16_t *)target;
+	bb_meta->tpc = (uintptr_t)start_address;
+	bb_meta->exit_branch_addr = start_address;
+
+	riscv_restore_regs(&write_p, (m_x10 | m_x11));
+	riscv_save_regs(&write_p, (m_x10 | m_x11 | m_x12));
+	riscv_branch_jump(thread_data, &write_p, basic_block, target,
+		(REPLACE_TARGET | INSERT_BRANCH));
+	assert((uintptr_t)write_p - (uintptr_t)start_address <= STUB_BB_SIZE);
+
+#ifdef DBM_VAR_SIZE_BB
+	trim_bb(thread_data, (uintptr_t)start_address + STUB_BB_SIZE);
+#endif
+}
+
 size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_block,
 	cc_type type, uint16_t *write_p)
 {
@@ -837,17 +2236,33 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 	bool stop = false;
 	uint16_t *start_address;
 	uint16_t *data_p;
+	uint16_t *range_start = read_address;
+#ifdef DBM_INLINE_UNCOND_IMM
+	int inlined_count = 0;
+	int inlined_back_count = 0;
+	uintptr_t source_ranges[MAX_INLINE + 1][2];
+	int source_range_count = 0;
+#endif
+#ifdef DBM_JUMP_TABLES
+	riscv_jump_table jt = { .base_reg = x0, .jr_address = NULL };
+#endif
+#ifdef DBM_LINK_PLT
+	uint16_t *plt_jalr = NULL;
+	uintptr_t plt_target = 0;
+#endif
 
-	if (write_p == NULL) {
-		write_p = (uint16_t *) &thread_data->code_cache->blocks[basic_block];
+	bool in_cc = (write_p == NULL);
+	if (in_cc) {
+		write_p = (uint16_t *)cc_bb_addr(thread_data, basic_block);
 	}
 
 	start_address = write_p;
 
 	if (type == mambo_bb) {
-		data_p = write_p + BASIC_BLOCK_SIZE;
+		data_p = in_cc ? (uint16_t *)cc_bb_end(thread_data, basic_block)
+		               : write_p + BASIC_BLOCK_SIZE;
 	} else { // mambo_trace, mambo_trace_entry
-		data_p = (uint16_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE / 4);
+		data_p = (uint16_t *)&thread_data->code_cache->traces[TRACE_CACHE_SIZE];
 		thread_data->code_cache_meta[basic_block].free_b = 0;
 	}
 
@@ -874,13 +2289,16 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 		riscv_save_regs(&write_p, (m_x1 | m_x11));
 
 		riscv_copy_to_reg_32bits(&write_p, x11, (int)basic_block);
-		// TODO: [traces] Use large jump
-		riscv_branch_imm_helper(&write_p, thread_data->trace_head_incr_addr, true);
+		// The trampolines are out of JAL range of most basic blocks
+		riscv_large_jump_helper(&write_p, thread_data->trace_head_incr_addr, true, x1);
 
 		riscv_restore_regs(&write_p, (m_x1 | m_x11));
 	}
 #endif
 
+	// A fragment scanned in place of a stub starts with STUB_BB_SIZE B of space
+	riscv_check_free_space(thread_data, &write_p, &data_p, MIN_FSPACE, basic_block);
+
 	riscv_scanner_deliver_callbacks(thread_data, PRE_FRAGMENT_C, &read_address, -1,
 		&write_p, &data_p, basic_block, type, true, &stop);
 
@@ -889,7 +2307,11 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
 	while(!stop) {
 		debug("RV64 scan read_address: %p, w: : %p, bb: %d\n", read_address, write_p, basic_block);
+#ifdef DBM_DECODE_CACHE
+		riscv_instruction inst = riscv_decode_cached(thread_data, read_address);
+#else
 		riscv_instruction inst = riscv_decode(read_address);
+#endif
 		debug("  instruction enum: %d\n", (inst == RISCV_INVALID) ? -1 : inst);
 		if (inst >= 40)
 			debug("  instruction word: 0x%08x\n", *(uint32_t *)read_address);
@@ -903,6 +2325,14 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 		if (!skip_inst) {
 #endif
 
+#ifdef DBM_JUMP_TABLES
+		if (type == mambo_bb && riscv_jump_table_find(&jt, inst, read_address)) {
+			// PUSH rP, the lookup at the indirect branch indexes the table with it
+			riscv_push_helper(&write_p, jt.rp);
+		}
+		riscv_jump_table_track(&jt, inst, read_address);
+#endif
+
 		switch (inst) {
 		case RISCV_C_JAL:
 		case RISCV_C_J:
@@ -911,9 +2341,28 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 			//? Hash lookup could speed it up
 			enum reg x;
 			unsigned int rawimm;
-			uint64_t branch_offset;
 			uint64_t target;
-			int imm_size;
+
+#ifdef DBM_RAS
+			if (inst == RISCV_JAL)
+				riscv_jal_decode_fields(read_address, &x, &rawimm);
+			if ((inst == RISCV_JAL && x == x1) || inst == RISCV_C_JAL) {
+				// RAS push + PUSH/POP x10 + LI ra + exit
+				riscv_check_free_space(thread_data, &write_p, &data_p,
+					RAS_MAX_SIZE + 8 + 18 + MIN_FSPACE, basic_block);
+				/* ra is set by the call, the other temporary is a register
+				   written by the callee before being read if there is one */
+				enum reg x_tmp = riscv_dead_temp(riscv_dead_regs(
+					(uint16_t *)riscv_jump_target(inst, read_address)));
+				if (x_tmp == x0)
+					riscv_push_helper(&write_p, x10);
+				riscv_ras_push(thread_data, basic_block, &write_p, (uintptr_t)read_address
+					+ (inst == RISCV_JAL ? INST_32BIT : INST_16BIT), ra,
+					(x_tmp == x0) ? x10 : x_tmp);
+				if (x_tmp == x0)
+					riscv_pop_helper(&write_p, x10);
+			}
+#endif
 
 			if (inst == RISCV_JAL) {
 				riscv_jal_decode_fields(read_address, &x, &rawimm);
@@ -921,23 +2370,35 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 					riscv_copy_to_reg_64bits(&write_p, x, 
 						(uint64_t)read_address + INST_32BIT);
 				}
-				riscv_calc_j_imm(rawimm, &branch_offset);
-				imm_size = 21;
 			} else if (inst == RISCV_C_JAL) {
-				riscv_c_jal_decode_fields(read_address, &rawimm);
 				riscv_copy_to_reg_64bits(&write_p, ra, 
 					(uint64_t)read_address + INST_16BIT);
-				riscv_calc_cj_imm(rawimm, &branch_offset);
-				imm_size = 12;
-			} else { // RISCV_C_J
-				riscv_c_j_decode_fields(read_address, &rawimm);
-				riscv_calc_cj_imm(rawimm, &branch_offset);
-				imm_size = 12;
 			}
 
-			branch_offset = sign_extend64(imm_size, branch_offset);
-			debug("  Branch offset = 0x%x\n", branch_offset);
-			target = (uint64_t)read_address + branch_offset;
+			target = riscv_jump_target(inst, read_address);
+			debug("  Branch target = 0x%x\n", target);
+
+#ifdef DBM_INLINE_UNCOND_IMM
+			if (riscv_inline_uncond_imm(read_address, target, &inlined_count,
+				&inlined_back_count)) {
+				// Continue scanning at the target, which starts a new source range
+				riscv_add_source_range(source_ranges, &source_range_count,
+					(uintptr_t)range_start,
+					(uintptr_t)(read_address + riscv_get_inst_length(inst) / 2));
+				range_start = (uint16_t *)target;
+
+				riscv_scanner_deliver_callbacks(thread_data, POST_BB_C, &read_address,
+					-1, &write_p, &data_p, basic_block, type, false, &stop);
+				read_address = (uint16_t *)target;
+				riscv_scanner_deliver_callbacks(thread_data, PRE_BB_C, &read_address,
+					-1, &write_p, &data_p, basic_block, type, true, &stop);
+
+				// The read address is advanced past the jump at the end of the iteration
+				read_address -= riscv_get_inst_length(inst) / 2;
+				break;
+			}
+#endif
+
 #ifdef DBM_LINK_UNCOND_IMM
 			thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_riscv;
 			thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
@@ -1080,6 +2541,11 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
 			riscv_copy_to_reg_64bits(&write_p, rd, pc_rel_addr);
 			debug("AUIPC instrumented, continue scan.\n");
+
+#ifdef DBM_LINK_PLT
+			if (type == mambo_bb)
+				plt_jalr = riscv_plt_find(read_address, &plt_target);
+#endif
 			break;
 		}
 
@@ -1090,9 +2556,20 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 
 			riscv_jalr_decode_fields(read_address, &rd, &rs1, &imm12);
 
+#ifdef DBM_LINK_PLT
+			if (read_address == plt_jalr) {
+				riscv_check_free_space(thread_data, &write_p, &data_p,
+					PLT_EXIT_MAX_SIZE + IHL_MAX_SIZE, basic_block);
+				riscv_plt_exit(thread_data, basic_block, &write_p, read_address, rs1, rd,
+					plt_target);
+				stop = true;
+				break;
+			}
+#endif
+
 #ifdef DBM_INLINE_HASH
-			// Check for 104 bytes (worst case inline hash lookup)
-			riscv_check_free_space(thread_data, &write_p, &data_p, 104, basic_block);
+			riscv_check_free_space(thread_data, &write_p, &data_p,
+				IHL_MAX_SIZE + RAS_MAX_SIZE + IBTC_MAX_SIZE + JT_LOOKUP_MAX_SIZE, basic_block);
 #endif
 
 			thread_data->code_cache_meta[basic_block].exit_branch_type = 
@@ -1100,6 +2577,11 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 			thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
 			thread_data->code_cache_meta[basic_block].rn = rs1;
 
+#ifdef DBM_JUMP_TABLES
+			if (read_address == jt.jr_address)
+				riscv_jump_table_lookup(thread_data, basic_block, &write_p, &jt);
+#endif
+
 #ifndef DBM_INLINE_HASH
 			riscv_save_regs(&write_p, (m_x10 | m_x11 | m_x12));
 
@@ -1127,8 +2609,8 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 			riscv_c_jr_decode_fields(read_address, &rs1);
 
 #ifdef DBM_INLINE_HASH
-			// Check for 104 bytes (worst case inline hash lookup)
-			riscv_check_free_space(thread_data, &write_p, &data_p, 104, basic_block);
+			riscv_check_free_space(thread_data, &write_p, &data_p,
+				IHL_MAX_SIZE + RAS_MAX_SIZE + IBTC_MAX_SIZE + JT_LOOKUP_MAX_SIZE, basic_block);
 #endif
 
 			thread_data->code_cache_meta[basic_block].exit_branch_type = 
@@ -1136,6 +2618,11 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 			thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
 			thread_data->code_cache_meta[basic_block].rn = rs1;
 
+#ifdef DBM_JUMP_TABLES
+			if (read_address == jt.jr_address)
+				riscv_jump_table_lookup(thread_data, basic_block, &write_p, &jt);
+#endif
+
 #ifndef DBM_INLINE_HASH
 			riscv_save_regs(&write_p, (m_x10 | m_x11 | m_x12));
 
@@ -1514,6 +3001,27 @@ size_t scan_riscv(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 		read_address += riscv_get_inst_length(inst) / 2;
 	} // while(!stop)
 
+#ifdef DBM_INLINE_UNCOND_IMM
+	riscv_add_source_range(source_ranges, &source_range_count,
+		(uintptr_t)range_start, (uintptr_t)read_address);
+	thread_data->code_cache_meta[basic_block].source_start = (uint16_t *)source_ranges[0][0];
+	thread_data->code_cache_meta[basic_block].source_end = (uint16_t *)source_ranges[0][1];
+	for (int i = 1; i < source_range_count; i++) {
+		cc_add_source_range(thread_data, basic_block, source_ranges[i][0],
+			source_ranges[i][1]);
+	}
+#else
+	thread_data->code_cache_meta[basic_block].source_start = range_start;
+	thread_data->code_cache_meta[basic_block].source_end = read_address;
+#endif
+
+#ifdef DBM_VAR_SIZE_BB
+	// Return the unused part of the reservation to the allocator
+	if (type == mambo_bb && in_cc) {
+		trim_bb(thread_data, (uintptr_t)write_p);
+	}
+#endif
+
 	return ((write_p - start_address + 1) * sizeof(*write_p));
 }
 
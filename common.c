@@ -27,6 +27,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <ucontext.h>
 
@@ -42,108 +43,364 @@
 #endif
 
 /* Hash table */
+/* The table uses linear probing with robin hood ordering: the entries of a cluster
+   are kept sorted by their home index. This keeps the probe lengths short and even,
+   lets unsuccessful lookups stop early and allows deleting entries without tombstones,
+   by shifting the rest of the cluster back. To simplify the inline hash lookup code,
+   we avoid looping around for linear probing. A few slots are overprovisioned at the
+   end of the table and the last one is reserved empty to mark the end of the structure. */
+
+/* The writers hold the code cache lock, the lookups done by the translated code
+   don't. Moving an entry into a slot clears its key first and makes the value
+   visible before the new key, but a lookup which has already matched the old
+   key can still load the new value. With HASH_SEQLOCK, the lookups discard
+   the result if seq has changed meanwhile. */
+static inline void hash_write_begin(hash_table *table) {
+#ifdef HASH_SEQLOCK
+  table->seq++;
+  __sync_synchronize();
+#endif
+}
+
+static inline void hash_write_end(hash_table *table) {
+#ifdef HASH_SEQLOCK
+  __sync_synchronize();
+  table->seq++;
+#endif
+}
+
+static void hash_set_slot(hash_table *table, int index, uintptr_t key, uintptr_t value) {
+  table->entries[index].key = 0;
+  __sync_synchronize();
+  table->entries[index].value = value;
+  __sync_synchronize();
+  table->entries[index].key = key;
+}
+
+/* Removes the entry in a slot and moves the following entries of its cluster
+   back by one slot, unless they're already in their home slot */
+static void hash_remove_slot(hash_table *table, int index) {
+  int next = index + 1;
+  while (table->entries[next].key != 0 && GET_INDEX(table->entries[next].key) < next) {
+    hash_set_slot(table, index, table->entries[next].key, table->entries[next].value);
+    index = next++;
+  }
+  table->entries[index].key = 0;
+  table->count--;
+}
+
+/* Makes the first size slots accessible */
+static void hash_commit(hash_table *table, int size) {
+  size_t used = METADATA_SZ_ROUND(sizeof(hash_table) + sizeof(hash_entry) * size);
+  if (used > METADATA_SZ_ROUND(HASH_TABLE_MAX_SZ)) {
+    used = METADATA_SZ_ROUND(HASH_TABLE_MAX_SZ);
+  }
+  if (used > table->committed) {
+    int ret = mprotect((void *)table + table->committed, used - table->committed,
+                       PROT_READ | PROT_WRITE);
+    if (ret != 0) {
+      fprintf(stderr, "Growing the hash table failed\n");
+      while(1);
+    }
+    table->committed = used;
+  }
+}
+
+/* Reserves the address space of a table of the largest size, at addr if it's
+   not NULL. The slots are committed by hash_init() and hash_grow() as the
+   table reaches them. */
+hash_table *hash_alloc(void *addr) {
+  hash_table *table = mmap(addr, HASH_TABLE_MAX_SZ, PROT_NONE, METADATA_MMAP_OPTS, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "Allocating the hash table failed\n");
+    while(1);
+  }
+  size_t header = METADATA_SZ_ROUND(sizeof(hash_table));
+  int ret = mprotect(table, header, PROT_READ | PROT_WRITE);
+  if (ret != 0) {
+    fprintf(stderr, "Allocating the hash table failed\n");
+    while(1);
+  }
+  table->committed = header;
+  return table;
+}
+
+void hash_free(hash_table *table) {
+  int ret = munmap(table, METADATA_SZ_ROUND(HASH_TABLE_MAX_SZ));
+  assert(ret == 0);
+}
+
+static bool hash_insert(hash_table *table, uintptr_t key, uintptr_t value);
+
+#ifdef HASH_RESIZE
+/* Doubles the number of slots. The entries are moved out to a temporary buffer
+   and added back, concurrent lookups may miss in the meantime. */
+static void hash_grow(hash_table *table) {
+  int old_size = table->size;
+  int mask = table->size - CODE_CACHE_HASH_OVERP;
+  size_t buf_size = sizeof(hash_entry) * table->count;
+  hash_entry *buf = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    fprintf(stderr, "Failed to allocate the hash table resize buffer\n");
+    while(1);
+  }
+
+  // Stale entries are dropped
+  int count = 0;
+  for (int i = 0; i < old_size; i++) {
+    if (hash_entry_valid(table, i)) {
+      buf[count].key = table->entries[i].key;
+      buf[count].value = hash_entry_value(table, i);
+      count++;
+    }
+  }
+  for (int i = 0; i < old_size; i++) {
+    table->entries[i].key = 0;
+  }
+  __sync_synchronize();
+
+  hash_commit(table, mask * 2 + 1 + CODE_CACHE_HASH_OVERP);
+  table->size = mask * 2 + 1 + CODE_CACHE_HASH_OVERP;
+  table->index_mask = (mask * 2 + 1) * sizeof(hash_entry);
+  table->count = 0;
+#ifdef HASH_STATS
+  table->resizes++;
+#endif
+  debug("Hash table resized to %d slots\n", table->size);
+
+  for (int i = 0; i < count; i++) {
+    hash_insert(table, buf[i].key, buf[i].value);
+  }
+
+  int ret = munmap(buf, buf_size);
+  assert(ret == 0);
+}
+#endif
 
-// Breaks linear probing, don't use
 void hash_delete(hash_table *table, uintptr_t key) {
-  assert(false);
   int index = GET_INDEX(key);
-  int end = index - 1;
-  bool found = false;
-  uintptr_t c_key;
-  
-  do {
-    c_key = table->entries[index].key;
-    if (c_key == key) {
-      table->entries[index].key = 0;
-      found = true;
-    } else {
-      index = (index + 1) & table->size;
+
+  while (table->entries[index].key != 0) {
+    if (table->entries[index].key == key) {
+      hash_write_begin(table);
+      hash_remove_slot(table, index);
+      hash_write_end(table);
+      return;
     }
-  } while(!found && index != end && c_key != 0);
+    index++;
+  }
 }
 
-/* To simplify the inline hash lookup code, we avoid looping around for linear probing.
-   A few slots are overprovisioned at the end of the table and the last one is reserved
-   empty to mark the end of the structure. */
 uintptr_t hash_lookup(hash_table *table, uintptr_t key) {
-  int index = GET_INDEX(key);
-  bool found = false;
+  int home = GET_INDEX(key);
+  int index = home;
   uintptr_t entry = UINT_MAX;
   uintptr_t c_key;
-  
-  do {
-    c_key = table->entries[index].key;
+
+  while ((c_key = table->entries[index].key) != 0) {
     if (c_key == key) {
-      entry = table->entries[index].value;
-      found = true;
-    } else {
-      index++;
+      if (hash_entry_valid(table, index)) {
+        entry = hash_entry_value(table, index);
+      }
+      break;
     }
-  } while(!found && index < (table->size - 1) && c_key != 0);
-  
+    // The rest of the cluster belongs to later home slots
+    if (GET_INDEX(c_key) > home) break;
+    index++;
+  }
+
+#ifdef HASH_STATS
+  table->lookups++;
+  table->lookup_probes += index - home + 1;
+#endif
+
   return entry;
 }
 
+static bool hash_insert(hash_table *table, uintptr_t key, uintptr_t value) {
+#ifdef HASH_RESIZE
+  int mask = table->size - CODE_CACHE_HASH_OVERP;
+  if (table->count * 100 >= (mask + 1) * HASH_MAX_LOAD && mask < CODE_CACHE_HASH_SIZE) {
+    hash_grow(table);
+  }
+#endif
+
+  int home = GET_INDEX(key);
+  int index = home;
+  uintptr_t c_key;
+#ifdef HASH_EPOCHS
+  uintptr_t tagged_value = value | (table->epoch << HASH_EPOCH_SHIFT);
+#else
+  uintptr_t tagged_value = value;
+#endif
+
+  // Find the key, or the first entry with a later home slot
+  while ((c_key = table->entries[index].key) != 0) {
+    if (c_key == key) {
+      table->entries[index].value = tagged_value;
+      return true;
+    }
+    if (!hash_entry_valid(table, index)) {
+      hash_remove_slot(table, index);
+      continue;
+    }
+    if (GET_INDEX(c_key) > home) break;
+    index++;
+  }
+
+  int end = index;
+  while (table->entries[end].key != 0) {
+    end++;
+  }
+  if (end >= table->size - 1) {
+#ifdef HASH_RESIZE
+    if (mask < CODE_CACHE_HASH_SIZE) {
+      hash_grow(table);
+      return hash_insert(table, key, value);
+    }
+#endif
+    fprintf(stderr, "Hash table index overflow\n");
+    while(1);
+  }
+
+  // Make room, starting from the end so that the moved entries stay reachable
+  for (int i = end; i > index; i--) {
+    hash_set_slot(table, i, table->entries[i - 1].key, table->entries[i - 1].value);
+  }
+  hash_set_slot(table, index, key, tagged_value);
+  table->count++;
+  table->collisions += index - home;
+
+  return true;
+}
+
 bool hash_add(hash_table *table, uintptr_t key, uintptr_t value) {
-  int index = GET_INDEX(key);
-  int prev_index;
-  bool done = false;
-  
-  do {
-    if (table->entries[index].key == 0 || table->entries[index].key == key) {
-      if (table->entries[index].key == 0) {
-        table->count++;
-      }
-      table->entries[index].key = key;
-      table->entries[index].value = value;
-      done = true;
-    } else {
-      prev_index = index;
-      index++;
-      if (index >= table->size -1) {
-        fprintf(stderr, "Hash table index overflow\n");
-        while(1);
-      }
-      table->collisions++;
+  hash_write_begin(table);
+  bool ret = hash_insert(table, key, value);
+  hash_write_end(table);
+  return ret;
+}
+
+/* Removes all entries with a value in [start, end), and the stale ones */
+int hash_delete_values(hash_table *table, uintptr_t start, uintptr_t end) {
+  int deleted = 0;
+
+  hash_write_begin(table);
+  for (int i = 0; i < table->size - 1; i++) {
+    hash_entry *entry = &table->entries[i];
+    if (entry->key != 0 && (!hash_entry_valid(table, i)
+        || (hash_entry_value(table, i) >= start && hash_entry_value(table, i) < end))) {
+      hash_remove_slot(table, i);
+      deleted++;
+      // The next entry of the cluster may have been moved into slot i
+      i--;
     }
-  } while(!done && index < (table->size - 1));
-  
-  return done;
+  }
+  hash_write_end(table);
+
+  return deleted;
 }
 
 void hash_init(hash_table *table, int size) {
+  hash_commit(table, size);
+  // count tracks the used slots, so an empty table (e.g. fresh memory) isn't touched
+  if (table->count != 0) {
+    for (int i = table->size - 1; i >= 0; i--) {
+      table->entries[i].key = 0;
+    }
+  }
   table->size = size;
   table->collisions = 0;
   table->count = 0;
-  for (int i = size-1; i >= 0; i--) {
-    table->entries[i].key = 0;
+#ifdef HASH_EPOCHS
+  table->epoch = 0;
+#endif
+#ifdef HASH_RESIZE
+  table->index_mask = (size - CODE_CACHE_HASH_OVERP) * sizeof(hash_entry);
+#endif
+}
+
+/* Empties the table. With HASH_EPOCHS this takes constant time, except when
+   the epoch wraps around and the stale entries have to be cleared. */
+void hash_flush(hash_table *table) {
+  if (table->count == 0) {
+    return;
+  }
+#ifdef HASH_EPOCHS
+  if (table->epoch + 1 < HASH_EPOCH_NO) {
+    table->epoch++;
+    return;
   }
+#endif
+  hash_init(table, table->size);
 }
 
+#ifdef HASH_STATS
+/* Prints the probe lengths of successful lookups of the current entries, which
+   the inline lookups pay, and the average probe length of the lookups done by
+   the dispatcher */
+void hash_print_stats(hash_table *table) {
+  int entries = 0;
+  int max_probe = 0;
+  uint64_t probes = 0;
+  int histogram[5] = {0};
+
+  for (int i = 0; i < table->size - 1; i++) {
+    if (hash_entry_valid(table, i)) {
+      int probe = i - GET_INDEX(table->entries[i].key) + 1;
+      entries++;
+      probes += probe;
+      max_probe = max(max_probe, probe);
+      histogram[min(probe, 5) - 1]++;
+    }
+  }
+
+  fprintf(stderr, "Hash table: %d entries in %d slots, %d resizes\n",
+          entries, table->size - CODE_CACHE_HASH_OVERP + 1, table->resizes);
+  if (entries > 0) {
+    fprintf(stderr, "  probes per hit: avg %.2f, max %d, 1: %d, 2: %d, 3: %d, 4: %d, 5+: %d\n",
+            (double)probes / entries, max_probe, histogram[0], histogram[1], histogram[2],
+            histogram[3], histogram[4]);
+  }
+  if (table->lookups > 0) {
+    fprintf(stderr, "  dispatcher lookups: %" PRIu64 ", avg probes %.2f\n",
+            table->lookups, (double)table->lookup_probes / table->lookups);
+  }
+}
+#endif
+
 
 /* Linked list */
+/* The pool is handed out in order before reusing freed entries, so that only
+   the part of it which has been used is ever touched */
 void linked_list_init(ll *list, int size) {
   assert(size >= 1);
   list->size = size;
-  list->free_list = &list->pool[0];
-  
-  for (int i = 0; i < size-1; i++) {
-    list->pool[i].next = &list->pool[i+1];
-  }
-  
-  list->pool[size-1].next = NULL;
+  list->used = 0;
+  list->free_list = NULL;
 }
 
 ll_entry *linked_list_alloc(ll *list) {
-  if (list->free_list == NULL) return NULL;
-  
-  ll_entry *entry = list->free_list;
-  list->free_list = entry->next;
+  ll_entry *entry;
+
+  if (list->free_list != NULL) {
+    entry = list->free_list;
+    list->free_list = entry->next;
+  } else if (list->used < list->size) {
+    entry = &list->pool[list->used++];
+  } else {
+    return NULL;
+  }
   entry->next = NULL;
   
   return entry;
 }
 
+void linked_list_free(ll *list, ll_entry *entry) {
+  entry->next = list->free_list;
+  list->free_list = entry;
+}
+
 /* Interval map */
 /* Private interval_map functions; obtain lock before calling */
 void interval_map_print(interval_map *imap) {
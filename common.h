@@ -34,20 +34,64 @@
 #define GET_INDEX(key) ((key >> 2) & (table->size - CODE_CACHE_HASH_OVERP))
 #endif
 #ifdef DBM_ARCH_RISCV64
-// Key shifted only 1 position due to 16 bit alignment
-#define GET_INDEX(key) ((key >> 1) & (table->size - CODE_CACHE_HASH_OVERP))
+/* Multiplicative hashing, the index is taken from the middle of the product so
+   that the inline lookup can compute it with LUI/ADDI, MUL and SRLI */
+#define HASH_MULT 0x61C88647UL
+#define HASH_MULT_SHIFT 32
+#define GET_INDEX(key) ((((key) * HASH_MULT) >> HASH_MULT_SHIFT) & (table->size - CODE_CACHE_HASH_OVERP))
+/* The table starts with CODE_CACHE_HASH_INIT_SIZE + 1 slots and doubles, up to
+   CODE_CACHE_HASH_SIZE + 1, when more than HASH_MAX_LOAD percent of them are used
+   or when a cluster reaches the end of the table */
+#define HASH_RESIZE
+#define CODE_CACHE_HASH_INIT_SIZE 0xFFF
+#define HASH_MAX_LOAD 50
+/* The epoch of an entry is kept in the top bits of its value and entries of
+   older epochs are treated as empty, so hash_flush() only increments the epoch.
+   The inline lookup checks the epoch with a 12-bit immediate. */
+#define HASH_EPOCHS
+#define HASH_EPOCH_SHIFT 48
+#define HASH_EPOCH_NO 2048
+#define HASH_VALUE_MASK ((1UL << HASH_EPOCH_SHIFT) - 1)
+#if defined(DBM_SHARED_CC) || defined(DBM_SPEC_THREAD)
+/* The translated code looks up entries while another thread adds or removes
+   some under the code cache lock. seq is odd while entries are being moved,
+   the inline lookups which see it change take the slow path. */
+#define HASH_SEQLOCK
+#endif
+#else
+#define CODE_CACHE_HASH_INIT_SIZE CODE_CACHE_HASH_SIZE
 #endif
 typedef struct {
   uintptr_t key;
   uintptr_t value;
 } hash_entry;
 
+/* A table is a mapping of its own, see hash_alloc(). The inline lookups load
+   the fields before entries[] relative to it. */
 typedef struct {
   int size;
   int collisions;
-  int count;
-  hash_entry entries[CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP];
+  int count; // used slots, including the stale ones
+  size_t committed; // bytes of the mapping which are accessible, the rest is only reserved
+#ifdef HASH_EPOCHS
+  uintptr_t epoch;
+#endif
+#ifdef HASH_STATS
+  uint64_t lookups;
+  uint64_t lookup_probes;
+  int resizes;
+#endif
+#ifdef DBM_ARCH_RISCV64
+  uintptr_t seq; // incremented before and after each modification with HASH_SEQLOCK
+#endif
+#ifdef HASH_RESIZE
+  // (size - CODE_CACHE_HASH_OVERP) * sizeof(hash_entry), read by the inline lookup
+  uintptr_t index_mask;
+#endif
+  hash_entry entries[]; // up to CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP slots
 } hash_table;
+#define HASH_TABLE_MAX_SZ (sizeof(hash_table) \
+                           + sizeof(hash_entry) * (CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP))
 
 struct ll_entry_s {
   struct ll_entry_s *next;
@@ -58,6 +102,7 @@ typedef struct ll_entry_s ll_entry;
 typedef struct {
   ll_entry *free_list;
   int size;
+  int used; // entries of pool[] past this index have never been allocated
   ll_entry pool[];
 } ll;
 
@@ -76,11 +121,37 @@ typedef struct {
 
 bool hash_add(hash_table *table, uintptr_t key, uintptr_t value);
 void hash_delete(hash_table *table, uintptr_t key);
+int hash_delete_values(hash_table *table, uintptr_t start, uintptr_t end);
 uintptr_t hash_lookup(hash_table *table, uintptr_t key);
+hash_table *hash_alloc(void *addr);
+void hash_free(hash_table *table);
 void hash_init(hash_table *table, int size);
+void hash_flush(hash_table *table);
+#ifdef HASH_STATS
+void hash_print_stats(hash_table *table);
+#endif
+
+/* Returns true if the slot holds an entry of the current epoch */
+static inline bool hash_entry_valid(hash_table *table, int index) {
+#ifdef HASH_EPOCHS
+  return table->entries[index].key != 0
+         && (table->entries[index].value >> HASH_EPOCH_SHIFT) == table->epoch;
+#else
+  return table->entries[index].key != 0;
+#endif
+}
+
+static inline uintptr_t hash_entry_value(hash_table *table, int index) {
+#ifdef HASH_EPOCHS
+  return table->entries[index].value & HASH_VALUE_MASK;
+#else
+  return table->entries[index].value;
+#endif
+}
 
 void linked_list_init(ll *list, int size);
 ll_entry *linked_list_alloc(ll *list);
+void linked_list_free(ll *list, ll_entry *entry);
 
 int interval_map_init(interval_map *imap, ssize_t size);
 int interval_map_add(interval_map *imap, uintptr_t start, size_t len, int fd);
@@ -24,8 +24,10 @@
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <asm/unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -38,6 +40,10 @@
 
 #include "elf/elf_loader.h"
 
+#ifdef DBM_ARCH_RISCV64
+#include "arch/riscv/dispatcher_riscv.h"
+#endif
+
 #ifdef __arm__
 #include "pie/pie-thumb-decoder.h"
 #include "pie/pie-thumb-encoder.h"
@@ -68,37 +74,128 @@
   #define gp_tp_mambo_ctx_offset        ((uintptr_t)&gp_tp_mambo_ctx - (uintptr_t)&start_of_dispatcher_s)
   #define gp_shadow_offset              ((uintptr_t)&gp_shadow - (uintptr_t)&start_of_dispatcher_s)
   #define tp_shadow_offset              ((uintptr_t)&tp_shadow - (uintptr_t)&start_of_dispatcher_s)
+  #define trace_exec_count_offset       ((uintptr_t)&trace_exec_count - (uintptr_t)&start_of_dispatcher_s)
+  #define hash_entries_ptr_offset       ((uintptr_t)&hash_entries_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define hash_index_mask_ptr_offset    ((uintptr_t)&hash_index_mask_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define hash_epoch_ptr_offset         ((uintptr_t)&hash_epoch_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define hash_seq_ptr_offset           ((uintptr_t)&hash_seq_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define pending_inval_count_ptr_offset ((uintptr_t)&pending_inval_count_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define code_cache_meta_ptr_offset    ((uintptr_t)&code_cache_meta_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define code_cache_meta_size_offset   ((uintptr_t)&code_cache_meta_size - (uintptr_t)&start_of_dispatcher_s)
+  #define branch_status_ptr_offset      ((uintptr_t)&branch_status_ptr - (uintptr_t)&start_of_dispatcher_s)
+  #define exit_trampoline_offset        ((uintptr_t)exit_trampoline - (uintptr_t)&start_of_dispatcher_s)
 #endif
 
 uintptr_t page_size;
 dbm_global global_data;
 __thread dbm_thread *current_thread;
 
+/* The signal handlers take the locks of MAMBO, so signals are blocked while a
+   thread holds one. A signal taken in dispatcher() or scan() would otherwise
+   deadlock the thread on a lock it already holds. The blocks nest, the mask
+   of the outermost one is restored. */
+static __thread int signals_blocked;
+static __thread sigset_t unblocked_sigmask;
+
+static void block_signals() {
+  if (signals_blocked++ == 0) {
+    sigset_t all;
+    sigfillset(&all);
+    int ret = pthread_sigmask(SIG_SETMASK, &all, &unblocked_sigmask);
+    assert(ret == 0);
+  }
+}
+
+static void unblock_signals() {
+  assert(signals_blocked > 0);
+  if (--signals_blocked == 0) {
+    int ret = pthread_sigmask(SIG_SETMASK, &unblocked_sigmask, NULL);
+    assert(ret == 0);
+  }
+}
+
 void flush_code_cache(dbm_thread *thread_data) {
   thread_data->was_flushed = true;
   thread_data->free_block = trampolines_size_bbs;
-  hash_init(&thread_data->entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+#ifdef DBM_VAR_SIZE_BB
+  thread_data->free_addr = (uintptr_t)&thread_data->code_cache->blocks[trampolines_size_bbs];
+  for (int i = 0; i < trampolines_size_bbs; i++) {
+    thread_data->bb_offset[i] = i * sizeof(dbm_block);
+  }
+#endif
+#ifdef DBM_CC_REGIONS
+  thread_data->cc_region = 0;
+  thread_data->scan_region = -1;
+  for (int i = 0; i < CC_REGION_NO; i++) {
+    thread_data->region_free_bb[i] = cc_region_first_bb(i);
+    thread_data->region_free_addr[i] = cc_region_start(thread_data, i);
+  }
+#endif
+#ifdef DBM_CC_VENEERS
+  // The links through the veneers are released by linked_list_init()
+  for (int i = 0; i < CC_REGION_NO; i++) {
+    thread_data->region_veneers[i] = 0;
+  }
+#endif
+  hash_flush(thread_data->entry_address);
+#ifdef DBM_RAS
+  riscv_ras_reset(thread_data, 0, UINTPTR_MAX);
+#endif
+#ifdef DBM_JUMP_TABLES
+  for (int i = 0; i < JT_POOL_NO; i++) {
+    riscv_jump_table_reset(thread_data, i);
+  }
+#endif
 #ifdef DBM_TRACES
   thread_data->trace_cache_next = thread_data->code_cache->traces;
   thread_data->trace_id = CODE_CACHE_SIZE;
   thread_data->active_trace.id = CODE_CACHE_SIZE;
 #endif
 
-  for (int i = 0; i < CODE_CACHE_SIZE; i++) {
-    thread_data->code_cache_meta[i].exit_branch_type = unknown;
-    thread_data->code_cache_meta[i].linked_from = NULL;
-    thread_data->code_cache_meta[i].branch_cache_status = 0;
-    thread_data->code_cache_meta[i].actual_id = 0;
-#ifdef DBM_TRACES
-    thread_data->exec_count[i] = 0;
+  // The metadata of the basic blocks is reset by allocate_bb() when they are reused
+  linked_list_init(thread_data->cc_links, MAX_CC_LINKS);
+#ifdef DBM_ARCH_RISCV64
+  memset(thread_data->source_index, 0, sizeof(ll_entry *) * SOURCE_INDEX_SIZE);
+  thread_data->source_index_full = false;
+#endif
+
+#ifdef DBM_PERSISTENT_CC
+  persistent_cc_notify_flush(thread_data);
+#endif
+}
+
+/* Records a modified code cache range [start, end). With DBM_DEFER_ICACHE_FLUSH,
+   the ranges are merged and the instruction cache is only synchronised by
+   cc_sync_icache() before returning to the code cache. On RISC-V, each
+   __clear_cache() is a riscv_flush_icache syscall with a remote fence. */
+void cc_mark_dirty(dbm_thread *thread_data, void *start, void *end) {
+#ifdef DBM_DEFER_ICACHE_FLUSH
+  if (thread_data->icache_dirty_start == thread_data->icache_dirty_end) {
+    thread_data->icache_dirty_start = (uintptr_t)start;
+    thread_data->icache_dirty_end = (uintptr_t)end;
+  } else {
+    thread_data->icache_dirty_start = min(thread_data->icache_dirty_start, (uintptr_t)start);
+    thread_data->icache_dirty_end = max(thread_data->icache_dirty_end, (uintptr_t)end);
+#ifdef ICACHE_STATS
+    thread_data->icache_flushes_avoided++;
 #endif
   }
+#else
+  __clear_cache(start, end);
+#endif
+}
 
-  linked_list_init(thread_data->cc_links, MAX_CC_LINKS);
+void cc_sync_icache(dbm_thread *thread_data) {
+#ifdef DBM_DEFER_ICACHE_FLUSH
+  if (thread_data->icache_dirty_start != thread_data->icache_dirty_end) {
+    __clear_cache((char *)thread_data->icache_dirty_start, (char *)thread_data->icache_dirty_end);
+    thread_data->icache_dirty_start = thread_data->icache_dirty_end = 0;
+  }
+#endif
 }
 
 uintptr_t cc_lookup(dbm_thread *thread_data, uintptr_t target) {
-  uintptr_t addr = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t addr = hash_lookup(thread_data->entry_address, target);
   return adjust_cc_entry(addr);
 }
 
@@ -114,8 +211,24 @@ uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached
   if (block_address == UINT_MAX) {
     from_cache = false;
     block_address = scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
+#ifdef DBM_LOOKAHEAD
+    /* The successors may evict the region of the new block, it's scanned again
+       in that case. was_flushed is kept set for the caller. */
+    bool was_flushed = thread_data->was_flushed;
+    thread_data->was_flushed = false;
+    riscv_lookahead(thread_data, addr_to_bb_id(thread_data, block_address));
+    if (thread_data->was_flushed) {
+      block_address = cc_lookup(thread_data, target);
+      if (block_address == UINT_MAX) {
+        block_address = scan(thread_data, (uint16_t *)target, ALLOCATE_BB);
+      }
+    }
+    thread_data->was_flushed |= was_flushed;
+#elif defined(DBM_SPEC_THREAD)
+    riscv_spec_enqueue(thread_data, addr_to_bb_id(thread_data, block_address));
+#endif
   } else {
-    basic_block = ((uintptr_t)block_address - (uintptr_t)(thread_data->code_cache)) >> 8;
+    basic_block = addr_to_bb_id(thread_data, block_address);
     if (thread_data->code_cache_meta[basic_block].exit_branch_type == stub) {
       block_address = scan(thread_data, (uint16_t *)target, basic_block);
     }
@@ -128,21 +241,643 @@ uintptr_t lookup_or_scan(dbm_thread *thread_data, uintptr_t target, bool *cached
   return block_address;
 }
 
+#ifdef DBM_ARCH_RISCV64
+/* Restores the exits linked to a fragment from outside [start, end) to call
+   the dispatcher, and releases all the links recorded for it */
+static void unlink_incoming_links(dbm_thread *thread_data, int fragment_id,
+                                  uintptr_t start, uintptr_t end) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
+  ll_entry *entry = bb_meta->linked_from;
+  while (entry != NULL) {
+    ll_entry *next = entry->next;
+    if (entry->data < start || entry->data >= end) {
+      bool unlinked = false;
+#ifdef DBM_JUMP_TABLES
+      // The translated jump tables aren't in the code cache, check them first
+      unlinked = riscv_jump_table_unlink(thread_data, entry->data);
+#endif
+#ifdef DBM_CC_VENEERS
+      unlinked = unlinked || riscv_unlink_veneer(thread_data, entry->data);
+#endif
+#ifdef DBM_RAS
+      unlinked = unlinked || riscv_ras_unlink(thread_data, entry->data);
+#endif
+#ifdef DBM_IBTC
+      unlinked = unlinked || riscv_ibtc_unlink(thread_data, entry->data);
+#endif
+      int source = unlinked ? -1 : addr_to_bb_id(thread_data, entry->data);
+      if (source >= 0) {
+        if (thread_data->code_cache_meta[source].actual_id != 0) {
+          source = thread_data->code_cache_meta[source].actual_id;
+        }
+        riscv_unlink_exit(thread_data, source);
+      }
+    }
+    linked_list_free(thread_data->cc_links, entry);
+    entry = next;
+  }
+  bb_meta->linked_from = NULL;
+}
+
+/* Records [start, end) as another source range of a fragment, besides
+   [source_start, source_end). If the pool of entries is exhausted, the first
+   range is widened to cover it instead, which only invalidates more often. */
+void cc_add_source_range(dbm_thread *thread_data, int fragment, uintptr_t start, uintptr_t end) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment];
+  while (start < end) {
+    size_t len = end - start;
+    if (len > SOURCE_RANGE_MAX_LEN) {
+      len = SOURCE_RANGE_MAX_LEN;
+    }
+    ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+    if (entry == NULL) {
+      if (end > (uintptr_t)bb_meta->source_end) bb_meta->source_end = (uint16_t *)end;
+      if (start < (uintptr_t)bb_meta->source_start) bb_meta->source_start = (uint16_t *)start;
+      return;
+    }
+    entry->data = source_range(start, len);
+    entry->next = bb_meta->source_ranges;
+    bb_meta->source_ranges = entry;
+    start += len;
+  }
+}
+
+/* Calls fn for each source page of a fragment. A page is visited once per
+   range of the fragment which covers it. */
+static void cc_for_each_source_page(dbm_thread *thread_data, int fragment,
+                                    void (*fn)(dbm_thread *, uintptr_t, int)) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment];
+  uintptr_t start = (uintptr_t)bb_meta->source_start;
+  uintptr_t end = (uintptr_t)bb_meta->source_end;
+  ll_entry *entry = bb_meta->source_ranges;
+  while (true) {
+    for (uintptr_t page = start >> SOURCE_INDEX_SHIFT; page << SOURCE_INDEX_SHIFT < end; page++) {
+      fn(thread_data, page << SOURCE_INDEX_SHIFT, fragment);
+    }
+    if (entry == NULL) break;
+    start = source_range_start(entry->data);
+    end = source_range_end(entry->data);
+    entry = entry->next;
+  }
+}
+
+static void source_index_add(dbm_thread *thread_data, uintptr_t page, int fragment) {
+  ll_entry **bucket = &thread_data->source_index[source_index_bucket(page)];
+  for (ll_entry *entry = *bucket; entry != NULL; entry = entry->next) {
+    if (entry->data == fragment) return;
+  }
+  ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+  if (entry == NULL) {
+    thread_data->source_index_full = true;
+    return;
+  }
+  entry->data = fragment;
+  entry->next = *bucket;
+  *bucket = entry;
+}
+
+static void source_index_remove(dbm_thread *thread_data, uintptr_t page, int fragment) {
+  ll_entry **prev = &thread_data->source_index[source_index_bucket(page)];
+  while (*prev != NULL) {
+    ll_entry *entry = *prev;
+    if (entry->data == fragment) {
+      *prev = entry->next;
+      linked_list_free(thread_data->cc_links, entry);
+      return;
+    }
+    prev = &entry->next;
+  }
+}
+
+/* Adds a new fragment to the source address index, which maps each source
+   page to the fragments translated from it. The buckets are reset when the
+   code cache is flushed. */
+void cc_index_source(dbm_thread *thread_data, int fragment) {
+  cc_for_each_source_page(thread_data, fragment, source_index_add);
+}
+
+/* Removes a fragment from the source address index and releases its other
+   source ranges */
+void cc_free_source_ranges(dbm_thread *thread_data, int fragment) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment];
+  cc_for_each_source_page(thread_data, fragment, source_index_remove);
+  ll_entry *entry = bb_meta->source_ranges;
+  while (entry != NULL) {
+    ll_entry *next = entry->next;
+    linked_list_free(thread_data->cc_links, entry);
+    entry = next;
+  }
+  bb_meta->source_ranges = NULL;
+}
+
+/* Checks if any source range of a fragment overlaps [start, end) */
+bool cc_source_overlaps(dbm_thread *thread_data, int fragment, uintptr_t start, uintptr_t end) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment];
+  if ((uintptr_t)bb_meta->source_start < end && (uintptr_t)bb_meta->source_end > start) {
+    return true;
+  }
+  for (ll_entry *entry = bb_meta->source_ranges; entry != NULL; entry = entry->next) {
+    if (source_range_start(entry->data) < end && source_range_end(entry->data) > start) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Invalidates the translations of the source range [start, end). The exits
+   linked to them are restored and their hash table entries are removed, so
+   the source is translated again if it's executed. The fragments themselves
+   are left in place and reclaimed with the rest of the code cache. */
+static bool cc_invalidate_fragment(dbm_thread *thread_data, int fragment,
+                                   uintptr_t start, uintptr_t end) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment];
+  if (bb_meta->actual_id != 0 || bb_meta->exit_branch_type == stub
+      || !cc_source_overlaps(thread_data, fragment, start, end)) {
+    return false;
+  }
+  unlink_incoming_links(thread_data, fragment, 0, 0);
+  hash_delete(thread_data->entry_address, (uintptr_t)bb_meta->source_addr);
+  cc_free_source_ranges(thread_data, fragment);
+  bb_meta->source_end = bb_meta->source_start;
+  return true;
+}
+
+void cc_invalidate_range(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  int count = 0;
+
+  if (!thread_data->source_index_full) {
+    // A range of SOURCE_INDEX_SIZE pages or more visits every bucket once
+    uintptr_t first_page = start >> SOURCE_INDEX_SHIFT;
+    uintptr_t pages = ((end - 1) >> SOURCE_INDEX_SHIFT) - first_page + 1;
+    if (pages > SOURCE_INDEX_SIZE) {
+      pages = SOURCE_INDEX_SIZE;
+    }
+    for (uintptr_t page = first_page; page < first_page + pages && start < end; page++) {
+      ll_entry *entry = thread_data->source_index[source_index_bucket(page << SOURCE_INDEX_SHIFT)];
+      while (entry != NULL) {
+        // The entry is released if its fragment is invalidated
+        ll_entry *next = entry->next;
+        if (cc_invalidate_fragment(thread_data, entry->data, start, end)) {
+          count++;
+        }
+        entry = next;
+      }
+    }
+  } else {
+#ifdef DBM_CC_REGIONS
+    for (int r = 0; r < CC_REGION_NO; r++) {
+      for (int i = cc_region_first_bb(r); i < cc_region_free_bb(thread_data, r); i++) {
+#else
+    {
+      for (int i = trampolines_size_bbs; i < thread_data->free_block; i++) {
+#endif
+        if (cc_invalidate_fragment(thread_data, i, start, end)) {
+          count++;
+        }
+      }
+    }
+  }
+
+#ifdef DBM_TRACES
+  /* The exits of the traces aren't recorded as links, a trace can't be unlinked
+     from the fragments it jumps to. Once traces exist, everything is flushed. */
+  bool flush = (count > 0);
+  for (int i = CODE_CACHE_SIZE; i < thread_data->active_trace.id && !flush; i++) {
+    dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[i];
+    flush = bb_meta->exit_branch_type != trace_exit
+            && cc_source_overlaps(thread_data, i, start, end);
+  }
+  if (flush && thread_data->active_trace.id > CODE_CACHE_SIZE) {
+    flush_code_cache(thread_data);
+  }
+#endif
+
+  debug("Invalidated %d fragments of 0x%" PRIxPTR "-0x%" PRIxPTR "\n", count, start, end);
+}
+
+/* Invalidates a source range in all code caches. Without DBM_SHARED_CC, the
+   other threads are asked to apply it themselves. */
+void invalidate_source_range(uintptr_t start, uintptr_t end) {
+#ifdef DBM_SHARED_CC
+  int ret = lock_code_cache();
+  assert(ret == 0);
+  cc_invalidate_range(cc_thread(current_thread), start, end);
+  ret = unlock_code_cache();
+  assert(ret == 0);
+#else
+  // The speculative translation thread may be translating into this code cache
+  int ret = lock_code_cache();
+  assert(ret == 0);
+  cc_invalidate_range(current_thread, start, end);
+  ret = unlock_code_cache();
+  assert(ret == 0);
+
+  ret = lock_thread_list();
+  assert(ret == 0);
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    if (thread == current_thread) continue;
+
+    uintptr_t inval_start = start;
+    uintptr_t inval_end = end;
+    int i = thread->pending_inval_count;
+    if (i == MAX_PENDING_INVAL) {
+      // Merge into the last range, more than needed is invalidated
+      i--;
+      inval_start = min(inval_start, thread->pending_inval_start[i]);
+      inval_end = max(inval_end, thread->pending_inval_end[i]);
+    } else {
+      thread->pending_inval_count++;
+    }
+    thread->pending_inval_start[i] = inval_start;
+    thread->pending_inval_end[i] = inval_end;
+
+    /* Don't wait for the thread to enter the dispatcher, it may not for a long
+       time in a loop of linked fragments. Its UNLINK_SIGNAL handler applies
+       the invalidations if it's executing from the code cache. The threads in
+       a system call apply them in syscall_handler_post(). */
+    if (thread->status == THREAD_RUNNING && !thread->inval_signal_sent) {
+      thread->inval_signal_sent = true;
+      syscall(__NR_tgkill, getpid(), thread->tid, UNLINK_SIGNAL);
+    }
+  }
+  ret = unlock_thread_list();
+  assert(ret == 0);
+#endif
+}
+
+/* Safepoint: applies the invalidations requested by other threads */
+void apply_pending_invalidations(dbm_thread *thread_data) {
+  if (thread_data->pending_inval_count == 0) return;
+
+  int ret = lock_thread_list();
+  assert(ret == 0);
+  for (int i = 0; i < thread_data->pending_inval_count; i++) {
+    cc_invalidate_range(thread_data, thread_data->pending_inval_start[i],
+                        thread_data->pending_inval_end[i]);
+  }
+  thread_data->pending_inval_count = 0;
+  ret = unlock_thread_list();
+  assert(ret == 0);
+}
+
+/* Applies the pending invalidations while the thread is stopped in the code
+   cache, by a signal or a system call. With traces, an invalidation can flush
+   the code cache, so it's left for the dispatcher. */
+void apply_pending_invalidations_in_cc(dbm_thread *thread_data) {
+  if (thread_data->pending_inval_count == 0) return;
+#ifdef DBM_TRACES
+  if (thread_data->active_trace.id > CODE_CACHE_SIZE) return;
+#endif
+
+  int ret = lock_code_cache();
+  assert(ret == 0);
+  apply_pending_invalidations(thread_data);
+  cc_sync_icache(thread_data);
+  ret = unlock_code_cache();
+  assert(ret == 0);
+}
+#endif // DBM_ARCH_RISCV64
+
+#ifdef DBM_SMC_PROTECT
+// Called with smc_mutex held, addr is in a source page of the index
+static void smc_protect_page(dbm_thread *thread_data, uintptr_t addr, int fragment) {
+  uintptr_t page = addr & ~(page_size - 1);
+  interval_map_entry entry;
+  if (interval_map_search_by_addr(&global_data.smc_writable, page, &entry) == 1
+      && hash_lookup(global_data.smc_pages, page) == UINT_MAX) {
+    int ret = mprotect((void *)page, page_size, PROT_READ | PROT_EXEC);
+    assert(ret == 0);
+    if (!hash_add(global_data.smc_pages, page, page)) {
+      fprintf(stderr, "Failed to add hash table entry for a write-protected page\n");
+      while(1);
+    }
+  }
+}
+
+/* Write-protects the pages read to translate a new fragment which the
+   application can write, so that writing to them raises a SIGSEGV handled by
+   smc_write_fault(). The pages between the source ranges of the fragment
+   aren't protected. The system calls writing to such a page fail with EFAULT
+   instead. Signals are blocked while smc_mutex is held, the SIGSEGV handler
+   takes it. */
+void smc_protect(dbm_thread *thread_data, int fragment) {
+  block_signals();
+  int ret = pthread_mutex_lock(&global_data.smc_mutex);
+  assert(ret == 0);
+  cc_for_each_source_page(thread_data, fragment, smc_protect_page);
+  ret = pthread_mutex_unlock(&global_data.smc_mutex);
+  assert(ret == 0);
+  unblock_signals();
+}
+
+/* Called on a SIGSEGV for a write to addr. If its page was write-protected by
+   smc_protect(), the fragments translated from the page are invalidated and
+   the write is allowed, it's retried when the signal handler returns. */
+bool smc_write_fault(uintptr_t addr) {
+  uintptr_t page = addr & ~(page_size - 1);
+
+  // The other signals are only blocked for the SIGSEGV itself
+  block_signals();
+  int ret = pthread_mutex_lock(&global_data.smc_mutex);
+  assert(ret == 0);
+  bool protected = hash_lookup(global_data.smc_pages, page) != UINT_MAX;
+  if (protected) {
+    hash_delete(global_data.smc_pages, page);
+    ret = mprotect((void *)page, page_size, PROT_READ | PROT_WRITE | PROT_EXEC);
+    assert(ret == 0);
+  }
+  ret = pthread_mutex_unlock(&global_data.smc_mutex);
+  assert(ret == 0);
+  unblock_signals();
+
+  if (protected) {
+    debug("Write to translated code at 0x%" PRIxPTR "\n", addr);
+    invalidate_source_range(page, page + page_size);
+  }
+  return protected;
+}
+
+/* The protection set by the application replaces ours for the pages it maps,
+   unmaps or mprotects. The translations of the dropped pages are invalidated if
+   they can now be written without a fault or if they are replaced. */
+static void smc_notify_vm_op(vm_op_t op, uintptr_t start, uintptr_t end, int prot) {
+  bool writable = (op != VM_UNMAP) && (prot & PROT_WRITE) && (prot & PROT_EXEC);
+  int dropped = 0;
+
+  block_signals();
+  int ret = pthread_mutex_lock(&global_data.smc_mutex);
+  assert(ret == 0);
+  if (writable) {
+    ret = interval_map_add(&global_data.smc_writable, start, end, -1);
+    assert(ret == 0);
+  } else {
+    ssize_t deleted = interval_map_delete(&global_data.smc_writable, start, end);
+    assert(deleted >= 0);
+  }
+  if (global_data.smc_pages->count != 0) {
+    dropped = hash_delete_values(global_data.smc_pages, start, end);
+  }
+  ret = pthread_mutex_unlock(&global_data.smc_mutex);
+  assert(ret == 0);
+  unblock_signals();
+
+  if (dropped > 0 && (writable || op == VM_MAP)) {
+    invalidate_source_range(start, end);
+  }
+}
+#endif // DBM_SMC_PROTECT
+
+#ifdef DBM_DECODE_CACHE
+/* Returns a decode table covering addr, or NULL. The scanner calls this when
+   its last table doesn't cover the instruction, the tables are read without
+   the mutex because they're only appended. */
+decode_table *decode_table_find(uintptr_t addr) {
+  int count = __atomic_load_n(&global_data.decode_table_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    decode_table *table = &global_data.decode_tables[i];
+    if (addr >= table->start && addr < table->end) {
+      return table;
+    }
+  }
+  return NULL;
+}
+
+static void decode_table_add(uintptr_t start, uintptr_t end) {
+  int ret = pthread_mutex_lock(&global_data.decode_table_mutex);
+  assert(ret == 0);
+
+  int count = global_data.decode_table_count;
+  bool covered = false;
+  for (int i = 0; i < count && !covered; i++) {
+    covered = start >= global_data.decode_tables[i].start && end <= global_data.decode_tables[i].end;
+  }
+  // Once all the tables are used, the instructions of new mappings are decoded every time
+  if (!covered && count < DECODE_TABLE_NO) {
+    decode_table *table = &global_data.decode_tables[count];
+    table->entries = mmap(NULL, sizeof(decode_cache_entry) * ((end - start) / 2),
+                          PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+    if (table->entries != MAP_FAILED) {
+      table->start = start;
+      table->end = end;
+      __atomic_store_n(&global_data.decode_table_count, count + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  ret = pthread_mutex_unlock(&global_data.decode_table_mutex);
+  assert(ret == 0);
+}
+
+// Releases the pages of the entries for [start, end), they read as free again
+static void decode_table_drop(uintptr_t start, uintptr_t end) {
+  int count = __atomic_load_n(&global_data.decode_table_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    decode_table *table = &global_data.decode_tables[i];
+    if (start < table->end && end > table->start) {
+      uintptr_t first = (uintptr_t)&table->entries[(max(start, table->start) - table->start) / 2];
+      uintptr_t last = (uintptr_t)&table->entries[(min(end, table->end) - table->start) / 2];
+      first = align_higher(first, page_size);
+      last = align_lower(last, page_size);
+      if (first < last) {
+        int ret = madvise((void *)first, last - first, MADV_DONTNEED);
+        assert(ret == 0);
+      }
+    }
+  }
+}
+#endif // DBM_DECODE_CACHE
+
+#ifdef DBM_SHARED_CC
+/* Other threads could be executing from the shared code cache or have return
+   addresses into it in their system calls, it can't be reused under them */
+static void shared_cc_check_single_thread(void) {
+  if (global_data.threads != NULL && global_data.threads->next_thread != NULL) {
+    fprintf(stderr, "The shared code cache is full while multiple threads are running, "
+                    "increase CODE_CACHE_SIZE or build without DBM_SHARED_CC\n");
+    exit(EXIT_FAILURE);
+  }
+}
+#endif
+
+#ifdef DBM_CC_REGIONS
+/* Evicts the fragments of a code cache region. Exits linked to them from
+   other regions are restored to call the dispatcher, their hash table
+   entries are removed and the links recorded for their own exits are dropped. */
+static void evict_region(dbm_thread *thread_data, int region) {
+  uintptr_t start = cc_region_start(thread_data, region);
+  uintptr_t end = start + CC_REGION_SIZE;
+  int first_bb = cc_region_first_bb(region);
+  int free_bb = cc_region_free_bb(thread_data, region);
+
+  info("Evicting code cache region %d (%d fragments)\n", region, free_bb - first_bb);
+
+  for (int i = first_bb; i < free_bb; i++) {
+    dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[i];
+    unlink_incoming_links(thread_data, i, start, end);
+    cc_free_source_ranges(thread_data, i);
+
+    bb_meta->exit_branch_type = unknown;
+    bb_meta->branch_cache_status = 0;
+    bb_meta->actual_id = 0;
+  }
+
+  for (int r = 0; r < CC_REGION_NO; r++) {
+    if (r == region) continue;
+    for (int i = cc_region_first_bb(r); i < cc_region_free_bb(thread_data, r); i++) {
+      ll_entry **prev = &thread_data->code_cache_meta[i].linked_from;
+      while (*prev != NULL) {
+        ll_entry *entry = *prev;
+        bool in_region = entry->data >= start && entry->data < end;
+#ifdef DBM_JUMP_TABLES
+        in_region = in_region || riscv_jump_table_pool(thread_data, entry->data) == region;
+#endif
+        if (in_region) {
+          *prev = entry->next;
+          linked_list_free(thread_data->cc_links, entry);
+        } else {
+          prev = &entry->next;
+        }
+      }
+    }
+  }
+
+  hash_delete_values(thread_data->entry_address, start, end);
+#ifdef DBM_CC_VENEERS
+  riscv_reset_veneers(thread_data, region);
+#endif
+#ifdef DBM_RAS
+  riscv_ras_reset(thread_data, start, end);
+#endif
+#ifdef DBM_JUMP_TABLES
+  riscv_jump_table_reset(thread_data, region);
+#endif
+
+  thread_data->region_free_bb[region] = first_bb;
+  thread_data->region_free_addr[region] = start;
+
+  // The source of the current dispatcher call may have been evicted, don't link it
+  thread_data->was_flushed = true;
+}
+
+/* Makes regions [first, last] of the code cache accessible. init_thread() only
+   reserves the address space of the code cache, which then grows one region
+   at a time as allocation reaches it. */
+static void commit_regions(dbm_thread *thread_data, int first, int last) {
+  uintptr_t start = (first == 0) ? (uintptr_t)thread_data->code_cache
+                                 : cc_region_start(thread_data, first) & ~(CC_PAGE_SIZE - 1);
+  uintptr_t end = CC_SZ_ROUND(cc_region_start(thread_data, last + 1));
+  uintptr_t cc_end = (uintptr_t)thread_data->code_cache + CC_SZ_ROUND(sizeof(dbm_code_cache));
+  if (end > cc_end) {
+    end = cc_end;
+  }
+
+  int ret = mprotect((void *)start, end - start, PROT_EXEC | PROT_READ | PROT_WRITE);
+  if (ret != 0) {
+    fprintf(stderr, "Growing the code cache failed\n");
+    while(1);
+  }
+  thread_data->cc_regions_committed = last + 1;
+}
+
+/* Moves allocation to the next region in FIFO order, evicting it if used */
+static void next_region(dbm_thread *thread_data) {
+  int region = thread_data->cc_region;
+  thread_data->region_free_bb[region] = thread_data->free_block;
+  thread_data->region_free_addr[region] = thread_data->free_addr;
+
+  region = (region + 1) % CC_REGION_NO;
+  /* A large fragment can continue in the following regions, the region it
+     started in must stay in place until it has been scanned */
+  if (region == thread_data->scan_region) {
+    region = (region + 1) % CC_REGION_NO;
+  }
+  if (thread_data->region_free_bb[region] > cc_region_first_bb(region)) {
+#ifdef DBM_SHARED_CC
+    shared_cc_check_single_thread();
+#endif
+    evict_region(thread_data, region);
+  }
+  if (region >= thread_data->cc_regions_committed) {
+    commit_regions(thread_data, region, region);
+  }
+
+  thread_data->cc_region = region;
+  thread_data->free_block = cc_region_first_bb(region);
+  thread_data->free_addr = cc_region_start(thread_data, region);
+}
+#endif // DBM_CC_REGIONS
+
 int allocate_bb(dbm_thread *thread_data) {
   unsigned int basic_block;
   bool flushed = false;
 
+#ifdef DBM_CC_REGIONS
+  int region = thread_data->cc_region;
+  if (thread_data->free_block >= cc_region_first_bb(region + 1)
+      || thread_data->free_addr + sizeof(dbm_block) > cc_region_end(thread_data, region)) {
+    next_region(thread_data);
+  }
+#else
   // Reserve CODE_CACHE_OVERP basic blocks to be able to scan large blocks
+#ifdef DBM_VAR_SIZE_BB
+  uintptr_t cc_limit = (uintptr_t)&thread_data->code_cache->blocks[CODE_CACHE_SIZE - CODE_CACHE_OVERP];
+  if(thread_data->free_block >= (CODE_CACHE_FRAGMENTS - CODE_CACHE_OVERP)
+     || thread_data->free_addr >= cc_limit) {
+#else
   if(thread_data->free_block >= (CODE_CACHE_SIZE - CODE_CACHE_OVERP)) {
+#endif
+#ifdef DBM_SHARED_CC
+    shared_cc_check_single_thread();
+#endif
     fprintf(stderr, "code cache full, flushing it\n");
     flush_code_cache(thread_data);
     flushed = true;
   }
+#endif // DBM_CC_REGIONS
   
   basic_block = thread_data->free_block++;
+  if (basic_block >= thread_data->meta_committed) {
+    cc_meta_commit(thread_data, basic_block);
+  }
+  thread_data->code_cache_meta[basic_block].exit_branch_type = unknown;
+  thread_data->code_cache_meta[basic_block].linked_from = NULL;
+  thread_data->code_cache_meta[basic_block].branch_cache_status = 0;
+  thread_data->code_cache_meta[basic_block].actual_id = 0;
+#ifdef DBM_ARCH_RISCV64
+  thread_data->code_cache_meta[basic_block].source_ranges = NULL;
+#endif
+#ifdef DBM_TRACES
+  thread_data->exec_count[basic_block] = 0;
+#endif
+#ifdef DBM_RAS
+  thread_data->code_cache_meta[basic_block].ras_call = NULL;
+#endif
+#ifdef DBM_IBTC
+  thread_data->code_cache_meta[basic_block].ibtc = NULL;
+#endif
+#ifdef DBM_JUMP_TABLES
+  thread_data->code_cache_meta[basic_block].jump_table = NULL;
+  thread_data->code_cache_meta[basic_block].jump_table_size = 0;
+#endif
+#ifdef DBM_VAR_SIZE_BB
+  /* Bump allocation: a full dbm_block is reserved while the fragment is
+     being scanned, the unused tail is returned by trim_bb() */
+  thread_data->bb_offset[basic_block] = thread_data->free_addr - (uintptr_t)thread_data->code_cache->blocks;
+  thread_data->free_addr += sizeof(dbm_block);
+#endif
   return basic_block;
 }
 
+#ifdef DBM_VAR_SIZE_BB
+/* Releases the space after end if it's at the tail of the last allocated
+   fragment, i.e. no other fragment has been allocated after it */
+void trim_bb(dbm_thread *thread_data, uintptr_t end) {
+  end = align_higher(end, VAR_BB_ALIGN);
+  if (end >= cc_bb_addr(thread_data, thread_data->free_block - 1) && end <= thread_data->free_addr) {
+    thread_data->free_addr = end;
+  }
+}
+#endif
+
 /* Stub BBs only contain a call to the dispatcher
    Stub BBs are used when a basic block can be optimised by directly linking
    to a target, but it's not clear if the target will ever be reached, e.g.:
@@ -153,12 +888,12 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
   uintptr_t thumb = target & THUMB;
   
   basic_block = allocate_bb(thread_data);
-  block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
+  block_address = cc_bb_addr(thread_data, basic_block);
   
   debug("Stub BB: 0x%x\n", block_address + thumb);
   
   thread_data->code_cache_meta[basic_block].exit_branch_type = stub;
-  if (!hash_add(&thread_data->entry_address, target, block_address + thumb)) {
+  if (!hash_add(thread_data->entry_address, target, block_address + thumb)) {
     fprintf(stderr, "Failed to add hash table entry for newly created stub basic block\n");
     while(1);
   }
@@ -173,6 +908,9 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
 #ifdef __aarch64__
   assert(0); // TODO
 #endif
+#ifdef DBM_ARCH_RISCV64
+  riscv_encode_stub_bb(thread_data, basic_block, target);
+#endif
   
   return adjust_cc_entry(block_address + thumb);
 }
@@ -186,7 +924,7 @@ uintptr_t lookup_or_stub(dbm_thread *thread_data, uintptr_t target) {
   block_address = cc_lookup(thread_data, target);
   if (block_address == UINT_MAX) {
     block_address = stub_bb(thread_data, target);
-    __clear_cache((char *)block_address, (char *)(block_address + BASIC_BLOCK_SIZE * 4 + 1));
+    cc_mark_dirty(thread_data, (char *)block_address, (char *)(block_address + BASIC_BLOCK_SIZE * 4 + 1));
   }
 
   return block_address;
@@ -207,21 +945,30 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
     stub = true;
   }
 
-  block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
+  block_address = cc_bb_addr(thread_data, basic_block);
   thread_data->code_cache_meta[basic_block].source_addr = address;
   thread_data->code_cache_meta[basic_block].tpc = block_address;
+#ifdef DBM_CC_REGIONS
+  // Only the outermost fragment of nested scans is protected from eviction
+  int scan_region = thread_data->scan_region;
+  if (scan_region < 0) {
+    thread_data->scan_region = cc_bb_region(basic_block);
+  }
+#endif
   //fprintf(stderr, "scan(%p): 0x%x (bb %d)\n", address, block_address, basic_block);
 
   // Add entry into the code cache hash table
   // It must be added before scan_ is called, otherwise a call for scan
   // from scan_x could result in duplicate BBS or an infinite recursive call
   block_address |= thumb;
+#if !defined(DBM_SHARED_CC) && !defined(DBM_SPEC_THREAD)
   if (!stub) {
-    if (!hash_add(&thread_data->entry_address, (uintptr_t)address, block_address)) {
+    if (!hash_add(thread_data->entry_address, (uintptr_t)address, block_address)) {
       fprintf(stderr, "Failed to add hash table entry for newly created basic block\n");
       while(1);
     }
   }
+#endif
 
   // Build a basic block
   // Scan functions return size of the generated basic block, in bytes
@@ -239,6 +986,9 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
 #ifdef DBM_ARCH_RISCV64
   block_size = scan_riscv(thread_data, (uint16_t *)address, basic_block, mambo_bb, NULL);
 #endif
+#ifdef DBM_CC_REGIONS
+  thread_data->scan_region = scan_region;
+#endif
 
 #ifdef __arm__
   inst_set inst_type = thumb ? THUMB_INST : ARM_INST;
@@ -267,24 +1017,185 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   if (thread_data->free_block < basic_block) {
     /* The code cache has been flushed. Play it safe, because we don't know how
        much space has been used in each of the two areas. */
-    __clear_cache((char *)block_address, &thread_data->code_cache->traces);
-    __clear_cache(&thread_data->code_cache->blocks[trampolines_size_bbs],
-                  &thread_data->code_cache->blocks[thread_data->free_block]);
+    cc_mark_dirty(thread_data, (char *)block_address, &thread_data->code_cache->traces);
+    cc_mark_dirty(thread_data, &thread_data->code_cache->blocks[trampolines_size_bbs],
+                  (void *)cc_free_addr(thread_data));
   } else {
-    __clear_cache((char *)block_address, (char *)(block_address + block_size + 1));
+    cc_mark_dirty(thread_data, (char *)block_address, (char *)(block_address + block_size + 1));
   }
 
+#ifdef DBM_ARCH_RISCV64
+  cc_index_source(thread_data, basic_block);
+#endif
+
+#ifdef DBM_SMC_PROTECT
+  smc_protect(thread_data, basic_block);
+#endif
+
+#if defined(DBM_SHARED_CC) || defined(DBM_SPEC_THREAD)
+  /* Other threads can reach the block through the inline hash lookup as soon
+     as it is in the hash table, so it's only published once it is complete.
+     With DBM_SPEC_THREAD, the owner of the code cache can while the
+     speculative translation thread scans into it. */
+  cc_sync_icache(thread_data);
+  if (!stub) {
+    if (!hash_add(thread_data->entry_address, (uintptr_t)address, block_address)) {
+      fprintf(stderr, "Failed to add hash table entry for newly created basic block\n");
+      while(1);
+    }
+  }
+#endif
+
   return adjust_cc_entry(block_address);
 }
 
 int lock_thread_list() {
+  block_signals();
   return pthread_mutex_lock(&global_data.thread_list_mutex);
 }
 
 int unlock_thread_list() {
-  return pthread_mutex_unlock(&global_data.thread_list_mutex);
+  int ret = pthread_mutex_unlock(&global_data.thread_list_mutex);
+  unblock_signals();
+  return ret;
+}
+
+/* Serialises modifications of the shared code cache, or with DBM_SPEC_THREAD
+   of the code caches of all threads. Lookups, including the inline hash
+   lookups, don't take the lock. Every modification of the hash table or of
+   the metadata of the fragments must hold it, including the ones made by
+   traces, system calls, signal handlers and the persistent code cache. */
+int lock_code_cache() {
+#ifdef DBM_SHARED_CC
+  block_signals();
+  return pthread_mutex_lock(&global_data.shared_cc_mutex);
+#elif defined(DBM_SPEC_THREAD)
+  block_signals();
+  return pthread_mutex_lock(&global_data.spec_mutex);
+#else
+  return 0;
+#endif
 }
 
+int unlock_code_cache() {
+#ifdef DBM_SHARED_CC
+  int ret = pthread_mutex_unlock(&global_data.shared_cc_mutex);
+  unblock_signals();
+  return ret;
+#elif defined(DBM_SPEC_THREAD)
+  int ret = pthread_mutex_unlock(&global_data.spec_mutex);
+  unblock_signals();
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+#ifdef DBM_SPEC_THREAD
+/* The owner of a code cache may be executing from it, the speculative
+   translation thread must not evict a region or flush it. A fragment being
+   scanned can spill over into the next region if it's still unused. */
+static bool spec_has_space(dbm_thread *thread_data) {
+  uintptr_t min_space = SPEC_MIN_BBS * sizeof(dbm_block);
+#ifdef DBM_CC_REGIONS
+  int region = thread_data->cc_region;
+  int next = (region + 1) % CC_REGION_NO;
+  if (thread_data->region_free_bb[next] == cc_region_first_bb(next)) {
+    return true;
+  }
+  return thread_data->free_block + SPEC_MIN_BBS < cc_region_first_bb(region + 1)
+         && thread_data->free_addr + min_space <= cc_region_end(thread_data, region);
+#elif defined(DBM_VAR_SIZE_BB)
+  uintptr_t cc_limit = (uintptr_t)&thread_data->code_cache->blocks[CODE_CACHE_SIZE - CODE_CACHE_OVERP];
+  return thread_data->free_block + SPEC_MIN_BBS < CODE_CACHE_FRAGMENTS - CODE_CACHE_OVERP
+         && thread_data->free_addr + min_space < cc_limit;
+#else
+  return thread_data->free_block + SPEC_MIN_BBS < CODE_CACHE_SIZE - CODE_CACHE_OVERP;
+#endif
+}
+
+/* Picks a thread with queued targets which can be translated now. The queues
+   of the threads without enough free space are dropped, the threads with
+   pending invalidations are left until their dispatcher applies them. */
+static dbm_thread *spec_next_thread() {
+  dbm_thread *next = NULL;
+
+  int ret = lock_thread_list();
+  assert(ret == 0);
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    if (thread->spec_head == thread->spec_tail || thread->status != THREAD_RUNNING
+        || thread->pending_inval_count != 0) {
+      continue;
+    }
+    if (!spec_has_space(thread)) {
+      thread->spec_head = thread->spec_tail;
+      continue;
+    }
+    next = thread;
+    break;
+  }
+  ret = unlock_thread_list();
+  assert(ret == 0);
+
+  return next;
+}
+
+/* Translates the queued targets of all threads into their code caches. Threads
+   only exit while holding the code cache lock, so the thread data stays valid
+   while it's held. The lock is released after each fragment to let the
+   dispatchers in. */
+static void *spec_thread(void *arg) {
+  int ret = lock_code_cache();
+  assert(ret == 0);
+  while (1) {
+    dbm_thread *thread = spec_next_thread();
+    if (thread == NULL) {
+      ret = pthread_cond_wait(&global_data.spec_cond, &global_data.spec_mutex);
+      assert(ret == 0);
+      continue;
+    }
+
+    // The plugin callbacks and helpers use current_thread
+    current_thread = thread;
+    riscv_spec_translate(thread);
+    current_thread = NULL;
+
+    ret = unlock_code_cache();
+    assert(ret == 0);
+    ret = lock_code_cache();
+    assert(ret == 0);
+  }
+  return NULL;
+}
+
+/* Creates the speculative translation thread, also in the child after a fork().
+   It never executes application code and doesn't handle any signals. */
+void start_spec_thread() {
+  int ret = pthread_mutex_init(&global_data.spec_mutex, NULL);
+  assert(ret == 0);
+  ret = pthread_cond_init(&global_data.spec_cond, NULL);
+  assert(ret == 0);
+
+  sigset_t all, prev;
+  sigfillset(&all);
+  ret = pthread_sigmask(SIG_SETMASK, &all, &prev);
+  assert(ret == 0);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  ret = pthread_create(&thread, &attr, spec_thread, NULL);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to create the speculative translation thread\n");
+    while(1);
+  }
+
+  ret = pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  assert(ret == 0);
+}
+#endif // DBM_SPEC_THREAD
+
 int register_thread(dbm_thread *thread_data, bool caller_has_lock) {
   int ret;
 
@@ -330,6 +1241,9 @@ int unregister_thread(dbm_thread *thread_data, bool caller_has_lock) {
 
   if (status == 0) {
     mambo_deliver_callbacks(POST_THREAD_C, thread_data);
+#if defined(DBM_DEFER_ICACHE_FLUSH) && defined(ICACHE_STATS)
+    atomic_increment_u64(&global_data.icache_flushes_avoided, thread_data->icache_flushes_avoided);
+#endif
   }
 
   if (!caller_has_lock) {
@@ -343,6 +1257,29 @@ int unregister_thread(dbm_thread *thread_data, bool caller_has_lock) {
 void dbm_exit(dbm_thread *thread_data, uint32_t code) {
   fprintf(stderr, "We're done; exiting with status: %d\n", code);
 
+#if defined(DBM_DEFER_ICACHE_FLUSH) && defined(ICACHE_STATS)
+  uint64_t flushes_avoided = global_data.icache_flushes_avoided;
+  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+    flushes_avoided += thread->icache_flushes_avoided;
+  }
+  fprintf(stderr, "I-cache flushes avoided: %" PRIu64 "\n", flushes_avoided);
+#endif
+
+#ifdef HASH_STATS
+  hash_print_stats(cc_thread(thread_data)->entry_address);
+#endif
+
+#ifdef DBM_PERSISTENT_CC
+  if (global_data.threads != NULL && global_data.threads->next_thread == NULL) {
+    // The speculative translation thread may still be translating
+    int ret = lock_code_cache();
+    assert(ret == 0);
+    persistent_cc_save(cc_thread(thread_data));
+    ret = unlock_code_cache();
+    assert(ret == 0);
+  }
+#endif
+
 #ifdef PLUGINS_NEW
   lock_thread_list();
   pid_t pid = getpid();
@@ -383,7 +1320,16 @@ void thread_abort(dbm_thread *thread_data) {
 }
 
 bool allocate_thread_data(dbm_thread **thread_data) {
-  dbm_thread *data = mmap(NULL, sizeof(dbm_thread), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+  void *addr = NULL;
+#ifdef DBM_PERSISTENT_CC
+  // The first allocation holds the code cache used by the main thread
+  static bool first_thread = true;
+  if (first_thread) {
+    addr = PCC_THREAD_DATA_ADDR;
+    first_thread = false;
+  }
+#endif
+  dbm_thread *data = mmap(addr, sizeof(dbm_thread), PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
   if (data != MAP_FAILED) {
     *thread_data = data;
     return true;
@@ -391,15 +1337,84 @@ bool allocate_thread_data(dbm_thread **thread_data) {
   return false;
 }
 
-int free_thread_data(dbm_thread *thread_data) {
-  if (munmap(thread_data->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache))) != 0) {
-    fprintf(stderr, "Error freeing code cache on exit()\n");
+/* The large per-thread arrays are mapped outside of dbm_thread, most of them
+   only when first used. The pages are only backed once they're written. */
+void *thread_array_alloc(void *addr, size_t size) {
+  void *array = mmap(addr, size, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+  if (array == MAP_FAILED) {
+    fprintf(stderr, "Allocating thread metadata failed\n");
+    while(1);
+  }
+  return array;
+}
+
+#define CC_META_SZ (sizeof(dbm_code_cache_meta) * (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO))
+#define CC_META_COMMIT_NO 1024
+
+/* init_thread() only reserves the address space of code_cache_meta, the entries
+   are made accessible CC_META_COMMIT_NO at a time as fragment ids reach them.
+   The trace fragments are numbered from CODE_CACHE_SIZE and grow separately. */
+void cc_meta_commit(dbm_thread *thread_data, int id) {
+  int *committed = &thread_data->meta_committed;
+  int base = 0;
+  int limit = CODE_CACHE_SIZE + TRACE_FRAGMENT_NO;
+#ifdef DBM_TRACES
+  if (id >= CODE_CACHE_SIZE) {
+    committed = &thread_data->trace_meta_committed;
+    base = CODE_CACHE_SIZE;
+  } else {
+    limit = CODE_CACHE_SIZE;
+  }
+#endif
+  if (id < *committed) return;
+
+  int end = min(base + ROUND_UP(id + 1 - base, CC_META_COMMIT_NO), limit);
+  uintptr_t meta = (uintptr_t)thread_data->code_cache_meta;
+  uintptr_t start = meta + ((sizeof(dbm_code_cache_meta) * *committed) & ~(METADATA_PAGE_SIZE - 1));
+  uintptr_t stop = meta + min(METADATA_SZ_ROUND(sizeof(dbm_code_cache_meta) * end),
+                              METADATA_SZ_ROUND(CC_META_SZ));
+  int ret = mprotect((void *)start, stop - start, PROT_READ | PROT_WRITE);
+  if (ret != 0) {
+    fprintf(stderr, "Growing the code cache metadata failed\n");
     while(1);
   }
-  if (munmap(thread_data->cc_links, METADATA_SZ_ROUND(sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS)) != 0) {
-    fprintf(stderr, "Error freeing CC link struct on exit()\n");
+  *committed = end;
+}
+
+static void thread_array_free(void *array, size_t size) {
+  if (array != NULL && munmap(array, METADATA_SZ_ROUND(size)) != 0) {
+    fprintf(stderr, "Error freeing thread metadata on exit()\n");
     while(1);
   }
+}
+
+int free_thread_data(dbm_thread *thread_data) {
+  // With DBM_SHARED_CC, the code cache and links belong to global_data.shared_cc
+  if (cc_thread(thread_data) == thread_data) {
+    if (munmap(thread_data->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache))) != 0) {
+      fprintf(stderr, "Error freeing code cache on exit()\n");
+      while(1);
+    }
+    if (munmap(thread_data->cc_links, METADATA_SZ_ROUND(sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS)) != 0) {
+      fprintf(stderr, "Error freeing CC link struct on exit()\n");
+      while(1);
+    }
+    thread_array_free(thread_data->code_cache_meta, CC_META_SZ);
+    hash_free(thread_data->entry_address);
+#ifdef DBM_VAR_SIZE_BB
+    thread_array_free(thread_data->bb_offset, sizeof(uint32_t) * CODE_CACHE_FRAGMENTS);
+#endif
+#ifdef DBM_ARCH_RISCV64
+    thread_array_free(thread_data->source_index, sizeof(ll_entry *) * SOURCE_INDEX_SIZE);
+#endif
+#ifdef DBM_CC_VENEERS
+    thread_array_free(thread_data->veneer_target, sizeof(uintptr_t) * CC_REGION_NO * CC_VENEER_NO);
+    thread_array_free(thread_data->veneer_linked_from, sizeof(ll_entry *) * CC_REGION_NO * CC_VENEER_NO);
+#endif
+#ifdef DBM_JUMP_TABLES
+    thread_array_free(thread_data->jump_tables, sizeof(jump_table_entry) * JT_POOL_NO * JT_POOL_SIZE);
+#endif
+  }
   if (munmap(thread_data, METADATA_SZ_ROUND(sizeof(dbm_thread))) != 0) {
     fprintf(stderr, "Error freeing thread private structure on exit()\n");
     while(1);
@@ -410,18 +1425,86 @@ int free_thread_data(dbm_thread *thread_data) {
 void init_thread(dbm_thread *thread_data) {
   dbm_thread **dispatcher_thread_data;
 
+#ifdef DBM_SHARED_CC
+  /* Threads only keep their private state, everything else, including the
+     trampolines, is reached through global_data.shared_cc */
+  dbm_thread *shared_cc = cc_thread(thread_data);
+  if (shared_cc != thread_data) {
+    thread_data->code_cache = shared_cc->code_cache;
+    thread_data->dispatcher_addr = shared_cc->dispatcher_addr;
+    thread_data->syscall_wrapper_addr = shared_cc->syscall_wrapper_addr;
+#ifdef DBM_COMPACT_EXITS
+    thread_data->exit_trampoline_addr = shared_cc->exit_trampoline_addr;
+#endif
+    thread_data->status = THREAD_RUNNING;
+    return;
+  }
+#endif
+
   // Initialize code cache
-  thread_data->code_cache = mmap(NULL, sizeof(dbm_code_cache), PROT_EXEC | PROT_READ | PROT_WRITE, CC_MMAP_OPTS, -1, 0);
+  void *cc_addr = NULL;
+#ifdef DBM_PERSISTENT_CC
+  static bool first_cc = true;
+  if (first_cc) {
+    cc_addr = PCC_CODE_CACHE_ADDR;
+    first_cc = false;
+  }
+#endif
+#ifdef DBM_CC_REGIONS
+  int cc_prot = PROT_NONE;
+#else
+  int cc_prot = PROT_EXEC | PROT_READ | PROT_WRITE;
+#endif
+  thread_data->code_cache = mmap(cc_addr, sizeof(dbm_code_cache), cc_prot, CC_MMAP_OPTS, -1, 0);
   if (thread_data->code_cache == MAP_FAILED) {
     fprintf(stderr, "Allocating code cache space failed\n");
     while(1);
   }
   info("Code cache: %p\n", thread_data->code_cache);
+#ifdef DBM_CC_REGIONS
+  // The trampolines and the first region
+  commit_regions(thread_data, 0, 0);
+#endif
+#ifdef DBM_CC_VENEERS
+  assert(CC_REGION_SIZE <= MAX_BRANCH_RANGE);
+#endif
 
   thread_data->cc_links = mmap(NULL, sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
   assert(thread_data->cc_links != MAP_FAILED);
+  thread_data->code_cache_meta = mmap(NULL, CC_META_SZ, PROT_NONE, METADATA_MMAP_OPTS, -1, 0);
+  if (thread_data->code_cache_meta == MAP_FAILED) {
+    fprintf(stderr, "Allocating code cache metadata failed\n");
+    while(1);
+  }
+  thread_data->meta_committed = 0;
+  cc_meta_commit(thread_data, trampolines_size_bbs);
+#ifdef DBM_TRACES
+  thread_data->trace_meta_committed = CODE_CACHE_SIZE;
+#endif
+#ifdef DBM_VAR_SIZE_BB
+  thread_data->bb_offset = thread_array_alloc(NULL, sizeof(uint32_t) * CODE_CACHE_FRAGMENTS);
+#endif
+#ifdef DBM_ARCH_RISCV64
+  thread_data->source_index = thread_array_alloc(NULL, sizeof(ll_entry *) * SOURCE_INDEX_SIZE);
+#endif
+#if defined(DBM_JUMP_TABLES) && defined(DBM_PERSISTENT_CC)
+  // Restored translations index the jump table pools of the run which saved them
+  if (thread_data == PCC_THREAD_DATA_ADDR) {
+    thread_data->jump_tables = thread_array_alloc(PCC_JUMP_TABLES_ADDR,
+                                                  sizeof(jump_table_entry) * JT_POOL_NO * JT_POOL_SIZE);
+  }
+#endif
 
-  // Initialize the hash table and basic block allocator, mark all BBs as unknown type
+  // Initialize the hash table and basic block allocator
+  void *hash_addr = NULL;
+#ifdef DBM_PERSISTENT_CC
+  // The inline hash lookups of restored translations embed its address
+  if (thread_data == PCC_THREAD_DATA_ADDR) {
+    hash_addr = PCC_HASH_TABLE_ADDR;
+  }
+#endif
+  thread_data->entry_address = hash_alloc(hash_addr);
+  hash_init(thread_data->entry_address, CODE_CACHE_HASH_INIT_SIZE + CODE_CACHE_HASH_OVERP);
   flush_code_cache(thread_data);
 
   // Copy the trampolines to the code cache
@@ -435,6 +1518,20 @@ void init_thread(dbm_thread *thread_data) {
                                            + th_is_pending_ptr_offset);
   *dispatcher_is_pending = &thread_data->is_signal_pending;
 
+#ifdef DBM_ARCH_RISCV64
+  // Read by the fast path of the dispatcher trampoline
+  uintptr_t trampolines = (uintptr_t)&thread_data->code_cache->blocks[0];
+  *(hash_entry **)(trampolines + hash_entries_ptr_offset) = thread_data->entry_address->entries;
+  *(uintptr_t **)(trampolines + hash_index_mask_ptr_offset) = &thread_data->entry_address->index_mask;
+  *(uintptr_t **)(trampolines + hash_epoch_ptr_offset) = &thread_data->entry_address->epoch;
+  *(uintptr_t **)(trampolines + hash_seq_ptr_offset) = &thread_data->entry_address->seq;
+  *(int **)(trampolines + pending_inval_count_ptr_offset) = &thread_data->pending_inval_count;
+  *(uintptr_t **)(trampolines + branch_status_ptr_offset) = &thread_data->code_cache_meta[0].branch_cache_status;
+  // Also read by the shared exit trampoline
+  *(dbm_code_cache_meta **)(trampolines + code_cache_meta_ptr_offset) = thread_data->code_cache_meta;
+  *(size_t *)(trampolines + code_cache_meta_size_offset) = sizeof(dbm_code_cache_meta);
+#endif
+
   debug("*thread_data in dispatcher at: %p\n", dispatcher_thread_data);
 
 #ifdef DBM_TRACES
@@ -449,16 +1546,21 @@ void init_thread(dbm_thread *thread_data) {
   a64_copy_to_reg_64bits(&write_p, x2, (uintptr_t)thread_data->exec_count);
   #endif
   #ifdef DBM_ARCH_RISCV64
-  // TODO: RISC-V traces
+  uint8_t **exec_count = (uint8_t **)((uintptr_t)&thread_data->code_cache->blocks[0]
+                                      + trace_exec_count_offset);
+  *exec_count = thread_data->exec_count;
   #endif
 
   info("Traces start at: %p\n", &thread_data->code_cache->traces);
 #endif // DBM_TRACES
 
-  __clear_cache((char *)&thread_data->code_cache->blocks[0], (char *)&thread_data->code_cache->blocks[thread_data->free_block]);
+  __clear_cache((char *)&thread_data->code_cache->blocks[0], (char *)cc_free_addr(thread_data));
  
   thread_data->dispatcher_addr = (uintptr_t)&thread_data->code_cache[0] + dispatcher_wrapper_offset;
   thread_data->syscall_wrapper_addr = (uintptr_t)&thread_data->code_cache[0] + syscall_wrapper_offset;
+#ifdef DBM_COMPACT_EXITS
+  thread_data->exit_trampoline_addr = (uintptr_t)&thread_data->code_cache[0] + exit_trampoline_offset;
+#endif
 
   thread_data->status = THREAD_RUNNING;
                         
@@ -486,6 +1588,19 @@ void reset_process(dbm_thread *thread_data) {
 
   current_thread = thread_data;
   free_all_other_threads(thread_data);
+#ifdef DBM_SMC_PROTECT
+  ret = pthread_mutex_init(&global_data.smc_mutex, NULL);
+  assert(ret == 0);
+#endif
+#ifdef DBM_DECODE_CACHE
+  ret = pthread_mutex_init(&global_data.decode_table_mutex, NULL);
+  assert(ret == 0);
+#endif
+#ifdef DBM_SPEC_THREAD
+  // The parent's speculative translation thread isn't copied, it may have held the lock
+  thread_data->spec_head = thread_data->spec_tail;
+  start_spec_thread();
+#endif
 
   /*
       MASSIVE HACK
@@ -517,12 +1632,48 @@ int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr) {
     return -1;
   }
 
+#ifdef DBM_VAR_SIZE_BB
+  // Fragments are allocated in increasing address order, so bb_offset is sorted
+  uint32_t offset = addr - min;
+#ifdef DBM_CC_REGIONS
+  // ... within each region
+  uintptr_t regions_start = cc_region_start(thread_data, 0);
+  if (addr < regions_start) {
+    return offset / sizeof(dbm_block);
+  }
+  int region = (addr - regions_start) / CC_REGION_SIZE;
+  if (region >= CC_REGION_NO) {
+    return -1;
+  }
+  int first = cc_region_first_bb(region);
+  int last = cc_region_free_bb(thread_data, region) - 1;
+  if (last < first || addr >= cc_region_free_addr(thread_data, region)) {
+    return -1;
+  }
+#else
+  int first = 0;
+  int last = thread_data->free_block - 1;
+  if (last < 0 || addr >= thread_data->free_addr) {
+    return -1;
+  }
+#endif
+  while (first < last) {
+    int pivot = (first + last + 1) / 2;
+    if (thread_data->bb_offset[pivot] <= offset) {
+      first = pivot;
+    } else {
+      last = pivot - 1;
+    }
+  }
+  return first;
+#else
   return (addr - (uintptr_t)thread_data->code_cache->blocks) / sizeof(dbm_block);
+#endif
 }
 
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
   uintptr_t start = (uintptr_t )thread_data->code_cache->blocks;
-  assert(addr >= start && addr < (start + MAX_BRANCH_RANGE));
+  assert(addr >= start && addr < ((uintptr_t)thread_data->code_cache + sizeof(dbm_code_cache)));
 
   int id = addr_to_bb_id(thread_data, addr);
   if (id >= 0) {
@@ -538,7 +1689,7 @@ int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
   int pivot;
 
   if (addr >= thread_data->code_cache_meta[last].tpc) {
-    assert((void *)addr < (((void *)&thread_data->code_cache) + sizeof(dbm_code_cache)));
+    assert((void *)addr < (((void *)thread_data->code_cache) + sizeof(dbm_code_cache)));
     return last;
   }
 
@@ -574,41 +1725,90 @@ void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t li
 }
 
 void notify_vm_op(vm_op_t op, uintptr_t addr, size_t size, int prot, int flags, int fd, off_t off) {
+#ifdef DBM_SMC_PROTECT
+  smc_notify_vm_op(op, addr, addr + size, prot);
+#endif
   switch(op) {
     case VM_MAP: {
       if (prot & PROT_EXEC) {
         int ret = interval_map_add(&global_data.exec_allocs, addr, addr + size, fd);
         assert(ret == 0);
+#ifdef DBM_DECODE_CACHE
+        decode_table_add(addr, addr + size);
+#endif
       }
-#ifdef PLUGINS_NEW
+#if defined(PLUGINS_NEW) || defined(DBM_JUMP_TABLES)
       if (fd >= 0 && (prot & PROT_EXEC)) {
         Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
         if (elf != NULL) {
+#ifdef PLUGINS_NEW
           function_watch_parse_elf(&global_data.watched_functions, elf, (void *)addr);
+#endif
+#ifdef DBM_JUMP_TABLES
+          rodata_parse_elf(&global_data.rodata_allocs, elf, addr, off);
+#endif
         }
         int ret = elf_end(elf);
         assert(ret == 0);
       }
-#endif // PLUGINS_NEW
+#endif // PLUGINS_NEW || DBM_JUMP_TABLES
+#ifdef DBM_PERSISTENT_CC
+      if (prot & PROT_EXEC) {
+        persistent_cc_notify_map(cc_thread(current_thread), addr, addr + size);
+      }
+#endif
       break;
     }
     case VM_UNMAP: {
+#ifdef DBM_JUMP_TABLES
+      interval_map_delete(&global_data.rodata_allocs, addr, addr + size);
+#endif
       ssize_t ret = interval_map_delete(&global_data.exec_allocs, addr, addr + size);
       assert(ret >= 0);
-      // TODO: flush the code cache in all threads
       if (ret >= 1) {
+#ifdef DBM_DECODE_CACHE
+        decode_table_drop(addr, addr + size);
+#endif
+#ifdef DBM_ARCH_RISCV64
+        invalidate_source_range(addr, addr + size);
+#else
         flush_code_cache(current_thread);
+#endif
       }
       break;
     }
     case VM_PROT: {
+#ifdef DBM_JUMP_TABLES
+      // The scanner reads the jump tables
+      if ((prot & PROT_READ) == 0) {
+        interval_map_delete(&global_data.rodata_allocs, addr, addr + size);
+      }
+#endif
       /* BUG: adding PROT_EXEC to an existing mapping results in the fd always being -1
          Fortunately, the fd is only used for symbol resolution and the GNU linker marks
          file mappings with PROT_EXEC from the beginning, so it shouldn't really be an issue */
       if (prot & PROT_EXEC) {
         int ret = interval_map_add(&global_data.exec_allocs, addr, addr + size, fd);
         assert(ret == 0);
+#ifdef DBM_DECODE_CACHE
+        decode_table_add(addr, addr + size);
+#endif
+#ifdef DBM_PERSISTENT_CC
+        persistent_cc_notify_map(cc_thread(current_thread), addr, addr + size);
+#endif
       }
+#ifdef DBM_ARCH_RISCV64
+      else {
+        ssize_t ret = interval_map_delete(&global_data.exec_allocs, addr, addr + size);
+        assert(ret >= 0);
+        if (ret >= 1) {
+#ifdef DBM_DECODE_CACHE
+          decode_table_drop(addr, addr + size);
+#endif
+          invalidate_source_range(addr, addr + size);
+        }
+      }
+#endif
       break;
     }
   } // switch
@@ -708,10 +1908,27 @@ void main(int argc, char **argv, char **envp) {
 
   ret = interval_map_init(&global_data.exec_allocs, 512);
   assert(ret == 0);
+#ifdef DBM_JUMP_TABLES
+  ret = interval_map_init(&global_data.rodata_allocs, 512);
+  assert(ret == 0);
+#endif
 
   ret = pthread_mutex_init(&global_data.signal_handlers_mutex, NULL);
   assert(ret == 0);
 
+#ifdef DBM_SMC_PROTECT
+  ret = interval_map_init(&global_data.smc_writable, 512);
+  assert(ret == 0);
+  global_data.smc_pages = hash_alloc(NULL);
+  hash_init(global_data.smc_pages, CODE_CACHE_HASH_INIT_SIZE + CODE_CACHE_HASH_OVERP);
+  ret = pthread_mutex_init(&global_data.smc_mutex, NULL);
+  assert(ret == 0);
+#endif
+#ifdef DBM_DECODE_CACHE
+  ret = pthread_mutex_init(&global_data.decode_table_mutex, NULL);
+  assert(ret == 0);
+#endif
+
   install_system_sig_handlers();
 
   global_data.brk = 0;
@@ -729,6 +1946,17 @@ void main(int argc, char **argv, char **envp) {
   global_data.initial_brk = global_data.brk = (uintptr_t)map;
   global_data.brk += PAGE_SIZE;
   
+#ifdef DBM_SHARED_CC
+  ret = pthread_mutex_init(&global_data.shared_cc_mutex, NULL);
+  assert(ret == 0);
+
+  if (!allocate_thread_data(&global_data.shared_cc)) {
+    fprintf(stderr, "Failed to allocate the shared code cache\n");
+    while(1);
+  }
+  init_thread(global_data.shared_cc);
+#endif
+
   dbm_thread *thread_data;
   if (!allocate_thread_data(&thread_data)) {
     fprintf(stderr, "Failed to allocate initial thread data\n");
@@ -738,8 +1966,21 @@ void main(int argc, char **argv, char **envp) {
   init_thread(thread_data);
   thread_data->tid = syscall(__NR_gettid);
   register_thread(thread_data, false);
+#ifdef DBM_SPEC_THREAD
+  start_spec_thread();
+#endif
+
+  // The speculative translation thread has already been started
+  ret = lock_code_cache();
+  assert(ret == 0);
+#ifdef DBM_PERSISTENT_CC
+  persistent_cc_load(cc_thread(thread_data), elf);
+#endif
 
-  uintptr_t block_address = scan(thread_data, (uint16_t *)entry_address, ALLOCATE_BB);
+  uintptr_t block_address = scan(cc_thread(thread_data), (uint16_t *)entry_address, ALLOCATE_BB);
+  cc_sync_icache(cc_thread(thread_data));
+  ret = unlock_code_cache();
+  assert(ret == 0);
   debug("Address of first basic block is: 0x%x\n", block_address);
 
 #ifdef DBM_ARCH_RISCV64
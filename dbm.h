@@ -60,13 +60,144 @@
 #define TRACE_FRAGMENT_NO 60000
 #define CODE_CACHE_OVERP 30
 #define TRACE_FRAGMENT_OVERP 50
+#if defined(DBM_SHARED_CC) && !defined(DBM_ARCH_RISCV64)
+  #error "DBM_SHARED_CC is only supported on RISC-V"
+#endif
+#if defined(DBM_SHARED_CC) && defined(DBM_TRACES)
+  #error "DBM_SHARED_CC is not compatible with DBM_TRACES"
+#endif
+#if defined(DBM_PERSISTENT_CC) && defined(DBM_TRACES)
+  #error "DBM_PERSISTENT_CC is not compatible with DBM_TRACES"
+#endif
+#if defined(DBM_VAR_SIZE_BB) && (!defined(DBM_ARCH_RISCV64) || defined(DBM_TRACES))
+  #error "DBM_VAR_SIZE_BB is only supported on RISC-V without DBM_TRACES"
+#endif
+#if defined(DBM_TRACES) && defined(DBM_ARCH_RISCV64) \
+    && (!defined(DBM_LINK_UNCOND_IMM) || !defined(DBM_LINK_COND_IMM))
+  #error "DBM_TRACES on RISC-V requires DBM_LINK_UNCOND_IMM and DBM_LINK_COND_IMM"
+#endif
+#ifdef DBM_VAR_SIZE_BB
+  /* Fragments are packed in the blocks area, BASIC_BLOCK_SIZE is only the space
+     reserved while scanning. Without traces, the trace fragment ids are free. */
+  #define CODE_CACHE_FRAGMENTS (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO)
+  #define VAR_BB_ALIGN 4 // must be a power of 2
+#else
+  #define CODE_CACHE_FRAGMENTS CODE_CACHE_SIZE
+#endif
+#if defined(DBM_CC_REGIONS) && !defined(DBM_VAR_SIZE_BB)
+  #error "DBM_CC_REGIONS requires DBM_VAR_SIZE_BB"
+#endif
+#ifdef DBM_CC_REGIONS
+  /* When the code cache is full, only the oldest region is evicted (FIFO).
+     Each region owns a fixed range of fragment ids and of code cache space.
+     Regions are smaller than MAX_BRANCH_RANGE, so that any exit can be linked
+     with a single JAL to the fragments of its own region. */
+  #define CC_REGION_NO 16
+#endif
+#if defined(DBM_CC_VENEERS) && !defined(DBM_CC_REGIONS)
+  #error "DBM_CC_VENEERS requires DBM_CC_REGIONS"
+#endif
+#ifdef DBM_CC_VENEERS
+  /* The end of each region is an island of veneers, which link the exits of
+     the region to fragments out of JAL range. A veneer is shared by all the
+     exits of its region linked to the same fragment. */
+  #define CC_VENEER_NO 512
+  #define CC_VENEER_SIZE 16
+#endif
+#if defined(DBM_RAS) && (!defined(DBM_ARCH_RISCV64) || defined(DBM_SHARED_CC))
+  #error "DBM_RAS is only supported on RISC-V without DBM_SHARED_CC"
+#endif
+#ifdef DBM_RAS
+  /* Shadow return address stack of each thread, a ring of RAS_SIZE pointers
+     to the records of the translated calls */
+  #define RAS_MASK (RAS_SIZE * sizeof(uintptr_t) - 1)
+#endif
+#if defined(DBM_IBTC) && (!defined(DBM_ARCH_RISCV64) || defined(DBM_SHARED_CC))
+  #error "DBM_IBTC is only supported on RISC-V without DBM_SHARED_CC"
+#endif
+#ifdef DBM_IBTC
+  /* Each translated indirect branch caches its last IBTC_WAYS targets inline,
+     they are checked before the hash table */
+  #define IBTC_WAYS 2
+#endif
+#if defined(DBM_JUMP_TABLES) && (!defined(DBM_ARCH_RISCV64) || defined(DBM_SHARED_CC) \
+                                   || !defined(DBM_INLINE_HASH))
+  #error "DBM_JUMP_TABLES is only supported on RISC-V with DBM_INLINE_HASH and without DBM_SHARED_CC"
+#endif
+#if defined(DBM_LINK_PLT) && (!defined(DBM_ARCH_RISCV64) || !defined(DBM_LINK_UNCOND_IMM) \
+                                || !defined(DBM_INLINE_HASH))
+  #error "DBM_LINK_PLT is only supported on RISC-V with DBM_LINK_UNCOND_IMM and DBM_INLINE_HASH"
+#endif
+#if defined(DBM_LINK_COND_STUBS) && (!defined(DBM_ARCH_RISCV64) || !defined(DBM_LINK_COND_IMM) \
+                                       || defined(DBM_SHARED_CC))
+  #error "DBM_LINK_COND_STUBS is only supported on RISC-V with DBM_LINK_COND_IMM and without DBM_SHARED_CC"
+#endif
+#if defined(DBM_LOOKAHEAD) && (!defined(DBM_ARCH_RISCV64) || !defined(DBM_LINK_UNCOND_IMM) \
+                                 || !defined(DBM_LINK_COND_IMM))
+  #error "DBM_LOOKAHEAD is only supported on RISC-V with DBM_LINK_UNCOND_IMM and DBM_LINK_COND_IMM"
+#endif
+#ifdef DBM_LOOKAHEAD
+  // Basic blocks translated ahead of execution on a miss of the dispatcher
+  #define LOOKAHEAD_BBS 4
+#endif
+#if defined(DBM_COMPACT_EXITS) && !defined(DBM_ARCH_RISCV64)
+  #error "DBM_COMPACT_EXITS is only supported on RISC-V"
+#endif
+#if defined(DBM_DECODE_CACHE) && !defined(DBM_ARCH_RISCV64)
+  #error "DBM_DECODE_CACHE is only supported on RISC-V"
+#endif
+#ifdef DBM_DECODE_CACHE
+  // Executable mappings which get a table of decoded instructions
+  #define DECODE_TABLE_NO 128
+#endif
+#if defined(DBM_SMC_PROTECT) && !defined(DBM_ARCH_RISCV64)
+  #error "DBM_SMC_PROTECT is only supported on RISC-V"
+#endif
+#if defined(DBM_SPEC_THREAD) && (!defined(DBM_ARCH_RISCV64) || defined(DBM_SHARED_CC))
+  #error "DBM_SPEC_THREAD is only supported on RISC-V without DBM_SHARED_CC"
+#endif
+#ifdef DBM_SPEC_THREAD
+  /* Direct targets queued per thread for the speculative translation thread,
+     which only translates while SPEC_MIN_BBS basic blocks fit in the current
+     code cache region. */
+  #define SPEC_QUEUE_SIZE 64
+  #define SPEC_MIN_BBS 4
+#endif
+#ifdef DBM_JUMP_TABLES
+  /* The jump tables of switch statements found in the read-only data of the
+     images get a translated table of JT_MIN_ENTRIES to JT_MAX_ENTRIES entries.
+     They are allocated from a pool per code cache region, reset with it. */
+  #define JT_MIN_ENTRIES 4
+  #define JT_MAX_ENTRIES 512
+  #define JT_POOL_SIZE 8192
+  #ifdef DBM_CC_REGIONS
+    #define JT_POOL_NO CC_REGION_NO
+  #else
+    #define JT_POOL_NO 1
+  #endif
+#endif
+#ifdef DBM_PERSISTENT_CC
+  // Fixed addresses of the first code cache and its thread data, translations aren't relocatable
+  #define PCC_CODE_CACHE_ADDR  ((void *)0x2000000000)
+  #define PCC_THREAD_DATA_ADDR ((void *)0x2100000000)
+  #define PCC_JUMP_TABLES_ADDR ((void *)0x2200000000)
+  #define PCC_HASH_TABLE_ADDR  ((void *)0x2300000000)
+#endif
+
 #ifdef DBM_ARCH_RISCV64
   #define MAX_BRANCH_RANGE 0x100000
 #else
   #define MAX_BRANCH_RANGE (16*1024*1024)
 #endif
-#define TRACE_CACHE_SIZE (MAX_BRANCH_RANGE - (CODE_CACHE_SIZE*BASIC_BLOCK_SIZE * ARCH_BYTE_ALIGN))
-#define TRACE_LIMIT_OFFSET (2*1024)
+#ifdef DBM_ARCH_RISCV64
+  /* The basic blocks don't fit in JAL range, they are left by large jumps. The
+     trace cache does, so that all branches within and between traces are JALs. */
+  #define TRACE_CACHE_SIZE MAX_BRANCH_RANGE
+  #define TRACE_LIMIT_OFFSET (8*1024)
+#else
+  #define TRACE_CACHE_SIZE (MAX_BRANCH_RANGE - (CODE_CACHE_SIZE*BASIC_BLOCK_SIZE * ARCH_BYTE_ALIGN))
+  #define TRACE_LIMIT_OFFSET (2*1024)
+#endif
 
 #define TRACE_ALIGN 4 // must be a power of 2
 #define TRACE_ALIGN_MASK (TRACE_ALIGN-1)
@@ -77,12 +208,28 @@
 #define TB_CACHE_SIZE 32
 
 #define MAX_BACK_INLINE 5
+
+/* An entry of source_ranges packs the start of a range in the low bits and its
+   length in bytes in the top SOURCE_RANGE_SHIFT bits */
+#define SOURCE_RANGE_SHIFT 48
+#define SOURCE_RANGE_MAX_LEN ((1UL << (64 - SOURCE_RANGE_SHIFT)) - 1)
+#define source_range(start, len) ((uintptr_t)(start) | ((uintptr_t)(len) << SOURCE_RANGE_SHIFT))
+#define source_range_start(range) ((range) & ((1UL << SOURCE_RANGE_SHIFT) - 1))
+#define source_range_end(range) (source_range_start(range) + ((range) >> SOURCE_RANGE_SHIFT))
 #define MAX_TRACE_FRAGMENTS 20
 
+#ifdef DBM_RAS
+#define RAS_SIZE 64 // a power of 2 and at most 256, the index mask is an ANDI immediate
+#else
 #define RAS_SIZE (4096*5)
+#endif
 #define TBB_TARGET_REACHED_SIZE 30
 
 #define MAX_CC_LINKS 1000000
+#define MAX_PENDING_INVAL 16
+#define SOURCE_INDEX_SIZE 4096 // buckets of the source address index, a power of 2
+#define SOURCE_INDEX_SHIFT 12 // the index is keyed by 4 KiB source pages
+#define source_index_bucket(addr) (((addr) >> SOURCE_INDEX_SHIFT) & (SOURCE_INDEX_SIZE - 1))
 
 #define THUMB 0x1
 #define FULLADDR 0x2
@@ -136,7 +283,8 @@ typedef enum {
 #ifdef DBM_ARCH_RISCV64
   uncond_imm_riscv,
   uncond_reg_riscv,
-  cond_imm_riscv
+  cond_imm_riscv,
+  trace_exit,
 #endif // DBM_ARCH_RISCV64
 } branch_type;
 
@@ -160,6 +308,59 @@ typedef struct {
 #define FALLTHROUGH_LINKED (1 << 0)
 #define BRANCH_LINKED (1 << 1)
 #define BOTH_LINKED (1 << 2)
+/* RISC-V: the exit can't be linked, the dispatcher trampoline looks up its
+   target without calling the dispatcher (tested as 8 in dispatcher_riscv.s) */
+#define BRANCH_NO_LINK (1 << 3)
+
+#ifdef DBM_RAS
+/* Emitted in the code cache by each translated call */
+typedef struct ras_record {
+  uintptr_t spc; // return address
+  uintptr_t tpc; // its translation, 0 until set by the dispatcher
+  struct ras_record *prev; // previous record in the same fragment, for inlined calls
+} ras_record;
+#endif
+
+#ifdef DBM_IBTC
+/* Emitted in the code cache by each translated indirect branch, IBTC_WAYS times */
+typedef struct {
+  uintptr_t spc; // target, 0 if the way is free
+  uintptr_t tpc; // its translation
+} ibtc_entry;
+#endif
+
+#ifdef DBM_JUMP_TABLES
+/* Translated jump table entry, the index is taken from the address of the
+   source entry loaded by the translated code */
+typedef struct {
+  uintptr_t spc; // target of the source entry, checked against the loaded target
+  uintptr_t tpc; // its translation, 0 until set by the dispatcher
+} jump_table_entry;
+#endif
+
+#ifdef DBM_DECODE_CACHE
+/* An instruction decoded by the scanner. The properties only depend on the
+   encoding, so an entry stays valid while the source holds the same one and
+   never needs to be invalidated. The plugin API reads the other properties
+   through mambo_context. */
+typedef struct {
+  uint32_t word; // encoding, the upper half is 0 for compressed instructions, 0 if free
+  int16_t inst; // riscv_instruction
+  uint8_t len; // in bytes
+  int8_t ld_st_size; // in bytes, -1 if it's not a load or store
+  uint32_t branch_type; // mambo_branch_type
+} decode_cache_entry;
+
+/* The decoded instructions of an executable mapping, one entry per halfword
+   of [start, end). The tables are shared by all threads and kept when the code
+   caches are flushed. A table is never freed or reused for another range,
+   only its pages are released when the mapping goes away. */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  decode_cache_entry *entries;
+} decode_table;
+#endif
 
 #define MAX_SAVED_EXIT_SZ 12
 typedef struct {
@@ -177,7 +378,20 @@ typedef struct {
 #ifdef DBM_ARCH_RISCV64
   uint16_t *exit_branch_addr; /**< Beginning of the instrumented exit */
   mambo_cond branch_condition; /**< Exit branch condition */
+  uint16_t *source_start; /**< Start of the first translated source range */
+  uint16_t *source_end; /**< End of the first translated source range */
+  ll_entry *source_ranges; /**< Other source ranges, of the inlined jump targets */
 #endif // DBM_ARCH_RISCV64
+#ifdef DBM_RAS
+  ras_record *ras_call; /**< Record of the last call in the fragment */
+#endif
+#ifdef DBM_IBTC
+  ibtc_entry *ibtc; /**< Inline target cache of the indirect branch ending the fragment */
+#endif
+#ifdef DBM_JUMP_TABLES
+  jump_table_entry *jump_table; /**< Translated jump table of the indirect branch ending the fragment */
+  int jump_table_size; /**< Number of entries of jump_table */
+#endif
   uintptr_t branch_taken_addr; /**< Address of taken branch */
   uintptr_t branch_skipped_addr; /**< Address of other branch taken */
   uintptr_t branch_cache_status; /**< Linkage status */
@@ -201,6 +415,9 @@ struct trace_exits {
 #ifdef __aarch64__
   int fragment_id;
 #endif
+#ifdef DBM_ARCH_RISCV64
+  mambo_cond cond; // condition of the branch to the exit stub
+#endif
 };
 
 #define MAX_TRACE_REC_EXITS (MAX_TRACE_FRAGMENTS+1)
@@ -226,13 +443,39 @@ struct dbm_thread_s {
   enum dbm_thread_status status;
 
   int free_block;
+#ifdef DBM_VAR_SIZE_BB
+  uintptr_t free_addr; // first byte after the last fragment or reservation
+  uint32_t *bb_offset; // CODE_CACHE_FRAGMENTS entries, fragment id -> offset in code_cache->blocks
+#endif
+#ifdef DBM_CC_REGIONS
+  int cc_region; // region receiving new fragments, described by free_block and free_addr
+  int region_free_bb[CC_REGION_NO];
+  uintptr_t region_free_addr[CC_REGION_NO];
+  uint64_t region_evictions;
+  int cc_regions_committed; // the code cache is only reserved past these regions
+  int scan_region; // region of the fragment being scanned, never evicted, or -1
+#endif
+#ifdef DBM_CC_VENEERS
+  int region_veneers[CC_REGION_NO]; // veneers allocated in the island of each region
+  // CC_REGION_NO rows each, allocated with the first veneer
+  uintptr_t (*veneer_target)[CC_VENEER_NO]; // 0 if the veneer is free
+  ll_entry *(*veneer_linked_from)[CC_VENEER_NO]; // exits linked through it
+#endif
   bool was_flushed;
   uintptr_t dispatcher_addr;
   uintptr_t syscall_wrapper_addr;
+#ifdef DBM_COMPACT_EXITS
+  uintptr_t exit_trampoline_addr;
+#endif
 
   dbm_code_cache *code_cache;
-  dbm_code_cache_meta code_cache_meta[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO];
-  hash_table entry_address;
+  // CODE_CACHE_SIZE + TRACE_FRAGMENT_NO entries reserved, committed by cc_meta_commit()
+  dbm_code_cache_meta *code_cache_meta;
+  int meta_committed; // code_cache_meta[0, meta_committed) is accessible
+#ifdef DBM_TRACES
+  int trace_meta_committed; // and code_cache_meta[CODE_CACHE_SIZE, trace_meta_committed)
+#endif
+  hash_table *entry_address;
 #ifdef DBM_TRACES
   uint8_t   exec_count[CODE_CACHE_SIZE];
   uintptr_t trace_head_incr_addr;
@@ -243,6 +486,52 @@ struct dbm_thread_s {
 #endif
 
   ll *cc_links;
+#ifdef DBM_ARCH_RISCV64
+  ll_entry **source_index; // SOURCE_INDEX_SIZE buckets of fragment ids, by source page
+  bool source_index_full; // a fragment couldn't be indexed, all fragments are checked
+#endif
+#ifdef DBM_DECODE_CACHE
+  decode_table *decode_table; // of the last instruction scanned, NULL if it had none
+#endif
+
+#ifdef DBM_ARCH_RISCV64
+  /* Source ranges invalidated by other threads, applied by the dispatcher of
+     this thread. Protected by the thread list lock. */
+  int pending_inval_count;
+  uintptr_t pending_inval_start[MAX_PENDING_INVAL];
+  uintptr_t pending_inval_end[MAX_PENDING_INVAL];
+  bool inval_signal_sent; // an UNLINK_SIGNAL was sent to apply them, cleared by its handler
+#endif
+
+#ifdef DBM_SPEC_THREAD
+  /* Ring of untranslated direct targets, consumed by the speculative
+     translation thread. Protected by the code cache lock. */
+  uintptr_t spec_queue[SPEC_QUEUE_SIZE];
+  unsigned int spec_head;
+  unsigned int spec_tail;
+#endif
+
+#ifdef DBM_RAS
+  /* Byte offset of the top of the shadow return address stack, only the bits
+     in RAS_MASK are used. The translated code expects ras to follow ras_top. */
+  uintptr_t ras_top;
+  ras_record *ras[RAS_SIZE];
+  ras_record ras_empty; // matches no return address
+#endif
+
+#ifdef DBM_JUMP_TABLES
+  int jump_table_free[JT_POOL_NO];
+  jump_table_entry (*jump_tables)[JT_POOL_SIZE]; // JT_POOL_NO pools, allocated with the first table
+#endif
+
+#ifdef DBM_DEFER_ICACHE_FLUSH
+  /* Code cache range written since the last I-cache flush, [start, end) */
+  uintptr_t icache_dirty_start;
+  uintptr_t icache_dirty_end;
+#ifdef ICACHE_STATS
+  uint64_t  icache_flushes_avoided;
+#endif
+#endif
 
   uintptr_t tls;
   uintptr_t child_tls;
@@ -303,6 +592,9 @@ typedef struct {
   int argc;
   char **argv;
   interval_map exec_allocs;
+#ifdef DBM_JUMP_TABLES
+  interval_map rodata_allocs; // read-only data sections of the executable images
+#endif
 
   uintptr_t signal_handlers[_NSIG];
   pthread_mutex_t signal_handlers_mutex;
@@ -316,11 +608,42 @@ typedef struct {
 
   volatile int exit_group;
 
+#if defined(DBM_DEFER_ICACHE_FLUSH) && defined(ICACHE_STATS)
+  uint64_t icache_flushes_avoided; // accumulated from exited threads
+#endif
+
+#ifdef DBM_DECODE_CACHE
+  decode_table decode_tables[DECODE_TABLE_NO];
+  int decode_table_count; // published after the table, read without the mutex
+  pthread_mutex_t decode_table_mutex;
+#endif
+
 #ifdef PLUGINS_NEW
   int free_plugin;
   mambo_plugin plugins[MAX_PLUGIN_NO];
   watched_functions_t watched_functions;
 #endif
+
+#ifdef DBM_SHARED_CC
+  /* Owner of the process-wide code cache, its metadata, hash table and links.
+     It is not a running thread and is never registered or freed. */
+  dbm_thread *shared_cc;
+  pthread_mutex_t shared_cc_mutex;
+#endif
+#ifdef DBM_SMC_PROTECT
+  /* Executable mappings the application can write, and the pages of them
+     write-protected because they hold translated code (key and value are the
+     page address). Both are protected by smc_mutex. */
+  interval_map smc_writable;
+  hash_table *smc_pages;
+  pthread_mutex_t smc_mutex;
+#endif
+#ifdef DBM_SPEC_THREAD
+  /* The code cache lock of all threads, also held by the speculative
+     translation thread while it translates into any of them */
+  pthread_mutex_t spec_mutex;
+  pthread_cond_t spec_cond; // signalled when a target is queued
+#endif
 } dbm_global;
 
 typedef struct {
@@ -333,6 +656,9 @@ void thread_abort(dbm_thread *thread_data);
 
 extern void dispatcher_trampoline();
 extern void syscall_wrapper();
+#ifdef DBM_COMPACT_EXITS
+extern void exit_trampoline();
+#endif
 extern void trace_head_incr();
 extern void* start_of_dispatcher_s;
 extern void* end_of_dispatcher_s;
@@ -344,14 +670,30 @@ extern void syscall_wrapper_svc();
 extern int* gp_tp_mambo_ctx;
 extern void* gp_shadow;
 extern void* tp_shadow;
+extern uint8_t *trace_exec_count;
+extern hash_entry *hash_entries_ptr;
+extern uintptr_t *hash_index_mask_ptr;
+extern uintptr_t *hash_epoch_ptr;
+extern uintptr_t *hash_seq_ptr;
+extern int *pending_inval_count_ptr;
+extern dbm_code_cache_meta *code_cache_meta_ptr;
+extern size_t code_cache_meta_size;
+extern uintptr_t *branch_status_ptr;
 #endif
 
 int lock_thread_list(void);
 int unlock_thread_list(void);
+int lock_code_cache(void);
+int unlock_code_cache(void);
 int register_thread(dbm_thread *thread_data, bool caller_has_lock);
 int unregister_thread(dbm_thread *thread_data, bool caller_has_lock);
 bool allocate_thread_data(dbm_thread **thread_data);
 int free_thread_data(dbm_thread *thread_data);
+void *thread_array_alloc(void *addr, size_t size);
+void cc_meta_commit(dbm_thread *thread_data, int id);
+#ifdef DBM_DECODE_CACHE
+decode_table *decode_table_find(uintptr_t addr);
+#endif
 void init_thread(dbm_thread *thread_data);
 void reset_process(dbm_thread *thread_data);
 
@@ -363,8 +705,36 @@ uint32_t scan_a32(dbm_thread *thread_data, uint32_t *read_address, int basic_blo
 uint32_t scan_t32(dbm_thread *thread_data, uint16_t *read_address, int basic_block, cc_type type, uint16_t *write_p);
 size_t   scan_a64(dbm_thread *thread_data, uint32_t *read_address, int basic_block, cc_type type, uint32_t *write_p);
 int allocate_bb(dbm_thread *thread_data);
+#ifdef DBM_VAR_SIZE_BB
+void trim_bb(dbm_thread *thread_data, uintptr_t end);
+#endif
 void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_index, dbm_thread *thread_data);
 void flush_code_cache(dbm_thread *thread_data);
+#ifdef DBM_ARCH_RISCV64
+void cc_add_source_range(dbm_thread *thread_data, int fragment, uintptr_t start, uintptr_t end);
+void cc_free_source_ranges(dbm_thread *thread_data, int fragment);
+void cc_index_source(dbm_thread *thread_data, int fragment);
+bool cc_source_overlaps(dbm_thread *thread_data, int fragment, uintptr_t start, uintptr_t end);
+void cc_invalidate_range(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+void invalidate_source_range(uintptr_t start, uintptr_t end);
+void apply_pending_invalidations(dbm_thread *thread_data);
+void apply_pending_invalidations_in_cc(dbm_thread *thread_data);
+#endif
+#ifdef DBM_SMC_PROTECT
+void smc_protect(dbm_thread *thread_data, int fragment);
+bool smc_write_fault(uintptr_t addr);
+#endif
+#ifdef DBM_SPEC_THREAD
+void start_spec_thread();
+#endif
+void cc_mark_dirty(dbm_thread *thread_data, void *start, void *end);
+void cc_sync_icache(dbm_thread *thread_data);
+#ifdef DBM_PERSISTENT_CC
+void persistent_cc_load(dbm_thread *thread_data, Elf *elf);
+void persistent_cc_save(dbm_thread *thread_data);
+void persistent_cc_notify_map(dbm_thread *thread_data, uintptr_t start, uintptr_t end);
+void persistent_cc_notify_flush(dbm_thread *thread_data);
+#endif
 #if defined(__arm__) || defined(__aarch64__)
 void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int cond);
 #endif
@@ -372,6 +742,9 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 
 void thumb_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
 void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t target);
+#ifdef DBM_ARCH_RISCV64
+void riscv_encode_stub_bb(dbm_thread *thread_data, int basic_block, uintptr_t target);
+#endif
 
 int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr);
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr);
@@ -399,6 +772,89 @@ inline static uintptr_t adjust_cc_entry(uintptr_t addr) {
 }
 
 extern dbm_global global_data;
+
+/* Returns the thread data which holds the code cache used by thread_data */
+#ifdef DBM_SHARED_CC
+  #define cc_thread(thread_data) (global_data.shared_cc)
+#else
+  #define cc_thread(thread_data) (thread_data)
+#endif
+
+#define trampolines_size_bytes         ((uintptr_t)&end_of_dispatcher_s - (uintptr_t)&start_of_dispatcher_s)
+#define trampolines_size_bbs           ((trampolines_size_bytes / sizeof(dbm_block)) \
+                                      + ((trampolines_size_bytes % sizeof(dbm_block)) ? 1 : 0))
+
+#ifdef DBM_CC_REGIONS
+#define CC_REGION_BBS ((CODE_CACHE_FRAGMENTS - trampolines_size_bbs) / CC_REGION_NO)
+#define CC_REGION_SIZE ((((CODE_CACHE_SIZE - trampolines_size_bbs) * sizeof(dbm_block)) / CC_REGION_NO) \
+                        & ~(uintptr_t)(VAR_BB_ALIGN - 1))
+#define cc_region_first_bb(region) (trampolines_size_bbs + (region) * CC_REGION_BBS)
+#define cc_bb_region(bb) (((bb) - trampolines_size_bbs) / CC_REGION_BBS)
+#define cc_region_start(thread_data, region) \
+  ((uintptr_t)&(thread_data)->code_cache->blocks[trampolines_size_bbs] + (region) * CC_REGION_SIZE)
+#ifdef DBM_CC_VENEERS
+  #define cc_region_end(thread_data, region) \
+    (cc_region_start(thread_data, (region) + 1) - CC_VENEER_NO * CC_VENEER_SIZE)
+  #define cc_veneer_addr(thread_data, region, veneer) \
+    (cc_region_start(thread_data, (region) + 1) - ((veneer) + 1) * CC_VENEER_SIZE)
+#else
+  #define cc_region_end(thread_data, region) cc_region_start(thread_data, (region) + 1)
+#endif
+
+static inline int cc_region_free_bb(dbm_thread *thread_data, int region) {
+  if (region == thread_data->cc_region) {
+    return thread_data->free_block;
+  }
+  return thread_data->region_free_bb[region];
+}
+
+static inline uintptr_t cc_region_free_addr(dbm_thread *thread_data, int region) {
+  if (region == thread_data->cc_region) {
+    return thread_data->free_addr;
+  }
+  return thread_data->region_free_addr[region];
+}
+#endif
+
+/* Returns the address of the code of basic block bb */
+static inline uintptr_t cc_bb_addr(dbm_thread *thread_data, int bb) {
+#ifdef DBM_VAR_SIZE_BB
+  return (uintptr_t)thread_data->code_cache->blocks + thread_data->bb_offset[bb];
+#else
+  return (uintptr_t)&thread_data->code_cache->blocks[bb];
+#endif
+}
+
+/* Returns the end of the space available to basic block bb */
+static inline uintptr_t cc_bb_end(dbm_thread *thread_data, int bb) {
+#ifdef DBM_CC_REGIONS
+  if (bb < trampolines_size_bbs) {
+    return (uintptr_t)&thread_data->code_cache->blocks[bb + 1];
+  }
+  int region = cc_bb_region(bb);
+  if (bb + 1 < cc_region_free_bb(thread_data, region)) {
+    return cc_bb_addr(thread_data, bb + 1);
+  }
+  return cc_region_free_addr(thread_data, region);
+#elif defined(DBM_VAR_SIZE_BB)
+  if (bb + 1 < thread_data->free_block) {
+    return cc_bb_addr(thread_data, bb + 1);
+  }
+  return thread_data->free_addr;
+#else
+  return (uintptr_t)&thread_data->code_cache->blocks[bb + 1];
+#endif
+}
+
+/* Returns the first unused address in the basic block area of the code cache */
+static inline uintptr_t cc_free_addr(dbm_thread *thread_data) {
+#ifdef DBM_VAR_SIZE_BB
+  return thread_data->free_addr;
+#else
+  return (uintptr_t)&thread_data->code_cache->blocks[thread_data->free_block];
+#endif
+}
+
 extern uintptr_t page_size;
 extern dbm_thread *disp_thread_data;
 extern uint32_t *th_is_pending_ptr;
@@ -419,7 +875,14 @@ void mambo_deliver_callbacks_code(unsigned cb_id, dbm_thread *thread_data, cc_ty
                                   int fragment_id, inst_set inst_type, int inst, mambo_cond cond,
                                   void *read_address, void *write_p, void *data_p, bool *stop);
 void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func);
+#if defined(PLUGINS_NEW) && defined(DBM_ARCH_RISCV64)
+mambo_branch_type _riscv_get_branch_type(int inst, void *read_address);
+int _riscv_get_ld_st_size(int inst);
+#endif
 int function_watch_parse_elf(watched_functions_t *self, Elf *elf, void *base_addr);
+#ifdef DBM_JUMP_TABLES
+int rodata_parse_elf(interval_map *map, Elf *elf, uintptr_t addr, off_t off);
+#endif
 int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
                        mambo_callback pre_callback, mambo_callback post_callback);
 
@@ -438,12 +901,14 @@ int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
   #define CC_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
 #endif
 
+/* The metadata is sized for the worst case but only the pages actually used
+   are touched, so no swap space is reserved for it */
 #ifdef METADATA_HUGETLB
   #define METADATA_PAGE_SIZE (2*1024*1024)
-  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB)
+  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_HUGETLB)
 #else
   #define METADATA_PAGE_SIZE (page_size)
-  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS)
+  #define METADATA_MMAP_OPTS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE)
 #endif
 
 #define ROUND_UP(input, multiple_of) \
@@ -454,10 +919,6 @@ int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
 
 #define PAGE_SIZE (page_size != 0 ? page_size : (page_size = getauxval(AT_PAGESZ)))
 
-#define trampolines_size_bytes         ((uintptr_t)&end_of_dispatcher_s - (uintptr_t)&start_of_dispatcher_s)
-#define trampolines_size_bbs           ((trampolines_size_bytes / sizeof(dbm_block)) \
-                                      + ((trampolines_size_bytes % sizeof(dbm_block)) ? 1 : 0))
-
 #define UNLINK_SIGNAL (SIGILL)
 #define CPSR_T (0x20)
 
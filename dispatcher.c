@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <limits.h>
+#include <assert.h>
 
 #include "dbm.h"
 #include "scanner_common.h"
@@ -65,12 +66,27 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 #ifdef __arm__
     if (source_branch_type != tbb && source_branch_type != tbh)
 #endif
-      return trace_dispatcher(target, next_addr, source_index, thread_data);
+    {
+      int ret = lock_code_cache();
+      assert(ret == 0);
+      trace_dispatcher(target, next_addr, source_index, thread_data);
+      cc_sync_icache(thread_data);
+      ret = unlock_code_cache();
+      assert(ret == 0);
+      return;
+    }
   }
 #endif
 
   debug("Reached the dispatcher, target: 0x%x, ret: %p, src: %d thr: %p\n", target, next_addr, source_index, thread_data);
+  /* With DBM_SHARED_CC, thread_data is global_data.shared_cc, passed by the
+     shared dispatcher trampoline. The running thread is current_thread. */
+  int ret = lock_code_cache();
+  assert(ret == 0);
   thread_data->was_flushed = false;
+#if defined(DBM_ARCH_RISCV64) && !defined(DBM_SHARED_CC)
+  apply_pending_invalidations(thread_data);
+#endif
   block_address = lookup_or_scan(thread_data, target, &cached);
   if (cached) {
     debug("Found block from %d for 0x%x in cache at 0x%x\n", source_index, target, block_address);
@@ -82,6 +98,9 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 
   // Bypass any linking
   if (source_index == 0 || thread_data->was_flushed) {
+    cc_sync_icache(thread_data);
+    ret = unlock_code_cache();
+    assert(ret == 0);
     return;
   }
 
@@ -94,4 +113,9 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 #ifdef DBM_ARCH_RISCV64
   dispatcher_riscv(thread_data, source_index, source_branch_type, target, block_address);
 #endif
+
+  // Make the new and modified code visible before returning to the code cache
+  cc_sync_icache(thread_data);
+  ret = unlock_code_cache();
+  assert(ret == 0);
 }
@@ -31,6 +31,7 @@
 #include <unistd.h>
 
 #include "../dbm.h"
+#include "../common.h"
 #include "elf_loader.h"
 
 int get_symbol_info_by_addr(uintptr_t addr, char **sym_name, void **start_addr, char **filename) {
@@ -340,3 +341,47 @@ int function_watch_parse_elf(watched_functions_t *self, Elf *elf, void *base_add
   } // while scn iterator
   return 0;
 }
+
+#ifdef DBM_JUMP_TABLES
+/* Records the read-only data sections of the image mapped at addr from the
+   file offset off, where the compiler places the jump tables of switch statements */
+int rodata_parse_elf(interval_map *map, Elf *elf, uintptr_t addr, off_t off) {
+  Elf_Scn *scn = NULL;
+  GElf_Ehdr ehdr;
+  GElf_Phdr phdr;
+  GElf_Shdr shdr;
+  size_t phnum, shstrndx;
+  uintptr_t bias = 0;
+  bool found = false;
+
+  if (gelf_getehdr(elf, &ehdr) == NULL || elf_getphdrnum(elf, &phnum) != 0
+      || elf_getshdrstrndx(elf, &shstrndx) != 0) {
+    return -1;
+  }
+
+  // The mapping is one of the loadable segments, which gives the load bias
+  for (size_t i = 0; i < phnum && !found; i++) {
+    if (gelf_getphdr(elf, i, &phdr) != NULL && phdr.p_type == PT_LOAD
+        && align_lower(phdr.p_offset, PAGE_SIZE) == off) {
+      if (ehdr.e_type == ET_DYN) {
+        bias = addr - align_lower(phdr.p_vaddr, PAGE_SIZE);
+      }
+      found = true;
+    }
+  }
+  if (!found) return -1;
+
+  while((scn = elf_nextscn(elf, scn)) != NULL) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type == SHT_PROGBITS && shdr.sh_size > 0 && (shdr.sh_flags & SHF_ALLOC)
+        && (shdr.sh_flags & (SHF_WRITE | SHF_EXECINSTR)) == 0) {
+      char *name = elf_strptr(elf, shstrndx, shdr.sh_name);
+      if (name != NULL && strncmp(name, ".rodata", 7) == 0) {
+        int ret = interval_map_add(map, bias + shdr.sh_addr, bias + shdr.sh_addr + shdr.sh_size, -1);
+        assert(ret == 0);
+      }
+    }
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,585 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Persistent translation cache
+
+  The contents of the code cache of the first thread are saved on exit to
+  $MAMBO_CC_DIR/<key>.mcc, where the key is derived from the build-id of the
+  application and from the MAMBO build and plugin set. On the next run, the
+  translated blocks are copied back into the code cache before the first scan.
+
+  Translations contain absolute addresses (e.g. of the hash table used by the
+  inline hash lookup), so the code cache, the thread data, the hash table and
+  the jump table pools of the first thread are mapped at fixed addresses.
+  Pointers into the other per-run allocations (the link pool) are rebased
+  while loading.
+
+  A restored block only becomes reachable once the executable mapping
+  containing its source address has been validated: it must be mapped at the
+  same address as in the run which saved the file and its contents must have
+  the same hash. Images mapped later by the dynamic linker are validated from
+  notify_vm_op().
+
+  The translations aren't relocatable. With ASLR, an image is usually mapped
+  at another base than in the run which saved the file: if the application or
+  the interpreter have moved, the whole file is rejected; if a library mapped
+  later has moved, its restored blocks are invalidated and it's translated
+  again. The cache saved on exit then describes the new layout.
+*/
+
+#ifdef DBM_PERSISTENT_CC
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <gelf.h>
+
+#include "dbm.h"
+#include "common.h"
+
+#ifdef DEBUG
+  #define debug(...) log("dbm", __VA_ARGS__)
+#else
+  #define debug(...)
+#endif
+
+#define PCC_MAGIC 0x4343504d // "MPCC"
+#define PCC_VERSION 11
+#define PCC_MAX_IMAGES 64
+#define PCC_BUILD_ID_MAX 64
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uintptr_t code_cache;
+  uintptr_t thread_data;
+  uintptr_t jump_tables;
+  uintptr_t hash_table;
+  int32_t free_block;
+  uint64_t code_size;
+  int32_t image_count;
+  int64_t entry_count;
+  int64_t link_count;
+  int64_t range_count;
+} pcc_header;
+
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  uint64_t hash;
+  bool valid;
+} pcc_image;
+
+typedef struct {
+  uintptr_t spc;
+  uintptr_t tpc;
+  int32_t image;
+} pcc_entry;
+
+typedef struct {
+  int32_t linked_to;
+  uintptr_t linked_from;
+} pcc_link;
+
+typedef struct {
+  int32_t fragment;
+  uintptr_t range;
+} pcc_range;
+
+static struct {
+  bool enabled;
+  char path[PATH_MAX];
+  uint64_t key;
+  dbm_thread *thread_data;
+
+  int image_count;
+  pcc_image images[PCC_MAX_IMAGES];
+
+  // Hash table entries of restored blocks which are waiting for their image to be validated
+  int64_t entry_count;
+  pcc_entry *entries;
+} pcc;
+
+static uint64_t pcc_hash(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int pcc_get_build_id(Elf *elf, uint8_t *build_id, size_t *size) {
+  Elf_Scn *scn = NULL;
+  GElf_Shdr shdr;
+
+  while((scn = elf_nextscn(elf, scn)) != NULL) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type == SHT_NOTE) {
+      Elf_Data *edata = elf_getdata(scn, NULL);
+      size_t offset = 0, name_off, desc_off;
+      GElf_Nhdr nhdr;
+
+      while (edata != NULL && (offset = gelf_getnote(edata, offset, &nhdr, &name_off, &desc_off)) > 0) {
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_descsz <= PCC_BUILD_ID_MAX) {
+          memcpy(build_id, (uint8_t *)edata->d_buf + desc_off, nhdr.n_descsz);
+          *size = nhdr.n_descsz;
+          return 0;
+        }
+      }
+    }
+  }
+
+  return -1;
+}
+
+static uint64_t pcc_get_key(uint8_t *build_id, size_t size) {
+  uint64_t key = 0xcbf29ce484222325ULL;
+
+  key = pcc_hash(key, build_id, size);
+  // Any change to MAMBO or to the set of plugins invalidates the translations
+  key = pcc_hash(key, GIT_VERSION, sizeof(GIT_VERSION));
+  uintptr_t addr = (uintptr_t)&start_of_dispatcher_s;
+  key = pcc_hash(key, &addr, sizeof(addr));
+  addr = (uintptr_t)scan;
+  key = pcc_hash(key, &addr, sizeof(addr));
+#ifdef PLUGINS_NEW
+  key = pcc_hash(key, &global_data.free_plugin, sizeof(global_data.free_plugin));
+  for (int i = 0; i < global_data.free_plugin; i++) {
+    key = pcc_hash(key, global_data.plugins[i].cbs, sizeof(global_data.plugins[i].cbs));
+  }
+#endif
+
+  return key;
+}
+
+static uintptr_t pcc_jump_tables(dbm_thread *thread_data) {
+#ifdef DBM_JUMP_TABLES
+  return (uintptr_t)thread_data->jump_tables;
+#else
+  return 0;
+#endif
+}
+
+static uint64_t pcc_image_hash(uintptr_t start, uintptr_t end) {
+  return pcc_hash(0xcbf29ce484222325ULL, (void *)start, end - start);
+}
+
+static int pcc_read(int fd, void *buf, size_t size) {
+  while (size > 0) {
+    ssize_t ret = read(fd, buf, size);
+    if (ret <= 0) return -1;
+    buf += ret;
+    size -= ret;
+  }
+  return 0;
+}
+
+static int pcc_write(int fd, void *buf, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, buf, size);
+    if (ret <= 0) return -1;
+    buf += ret;
+    size -= ret;
+  }
+  return 0;
+}
+
+static int pcc_find_image(uintptr_t addr) {
+  for (int i = 0; i < pcc.image_count; i++) {
+    if (addr >= pcc.images[i].start && addr < pcc.images[i].end) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Makes the restored blocks of a validated image reachable */
+static void pcc_publish_image(int image) {
+  dbm_thread *thread_data = pcc.thread_data;
+  int64_t count = 0;
+
+  for (int64_t i = 0; i < pcc.entry_count; i++) {
+    if (pcc.entries[i].image == image) {
+      if (!hash_add(thread_data->entry_address, pcc.entries[i].spc, pcc.entries[i].tpc)) {
+        fprintf(stderr, "Failed to add hash table entry for a restored basic block\n");
+        while(1);
+      }
+      pcc.entries[i].image = -1;
+      count++;
+    }
+  }
+  debug("Persistent cache: image %d: %" PRId64 " blocks restored\n", image, count);
+}
+
+/* Returns the index of a saved image which has been mapped at another base
+   as [start, end), or -1 */
+static int pcc_find_moved_image(uintptr_t start, uintptr_t end) {
+  uint64_t hash = 0;
+  bool hashed = false;
+
+  for (int i = 0; i < pcc.image_count; i++) {
+    pcc_image *image = &pcc.images[i];
+    if (!image->valid && image->start != start && image->end - image->start == end - start) {
+      if (!hashed) {
+        hash = pcc_image_hash(start, end);
+        hashed = true;
+      }
+      if (hash == image->hash) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Drops the restored blocks of a saved image which doesn't match the code mapped
+   now. They are never published, but the blocks of other images may have been
+   linked to them by an indirect branch */
+static void pcc_drop_image(int index) {
+  pcc_image *image = &pcc.images[index];
+  for (int64_t i = 0; i < pcc.entry_count; i++) {
+    if (pcc.entries[i].image == index) {
+      pcc.entries[i].image = -1;
+    }
+  }
+  cc_invalidate_range(pcc.thread_data, image->start, image->end);
+  image->valid = true;
+}
+
+static void pcc_validate_image(uintptr_t start, uintptr_t end) {
+  for (int i = 0; i < pcc.image_count; i++) {
+    pcc_image *image = &pcc.images[i];
+    if (!image->valid && image->start == start && image->end == end) {
+      if (pcc_image_hash(start, end) == image->hash) {
+        image->valid = true;
+        pcc_publish_image(i);
+        return;
+      }
+      debug("Persistent cache: image %d at 0x%" PRIxPTR " has changed\n", i, start);
+      pcc_drop_image(i);
+      break;
+    }
+  }
+
+  int moved = pcc_find_moved_image(start, end);
+  if (moved >= 0) {
+    debug("Persistent cache: image %d moved from 0x%" PRIxPTR " to 0x%" PRIxPTR "\n",
+          moved, pcc.images[moved].start, start);
+    pcc_drop_image(moved);
+  }
+}
+
+/* Restores the translations from fd, returns -1 if the file can't be used */
+static int pcc_load_file(dbm_thread *thread_data, int fd) {
+  pcc_header header;
+
+  if (pcc_read(fd, &header, sizeof(header)) != 0
+      || header.magic != PCC_MAGIC || header.version != PCC_VERSION || header.key != pcc.key
+      || header.image_count > PCC_MAX_IMAGES || header.free_block > CODE_CACHE_FRAGMENTS
+      || header.free_block < trampolines_size_bbs || header.entry_count < 0
+      || header.code_size > sizeof(dbm_block) * (CODE_CACHE_SIZE - trampolines_size_bbs)) {
+    return -1;
+  }
+#ifdef DBM_CC_REGIONS
+  // Only the first region is saved, the others are not even committed yet
+  if (header.free_block > cc_region_first_bb(1)
+      || header.code_size > cc_region_end(thread_data, 0) - cc_region_start(thread_data, 0)) {
+    return -1;
+  }
+#endif
+  if (header.code_cache != (uintptr_t)thread_data->code_cache
+      || header.thread_data != (uintptr_t)thread_data
+      || header.jump_tables != pcc_jump_tables(thread_data)
+      || header.hash_table != (uintptr_t)thread_data->entry_address) {
+    debug("Persistent cache: the code cache can't be mapped at the same address\n");
+    return -1;
+  }
+
+  int block_count = header.free_block - trampolines_size_bbs;
+  cc_meta_commit(thread_data, header.free_block - 1);
+  pcc.entries = malloc(sizeof(pcc_entry) * header.entry_count);
+  if (pcc.entries == NULL
+      || pcc_read(fd, pcc.images, sizeof(pcc_image) * header.image_count) != 0
+      || pcc_read(fd, &thread_data->code_cache->blocks[trampolines_size_bbs], header.code_size) != 0
+#ifdef DBM_VAR_SIZE_BB
+      || pcc_read(fd, &thread_data->bb_offset[trampolines_size_bbs], sizeof(uint32_t) * block_count) != 0
+#endif
+      || pcc_read(fd, &thread_data->code_cache_meta[trampolines_size_bbs],
+                  sizeof(dbm_code_cache_meta) * block_count) != 0
+      || pcc_read(fd, pcc.entries, sizeof(pcc_entry) * header.entry_count) != 0) {
+    return -1;
+  }
+
+  // Rebuild the incoming links and the source ranges in this run's link pool
+  for (int i = trampolines_size_bbs; i < header.free_block; i++) {
+    thread_data->code_cache_meta[i].linked_from = NULL;
+    thread_data->code_cache_meta[i].source_ranges = NULL;
+#ifdef DBM_JUMP_TABLES
+    // The translated jump tables aren't saved, the restored lookups miss
+    thread_data->code_cache_meta[i].jump_table = NULL;
+    thread_data->code_cache_meta[i].jump_table_size = 0;
+#endif
+  }
+  for (int64_t i = 0; i < header.link_count; i++) {
+    pcc_link link;
+    if (pcc_read(fd, &link, sizeof(link)) != 0
+        || link.linked_to < trampolines_size_bbs || link.linked_to >= header.free_block) {
+      return -1;
+    }
+    ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+    if (entry == NULL) {
+      return -1;
+    }
+    entry->data = link.linked_from;
+    entry->next = thread_data->code_cache_meta[link.linked_to].linked_from;
+    thread_data->code_cache_meta[link.linked_to].linked_from = entry;
+  }
+  for (int64_t i = 0; i < header.range_count; i++) {
+    pcc_range range;
+    if (pcc_read(fd, &range, sizeof(range)) != 0
+        || range.fragment < trampolines_size_bbs || range.fragment >= header.free_block) {
+      return -1;
+    }
+    ll_entry *entry = linked_list_alloc(thread_data->cc_links);
+    if (entry == NULL) {
+      return -1;
+    }
+    entry->data = range.range;
+    entry->next = thread_data->code_cache_meta[range.fragment].source_ranges;
+    thread_data->code_cache_meta[range.fragment].source_ranges = entry;
+  }
+  for (int i = trampolines_size_bbs; i < header.free_block; i++) {
+    cc_index_source(thread_data, i);
+  }
+
+  pcc.image_count = header.image_count;
+  pcc.entry_count = header.entry_count;
+  thread_data->free_block = header.free_block;
+#ifdef DBM_VAR_SIZE_BB
+  thread_data->free_addr = (uintptr_t)&thread_data->code_cache->blocks[trampolines_size_bbs] + header.code_size;
+#endif
+  cc_mark_dirty(thread_data, &thread_data->code_cache->blocks[trampolines_size_bbs],
+                (void *)cc_free_addr(thread_data));
+
+  debug("Persistent cache: loaded %d blocks from %s\n", block_count, pcc.path);
+  return 0;
+}
+
+/* Called before the first basic block is scanned, with the code cache lock held */
+void persistent_cc_load(dbm_thread *thread_data, Elf *elf) {
+  uint8_t build_id[PCC_BUILD_ID_MAX];
+  size_t build_id_size;
+
+  char *dir = getenv("MAMBO_CC_DIR");
+  if (dir == NULL || pcc_get_build_id(elf, build_id, &build_id_size) != 0) {
+    return;
+  }
+
+  pcc.enabled = true;
+  pcc.thread_data = thread_data;
+  pcc.key = pcc_get_key(build_id, build_id_size);
+  snprintf(pcc.path, sizeof(pcc.path), "%s/%016" PRIx64 ".mcc", dir, pcc.key);
+
+  int fd = open(pcc.path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  int ret = pcc_load_file(thread_data, fd);
+  close(fd);
+
+  if (ret != 0) {
+    free(pcc.entries);
+    pcc.entries = NULL;
+    flush_code_cache(thread_data);
+    return;
+  }
+
+  /* The application and the interpreter have already been mapped by the ELF
+     loader. If ASLR has moved either of them, the file can't be used. */
+  bool moved = false;
+  ret = pthread_mutex_lock(&global_data.exec_allocs.mutex);
+  assert(ret == 0);
+  for (ssize_t i = 0; i < global_data.exec_allocs.entry_count && !moved; i++) {
+    interval_map_entry *e = &global_data.exec_allocs.entries[i];
+    moved = e->fd >= 0 && pcc_find_moved_image(e->start, e->end) >= 0;
+  }
+  for (ssize_t i = 0; i < global_data.exec_allocs.entry_count && !moved; i++) {
+    pcc_validate_image(global_data.exec_allocs.entries[i].start, global_data.exec_allocs.entries[i].end);
+  }
+  ret = pthread_mutex_unlock(&global_data.exec_allocs.mutex);
+  assert(ret == 0);
+
+  if (moved) {
+    debug("Persistent cache: rejected, the application was mapped at another address\n");
+    free(pcc.entries);
+    pcc.entries = NULL;
+    flush_code_cache(thread_data);
+  }
+}
+
+/* Called for new executable mappings. Blocks restored into the code cache
+   of the first thread can only be published by a thread using it */
+void persistent_cc_notify_map(dbm_thread *thread_data, uintptr_t start, uintptr_t end) {
+  if (pcc.entry_count > 0 && thread_data == pcc.thread_data) {
+    int ret = lock_code_cache();
+    assert(ret == 0);
+    pcc_validate_image(start, end);
+    ret = unlock_code_cache();
+    assert(ret == 0);
+  }
+}
+
+/* The code cache has been flushed, drop the blocks waiting for validation */
+void persistent_cc_notify_flush(dbm_thread *thread_data) {
+  if (thread_data == pcc.thread_data) {
+    free(pcc.entries);
+    pcc.entries = NULL;
+    pcc.entry_count = 0;
+    pcc.image_count = 0;
+  }
+}
+
+/* Called on exit, saves the translations of file-backed executable mappings */
+void persistent_cc_save(dbm_thread *thread_data) {
+  pcc_header header;
+  pcc_image images[PCC_MAX_IMAGES];
+  char tmp_path[PATH_MAX + 16];
+  int image_count = 0;
+
+  if (!pcc.enabled || thread_data != pcc.thread_data) {
+    return;
+  }
+#ifdef DBM_CC_REGIONS
+  // Only a code cache which hasn't moved past its first region is contiguous
+  if (thread_data->cc_region != 0 || thread_data->region_free_bb[1] != cc_region_first_bb(1)) {
+    debug("Persistent cache: not saved, the code cache has been partially evicted\n");
+    return;
+  }
+#endif
+#ifdef HASH_EPOCHS
+  // The inline hash lookups only accept entries of the epoch they were emitted in
+  if (thread_data->entry_address->epoch != 0) {
+    debug("Persistent cache: not saved, the code cache has been flushed\n");
+    return;
+  }
+#endif
+
+  int ret = pthread_mutex_lock(&global_data.exec_allocs.mutex);
+  assert(ret == 0);
+  for (ssize_t i = 0; i < global_data.exec_allocs.entry_count && image_count < PCC_MAX_IMAGES; i++) {
+    interval_map_entry *e = &global_data.exec_allocs.entries[i];
+    if (e->fd >= 0) {
+      images[image_count].start = e->start;
+      images[image_count].end = e->end;
+      images[image_count].hash = pcc_image_hash(e->start, e->end);
+      images[image_count].valid = false;
+      image_count++;
+    }
+  }
+  ret = pthread_mutex_unlock(&global_data.exec_allocs.mutex);
+  assert(ret == 0);
+
+  memcpy(pcc.images, images, sizeof(pcc_image) * image_count);
+  pcc.image_count = image_count;
+
+  header.magic = PCC_MAGIC;
+  header.version = PCC_VERSION;
+  header.key = pcc.key;
+  header.code_cache = (uintptr_t)thread_data->code_cache;
+  header.thread_data = (uintptr_t)thread_data;
+  header.jump_tables = pcc_jump_tables(thread_data);
+  header.hash_table = (uintptr_t)thread_data->entry_address;
+  header.free_block = thread_data->free_block;
+  header.code_size = cc_free_addr(thread_data) - (uintptr_t)&thread_data->code_cache->blocks[trampolines_size_bbs];
+  header.image_count = image_count;
+  header.entry_count = 0;
+  header.link_count = 0;
+  header.range_count = 0;
+
+  hash_table *table = thread_data->entry_address;
+  for (int i = 0; i < table->size; i++) {
+    if (hash_entry_valid(table, i) && pcc_find_image(table->entries[i].key) >= 0) {
+      header.entry_count++;
+    }
+  }
+  for (int i = trampolines_size_bbs; i < thread_data->free_block; i++) {
+    for (ll_entry *e = thread_data->code_cache_meta[i].linked_from; e != NULL; e = e->next) {
+      header.link_count++;
+    }
+    for (ll_entry *e = thread_data->code_cache_meta[i].source_ranges; e != NULL; e = e->next) {
+      header.range_count++;
+    }
+  }
+
+  // Write to a temporary file first, concurrent runs may load the cache
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", pcc.path, getpid());
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+
+  int block_count = thread_data->free_block - trampolines_size_bbs;
+  bool err = pcc_write(fd, &header, sizeof(header)) != 0
+             || pcc_write(fd, images, sizeof(pcc_image) * image_count) != 0
+             || pcc_write(fd, &thread_data->code_cache->blocks[trampolines_size_bbs], header.code_size) != 0
+#ifdef DBM_VAR_SIZE_BB
+             || pcc_write(fd, &thread_data->bb_offset[trampolines_size_bbs], sizeof(uint32_t) * block_count) != 0
+#endif
+             || pcc_write(fd, &thread_data->code_cache_meta[trampolines_size_bbs],
+                          sizeof(dbm_code_cache_meta) * block_count) != 0;
+
+  for (int i = 0; i < table->size && !err; i++) {
+    pcc_entry entry;
+    entry.spc = table->entries[i].key;
+    entry.tpc = hash_entry_value(table, i);
+    entry.image = pcc_find_image(entry.spc);
+    if (hash_entry_valid(table, i) && entry.image >= 0) {
+      err = pcc_write(fd, &entry, sizeof(entry)) != 0;
+    }
+  }
+  for (int i = trampolines_size_bbs; i < thread_data->free_block && !err; i++) {
+    for (ll_entry *e = thread_data->code_cache_meta[i].linked_from; e != NULL && !err; e = e->next) {
+      pcc_link link = { .linked_to = i, .linked_from = e->data };
+      err = pcc_write(fd, &link, sizeof(link)) != 0;
+    }
+  }
+  for (int i = trampolines_size_bbs; i < thread_data->free_block && !err; i++) {
+    for (ll_entry *e = thread_data->code_cache_meta[i].source_ranges; e != NULL && !err; e = e->next) {
+      pcc_range range = { .fragment = i, .range = e->data };
+      err = pcc_write(fd, &range, sizeof(range)) != 0;
+    }
+  }
+
+  close(fd);
+  if (err || rename(tmp_path, pcc.path) != 0) {
+    unlink(tmp_path);
+  }
+}
+
+#endif // DBM_PERSISTENT_CC
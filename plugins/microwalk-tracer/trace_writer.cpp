@@ -79,8 +79,7 @@ void TraceWriter::WriteBufferToFile(TraceEntry* end)
 void TraceWriter::TestcaseStart(int testcaseId, TraceEntry* nextEntry)
 {
     // Exit prefix mode if necessary
-    if(_prefixMode)
-        TestcaseEnd(nextEntry);
+    EndPrefixMode(nextEntry);
 
     // Remember new testcase ID
     _testcaseId = testcaseId;
@@ -93,6 +92,12 @@ void TraceWriter::TestcaseStart(int testcaseId, TraceEntry* nextEntry)
     std::cerr << "Switched to testcase #" << std::dec << _testcaseId << std::endl;
 }
 
+void TraceWriter::EndPrefixMode(TraceEntry* nextEntry)
+{
+    if(_prefixMode)
+        TestcaseEnd(nextEntry);
+}
+
 void TraceWriter::TestcaseEnd(TraceEntry* nextEntry)
 {
     // Save remaining trace data
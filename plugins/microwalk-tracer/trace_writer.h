@@ -143,6 +143,9 @@ public:
     // Sets the next testcase ID and opens a suitable trace file.
     void TestcaseStart(int testcaseId, TraceEntry* nextEntry);
 
+    // Writes the remaining trace prefix and leaves prefix mode, if it is still active.
+    void EndPrefixMode(TraceEntry* nextEntry);
+
     // Closes the current trace file and notifies the caller that the testcase has completed.
     void TestcaseEnd(TraceEntry* nextEntry);
 
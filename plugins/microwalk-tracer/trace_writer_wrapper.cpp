@@ -31,6 +31,11 @@ extern "C" {
 		self->TestcaseStart(testcaseId, nextEntry);
 	}
 
+	void TraceWriter_EndPrefixMode(TraceWriter* self, TraceEntry* nextEntry)
+	{
+		self->EndPrefixMode(nextEntry);
+	}
+
 	void TraceWriter_TestcaseEnd(TraceWriter* self, TraceEntry* nextEntry)
 	{
 		self->TestcaseEnd(nextEntry);
@@ -46,6 +46,9 @@ void TraceWriter_WriteBufferToFile(TraceWriter* self, TraceEntry* end);
 // Sets the next testcase ID and opens a suitable trace file.
 void TraceWriter_TestcaseStart(TraceWriter* self, int testcaseId, TraceEntry* nextEntry);
 
+// Writes the remaining trace prefix and leaves prefix mode, if it is still active.
+void TraceWriter_EndPrefixMode(TraceWriter* self, TraceEntry* nextEntry);
+
 // Closes the current trace file and notifies the caller that the testcase has completed.
 void TraceWriter_TestcaseEnd(TraceWriter* self, TraceEntry* nextEntry);
 
@@ -8,6 +8,9 @@
 #include <locale.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "trace_writer_wrapper.h"
 #include "../../plugins.h"
@@ -42,6 +45,19 @@ TraceWriter *trace_writer;
 int main_thread_id = -1;
 int is_intresting = true;
 
+/*
+ * Fork server mode (MICROWALK_FORK_SERVER=<jobs>): every testcase is traced in a
+ * forked child, which inherits the warm code cache, the loaded images and the
+ * trace prefix. The parent keeps running the testcase loop without writing any
+ * trace data and at most <jobs> children are running at the same time.
+ * The parent still runs each testcase instrumented, so every testcase is
+ * executed twice. This only pays off with enough cores for the children.
+ */
+int fork_server_jobs = 0;
+int fork_server_children = 0;
+bool is_testcase_child = false;
+bool is_tracing_testcase = false;
+
 int tracer_pre_thread_handler(mambo_context *ctx)
 {
 	// Only trace main thread, first thread is main thread
@@ -62,6 +78,10 @@ int tracer_post_thread_handler(mambo_context *ctx)
 		TraceWriter_WriteBufferToFile(trace_writer, entry_buffer_next);
 		TraceWriter_destroy(trace_writer);
 	}
+
+	// Don't exit before all testcases have been written
+	while (fork_server_children > 0 && wait(NULL) > 0)
+		fork_server_children--;
 }
 
 int tracer_test_start_pre_fn_handler(mambo_context *ctx) {}
@@ -662,6 +682,12 @@ __attribute__((constructor)) void branch_count_init_plugin()
 	mambo_register_pre_basic_block_cb(ctx, &tracer_pre_bb_handler);
 	mambo_register_vm_op_cb(ctx, &tracer_vm_op_handler);
 
+	char *jobs = getenv("MICROWALK_FORK_SERVER");
+	if (jobs != NULL) {
+		fork_server_jobs = atoi(jobs) > 0 ? atoi(jobs) : 1;
+		fprintf(stderr, "[tracer] Fork server mode, %d parallel testcases\n", fork_server_jobs);
+	}
+
 	setlocale(LC_NUMERIC, "");
 }
 
@@ -678,14 +704,48 @@ void tracer_write_end_trace_instrumentation(mambo_context *ctx)
 
 void tracer_testcase_start_helper(int testcase_id, TraceEntry **next_entry)
 {
+	if (fork_server_jobs > 0) {
+		// The prefix is written once by the fork server, children inherit its state
+		TraceWriter_EndPrefixMode(trace_writer, *next_entry);
+		*next_entry = TraceWriter_Begin(trace_writer);
+
+		while (fork_server_children >= fork_server_jobs && wait(NULL) > 0)
+			fork_server_children--;
+
+		fflush(NULL);
+		pid_t pid = mambo_fork();
+		if (pid < 0) {
+			fprintf(stderr, "[tracer] fork() failed, tracing testcase #%d in the server\n", testcase_id);
+		} else if (pid > 0) {
+			// The server runs the testcase untraced, its buffer is never written
+			fork_server_children++;
+			return;
+		} else {
+			is_testcase_child = true;
+			fork_server_children = 0;
+		}
+	}
+
 	TraceWriter_TestcaseStart(trace_writer, testcase_id, *next_entry);
 	*next_entry = TraceWriter_Begin(trace_writer);
+	is_tracing_testcase = true;
 }
 
 void tracer_testcase_end_helper(TraceEntry **next_entry)
 {
+	if (fork_server_jobs > 0 && !is_tracing_testcase) {
+		*next_entry = TraceWriter_Begin(trace_writer);
+		return;
+	}
+
 	TraceWriter_TestcaseEnd(trace_writer, *next_entry);
 	*next_entry = TraceWriter_Begin(trace_writer);
+	is_tracing_testcase = false;
+
+	if (is_testcase_child) {
+		fflush(NULL);
+		_exit(0);
+	}
 }
 
 TraceEntry *tracer_check_buffer_and_store_helper(TraceEntry *next_entry)
@@ -135,8 +135,9 @@ int riscv_large_jump_helper(uint16_t **write_p, uint64_t target, bool link, enum
  * @param thread_data Thread data of current thread.
  * @param write_p Pointer to the writing location.
  * @param target Target address.
+ * @return 0 on success, -1 if the target is out of JAL range (nothing written).
  */
-void riscv_cc_branch(dbm_thread *thread_data, uint16_t *write_p, uint64_t target);
+int riscv_cc_branch(dbm_thread *thread_data, uint16_t *write_p, uint64_t target);
 
 /**
  * Write code to conditionally branch to a target.
@@ -235,6 +236,15 @@ void riscv_check_free_space(dbm_thread *thread_data, uint16_t **write_p,
  */
 void pass1_riscv(uint16_t *read_address, branch_type *bb_type);
 
+/**
+ * Liveness of the general purpose registers at the start of straight-line code.
+ * Reads RISC-V code until the first control flow instruction or an instruction
+ * which isn't analysed, the registers not written until then are live.
+ * @param read_address Pointer to the start of the code.
+ * @return Mask (\c m_x1 ... \c m_x31) of the registers written before being read.
+ */
+uint32_t riscv_dead_regs(uint16_t *read_address);
+
 /**
  * Insert a inline hash lookup. If the hash table contains the target a jump to the 
  * corresponding target address otherwise call the dispatcher to scan the code 
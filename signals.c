@@ -43,6 +43,7 @@
 #include "pie/pie-riscv-encoder.h"
 #include "pie/pie-riscv-decoder.h"
 #include "pie/pie-riscv-field-decoder.h"
+#include "arch/riscv/dispatcher_riscv.h"
 #endif
 
 #ifdef DEBUG
@@ -83,8 +84,27 @@ void install_system_sig_handlers() {
   act.sa_sigaction = signal_trampoline;
   sigemptyset(&act.sa_mask);
   act.sa_flags = SA_SIGINFO;
+#if defined(DBM_ARCH_RISCV64) && !defined(DBM_SHARED_CC)
+  // Also sent by invalidate_source_range() at any time, don't interrupt system calls
+  act.sa_flags |= SA_RESTART;
+#endif
   int ret = sigaction(UNLINK_SIGNAL, &act, NULL);
   assert(ret == 0);
+#ifdef DBM_SMC_PROTECT
+  // Writes to the write-protected pages holding translated code
+  ret = sigaction(SIGSEGV, &act, NULL);
+  assert(ret == 0);
+#endif
+}
+
+/* The code cache only checks the is_signal_pending flag of the thread which
+   owns it. With DBM_SHARED_CC, it's a hint shared by all threads and
+   deliver_signals() looks up which thread the signal is pending for. */
+static inline void signal_pending_update(dbm_thread *thread_data, int inc) {
+  atomic_increment_u32(&thread_data->is_signal_pending, inc);
+#ifdef DBM_SHARED_CC
+  atomic_increment_u32(&cc_thread(thread_data)->is_signal_pending, inc);
+#endif
 }
 
 int deliver_signals(uintptr_t spc, self_signal *s) {
@@ -103,7 +123,7 @@ int deliver_signals(uintptr_t spc, self_signal *s) {
       s->pid = syscall(__NR_getpid);
       s->tid = syscall(__NR_gettid);
       s->signo = i;
-      atomic_increment_u32(&current_thread->is_signal_pending, -1);
+      signal_pending_update(current_thread, -1);
       return 1;
     }
   }
@@ -238,8 +258,13 @@ int get_direct_branch_exit_trap_sz(dbm_code_cache_meta *bb_meta, int fragment_id
       sz = 4;
       break;
     case cond_imm_riscv:
-      // TODO: [traces] 8 for trace fragment
-      sz = (bb_meta->branch_cache_status & BOTH_LINKED) ? 12 : 8;
+      if (fragment_id >= CODE_CACHE_SIZE) {
+        // a single branch is inserted for a conditional exit in a trace
+        // however a second branch may follow for an early exit to an existing trace
+        sz = 8;
+      } else {
+        sz = (bb_meta->branch_cache_status & BOTH_LINKED) ? 12 : 8;
+      }
       break;
 #endif
     default:
@@ -263,7 +288,7 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
   offset = get_direct_branch_exit_trap_sz(bb_meta, fragment_id);
 
   if (pc < ((uintptr_t)bb_meta->exit_branch_addr + offset)) {
-    if (bb_meta->branch_cache_status != 0) {
+    if ((bb_meta->branch_cache_status & ~BRANCH_NO_LINK) != 0) {
       inst_decoder decoder;
 
 #ifdef __arm__
@@ -304,6 +329,7 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
  * @param pc Start address of current translated basic block (TPC).
  */
 void unlink_fragment(int fragment_id, uintptr_t pc) {
+  dbm_thread *thread_data = cc_thread(current_thread);
   dbm_code_cache_meta *bb_meta;
 
 #ifdef DBM_TRACES
@@ -311,7 +337,7 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
   branch_type type;
 
   do {
-    bb_meta = &current_thread->code_cache_meta[fragment_id];
+    bb_meta = &thread_data->code_cache_meta[fragment_id];
     type = bb_meta->exit_branch_type;
     fragment_id++;
   }
@@ -321,30 +347,28 @@ void unlink_fragment(int fragment_id, uintptr_t pc) {
   #elif __aarch64__
   while (type == uncond_imm_a64 &&
   #elif DBM_ARCH_RISCV64
-  // TODO: [traces] while(type == uncond_imm_riscv &&
+  while (type == uncond_imm_riscv &&
   #endif
          (bb_meta->branch_cache_status & BOTH_LINKED) == 0 &&
          fragment_id >= CODE_CACHE_SIZE &&
-         fragment_id < current_thread->active_trace.id);
+         fragment_id < thread_data->active_trace.id);
 
   fragment_id--;
   // If the fragment isn't installed, make sure it's active
-  if (fragment_id >= current_thread->trace_id) {
-    assert(current_thread->active_trace.active);
+  if (fragment_id >= thread_data->trace_id) {
+    assert(thread_data->active_trace.active);
   }
 #else
-  bb_meta = &current_thread->code_cache_meta[fragment_id];
+  bb_meta = &thread_data->code_cache_meta[fragment_id];
 #endif // DBM_TRACES
 
-#ifdef __aarch64__
+#if defined(__aarch64__) || defined(DBM_ARCH_RISCV64)
   // we don't try to unlink trace exits, we unlink the fragment they jump to
   if (bb_meta->exit_branch_type == trace_exit) {
-    fragment_id = addr_to_fragment_id(current_thread, bb_meta->branch_taken_addr);
-    bb_meta = &current_thread->code_cache_meta[fragment_id];
+    fragment_id = addr_to_fragment_id(thread_data, bb_meta->branch_taken_addr);
+    bb_meta = &thread_data->code_cache_meta[fragment_id];
     pc = bb_meta->tpc;
   }
-#elif DBM_ARCH_RISCV64
-  // TODO: [traces] Handle trace exit
 #endif
 
   void *write_p = bb_meta->exit_branch_addr;
@@ -711,6 +735,7 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   uintptr_t handler = 0;
   bool deliver_now = false;
+  dbm_thread *thread_data = cc_thread(current_thread);
 
   assert(i >= 0 && i < _NSIG);
   ucontext_t *cont = (ucontext_t *)context;
@@ -721,16 +746,78 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
 
   debug("Signal trap at %p: 0x%x\n", (uint32_t *)pc, *(uint32_t *)pc);
 
+#ifdef DBM_SMC_PROTECT
+  // The faulting store is executed again when the signal handler returns
+  if (i == SIGSEGV && info->si_code == SEGV_ACCERR && smc_write_fault((uintptr_t)info->si_addr)) {
+    return 0;
+  }
+
+  /* The SIGSEGV handler is only kept installed for smc_write_fault(). Without
+     an application handler, only its disposition is restored, wherever the
+     fault happened. A fault is raised again when the instruction is retried,
+     a signal sent by a process is sent again. */
+  if (i == SIGSEGV) {
+    uintptr_t app_handler = global_data.signal_handlers[SIGSEGV];
+    bool sent = info->si_code <= 0;
+    if (app_handler == (uintptr_t)SIG_DFL || (app_handler == (uintptr_t)SIG_IGN && !sent)) {
+      struct sigaction act;
+      act.sa_handler = (void *)app_handler;
+      sigemptyset(&act.sa_mask);
+      act.sa_flags = 0;
+      int ret = sigaction(i, &act, NULL);
+      assert(ret == 0);
+      if (sent) {
+        syscall(__NR_tgkill, getpid(), current_thread->tid, i);
+      }
+      return 0;
+    } else if (app_handler == (uintptr_t)SIG_IGN) {
+      return 0;
+    }
+  }
+#endif
+
+#if defined(DBM_ARCH_RISCV64) && !defined(DBM_SHARED_CC)
+  /* Sent by invalidate_source_range(). Outside of the code cache, the thread
+     applies the invalidations before it returns to it. The exits of the
+     fragment being executed and the veneers can't be rewritten under it,
+     then they are left for the dispatcher. */
+  if (i == UNLINK_SIGNAL && info->si_code == SI_TKILL
+      && __atomic_exchange_n(&current_thread->inval_signal_sent, false, __ATOMIC_ACQ_REL)) {
+    if (pc >= cc_start && pc < cc_end) {
+      bool in_exit = false;
+#ifdef DBM_CC_VENEERS
+      in_exit = riscv_veneer_target(thread_data, pc) != 0;
+#endif
+      if (!in_exit) {
+        int fragment_id = addr_to_fragment_id(thread_data, (uintptr_t)pc);
+        in_exit = pc >= (uintptr_t)thread_data->code_cache_meta[fragment_id].exit_branch_addr;
+      }
+      if (!in_exit) {
+        apply_pending_invalidations_in_cc(thread_data);
+      }
+    }
+    return 0;
+  }
+#endif
+
   if (global_data.exit_group > 0) {
     if (pc >= cc_start && pc < cc_end) {
-      int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
-      dbm_code_cache_meta *bb_meta = &current_thread->code_cache_meta[fragment_id];
+#ifdef DBM_CC_VENEERS
+      // A veneer only jumps to the start of a fragment, unlink that fragment instead
+      if (riscv_veneer_target(thread_data, pc) != 0) {
+        pc = riscv_veneer_target(thread_data, pc);
+      }
+#endif
+      int fragment_id = addr_to_fragment_id(thread_data, (uintptr_t)pc);
+      dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
       if (pc >= (uintptr_t)bb_meta->exit_branch_addr) {
         thread_abort(current_thread);
       }
+      lock_code_cache();
       unlink_fragment(fragment_id, pc);
+      unlock_code_cache();
     }
-    atomic_increment_u32(&current_thread->is_signal_pending, 1);
+    signal_pending_update(current_thread, 1);
     return 0;
   }
 
@@ -743,13 +830,22 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   }
 
   if (deliver_now) {
-    handler = lookup_or_scan(current_thread, global_data.signal_handlers[i], NULL);
+    lock_code_cache();
+    handler = lookup_or_scan(thread_data, global_data.signal_handlers[i], NULL);
+    cc_sync_icache(thread_data);
+    unlock_code_cache();
     return handler;
   }
 
   if (pc >= cc_start && pc < cc_end) {
-    int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
-    dbm_code_cache_meta *bb_meta = &current_thread->code_cache_meta[fragment_id];
+    lock_code_cache();
+#ifdef DBM_CC_VENEERS
+    if (riscv_veneer_target(thread_data, pc) != 0) {
+      pc = riscv_veneer_target(thread_data, pc);
+    }
+#endif
+    int fragment_id = addr_to_fragment_id(thread_data, (uintptr_t)pc);
+    dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
 
     if (pc >= (uintptr_t)bb_meta->exit_branch_addr) {
       void *write_p;
@@ -778,7 +874,7 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
         if (imm == SIGNAL_TRAP_IB) {
           restore_ihl_inst(pc);
 
-          int rn = current_thread->code_cache_meta[fragment_id].rn;
+          int rn = thread_data->code_cache_meta[fragment_id].rn;
           uintptr_t target;
 #ifdef __arm__
           unsigned long *regs = &cont->uc_mcontext.arm_r0;
@@ -789,15 +885,16 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
           target = cont->uc_mcontext.__gregs[rn];
 #endif
           restore_ihl_regs(cont);
+          unlock_code_cache();
           sigret_dispatcher_call(current_thread, cont, target);
           return 0;
         } else if (imm == SIGNAL_TRAP_DB) {
           write_p = bb_meta->exit_branch_addr;
           void *start_addr = write_p;
 #ifdef __arm__
-          restore_exit(current_thread, fragment_id, &write_p, is_thumb);
+          restore_exit(thread_data, fragment_id, &write_p, is_thumb);
 #elif defined(__aarch64__) || defined(DBM_ARCH_RISCV64)
-          restore_exit(current_thread, fragment_id, &write_p);
+          restore_exit(thread_data, fragment_id, &write_p);
 #endif
           __clear_cache(start_addr, write_p);
 
@@ -841,16 +938,25 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
           }
 
           // Set up *sigreturn* to the dispatcher
+          unlock_code_cache();
           sigret_dispatcher_call(current_thread, cont,
                                  is_taken ? bb_meta->branch_taken_addr : bb_meta->branch_skipped_addr);
           return 0;
         } else {
+#ifdef DBM_SHARED_CC
+          // Another thread has already restored this shared exit, execute it again
+          if (*(uint32_t *)pc != RISCV_SRET_CODE && *(uint32_t *)pc != RISCV_MRET_CODE) {
+            unlock_code_cache();
+            return 0;
+          }
+#endif
           fprintf(stderr, "Error: unknown MAMBO trap code\n");
           while(1);
         }
       } // i == UNLINK_SIGNAL
     } // if (pc >= (uintptr_t)bb_meta->exit_branch_addr)
     unlink_fragment(fragment_id, pc);
+    unlock_code_cache();
   }
 
   /* Call the handlers of synchronous signals immediately
@@ -882,12 +988,15 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
     }
 
     cont->pc_field = 0;
-    handler = lookup_or_scan(current_thread, handler, NULL);
+    lock_code_cache();
+    handler = lookup_or_scan(thread_data, handler, NULL);
+    cc_sync_icache(thread_data);
+    unlock_code_cache();
     return handler;
   }
 
   atomic_increment_int(&current_thread->pending_signals[i], 1);
-  atomic_increment_u32(&current_thread->is_signal_pending, 1);
+  signal_pending_update(current_thread, 1);
 
   return handler;
 }
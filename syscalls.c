@@ -104,7 +104,12 @@ void *dbm_start_thread_pth(void *ptr, void *mambo_sp) {
 
   assert(register_thread(thread_data, false) == 0);
 
-  uintptr_t addr = scan(thread_data, thread_data->clone_ret_addr, ALLOCATE_BB);
+  int ret = lock_code_cache();
+  assert(ret == 0);
+  uintptr_t addr = lookup_or_scan(cc_thread(thread_data), (uintptr_t)thread_data->clone_ret_addr, NULL);
+  cc_sync_icache(cc_thread(thread_data));
+  ret = unlock_code_cache();
+  assert(ret == 0);
   th_enter(child_stack, addr);
 
   return NULL;
@@ -204,6 +209,10 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
   uintptr_t *parent_stack = args - 4;
 #else
   uintptr_t *parent_stack = args;
+#endif
+#ifdef DBM_SHARED_CC
+  // The shared syscall wrapper passes the owner of the code cache
+  thread_data = current_thread;
 #endif
   debug("syscall pre %d\n", syscall_no);
 
@@ -270,8 +279,13 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
     case __NR_exit:
       debug("thread exit\n");
       void *sp = thread_data->mambo_sp;
+      // The speculative translation thread only uses the data of registered threads under this lock
+      int ret = lock_code_cache();
+      assert(ret == 0);
       assert(unregister_thread(thread_data, false) == 0);
       assert(free_thread_data(thread_data) == 0);
+      ret = unlock_code_cache();
+      assert(ret == 0);
 
       return_with_sp(sp); // this should never return
       while(1); 
@@ -289,7 +303,12 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       if (act != NULL) {
         handler = (uintptr_t)act->k_sa_handler;
         // Never remove the UNLINK_SIGNAL handler, which is used internally by MAMBO
-        if (args[0] == UNLINK_SIGNAL || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)) {
+        bool internal = (args[0] == UNLINK_SIGNAL);
+#ifdef DBM_SMC_PROTECT
+        // Nor the SIGSEGV handler detecting writes to translated code
+        internal = internal || (args[0] == SIGSEGV);
+#endif
+        if (internal || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)) {
           act->k_sa_handler = (__sighandler_t)signal_trampoline;
           act->sa_flags |= SA_SIGINFO;
         }
@@ -470,7 +489,13 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       debug("cache flush\n");
       /* Returning to the calling BB is potentially unsafe because the remaining
          contents of the BB or other basic blocks it is linked against could be stale */
-      flush_code_cache(thread_data);
+      {
+        int ret = lock_code_cache();
+        assert(ret == 0);
+        flush_code_cache(thread_data);
+        ret = unlock_code_cache();
+        assert(ret == 0);
+      }
       break;
     case __ARM_NR_set_tls:
       debug("set tls to %x\n", args[0]);
@@ -487,6 +512,22 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       break;
     }
 #endif
+#ifdef DBM_ARCH_RISCV64
+    case __NR_riscv_flush_icache:
+      debug("icache flush %p-%p\n", (void *)args[0], (void *)args[1]);
+      /* __clear_cache() passes the modified range, the kernel itself ignores it.
+         The calling fragment stays in the code cache until it is reused. */
+      if (args[0] < args[1]) {
+        invalidate_source_range(args[0], args[1]);
+      } else {
+        int ret = lock_code_cache();
+        assert(ret == 0);
+        flush_code_cache(thread_data);
+        ret = unlock_code_cache();
+        assert(ret == 0);
+      }
+      break;
+#endif
 #ifdef DEBUG
     // Ignore dup/2/3 if it attempts to redirect `stdout` or `stderr` during debugging.
     // Otherwise debug messages may be redirected and not printed to your terminal.
@@ -520,6 +561,9 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
 
 void syscall_handler_post(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_inst, dbm_thread *thread_data) {
   dbm_thread *new_thread_data;
+#ifdef DBM_SHARED_CC
+  thread_data = current_thread;
+#endif
   
   debug("syscall post %d\n", syscall_no);
 
@@ -527,6 +571,10 @@ void syscall_handler_post(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_
     thread_abort(thread_data);
   }
   thread_data->status = THREAD_RUNNING;
+#if defined(DBM_ARCH_RISCV64) && !defined(DBM_SHARED_CC)
+  // The invalidations requested while the thread was in the system call
+  apply_pending_invalidations_in_cc(thread_data);
+#endif
 
   switch(syscall_no) {
     case __NR_clone:
@@ -0,0 +1,126 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Hot loops with conditional branches taken both ways, direct and indirect
+  calls, returns and a switch, executed often enough to become trace heads
+  with DBM_TRACES. All results are checked against their closed form.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define ITERATIONS 1000000
+#define CASES 8
+
+static uint64_t op_count[4];
+
+static void __attribute__((noinline)) op_add(uint64_t *acc, uint64_t i) {
+  *acc += i;
+  op_count[0]++;
+}
+
+static void __attribute__((noinline)) op_sub(uint64_t *acc, uint64_t i) {
+  *acc -= i;
+  op_count[1]++;
+}
+
+static void __attribute__((noinline)) op_double(uint64_t *acc, uint64_t i) {
+  *acc += 2 * i;
+  op_count[2]++;
+}
+
+static void __attribute__((noinline)) op_none(uint64_t *acc, uint64_t i) {
+  op_count[3]++;
+}
+
+static void (* volatile ops[4])(uint64_t *, uint64_t) = {op_add, op_sub, op_double, op_none};
+
+static int __attribute__((noinline)) fib(int n) {
+  return (n < 2) ? n : fib(n - 1) + fib(n - 2);
+}
+
+static int __attribute__((noinline)) select_case(int i) {
+  switch (i % CASES) {
+    case 0: return 3;
+    case 1: return 5;
+    case 2: return 7;
+    case 3: return 11;
+    case 4: return 13;
+    case 5: return 17;
+    case 6: return 19;
+    default: return 23;
+  }
+}
+
+int main() {
+  uint64_t even_sum = 0, odd_sum = 0;
+  uint64_t acc = 0;
+  uint64_t case_sum = 0;
+  uint64_t n = ITERATIONS;
+
+  // Both sides of the branch are hot
+  for (uint64_t i = 0; i < n; i++) {
+    if (i & 1) {
+      odd_sum += i;
+    } else {
+      even_sum += i;
+    }
+  }
+  assert(even_sum == (n / 2) * (n / 2 - 1));
+  assert(odd_sum == (n / 2) * (n / 2));
+
+  // Indirect calls and returns
+  for (uint64_t i = 0; i < n; i++) {
+    ops[i % 4](&acc, i);
+  }
+  for (int i = 0; i < 4; i++) {
+    assert(op_count[i] == n / 4);
+  }
+  /* For i = 4k + j, k < n/4: add (4k), sub (4k + 1), double (4k + 2) sum to
+     8k + 3, so acc is 8 * (n/4 - 1) * (n/4) / 2 + 3 * n/4 */
+  assert(acc == 4 * (n / 4 - 1) * (n / 4) + 3 * (n / 4));
+
+  // A switch, translated through a jump table with DBM_JUMP_TABLES
+  for (uint64_t i = 0; i < n; i++) {
+    case_sum += select_case(i);
+  }
+  assert(case_sum == (n / CASES) * (3 + 5 + 7 + 11 + 13 + 17 + 19 + 23));
+
+  // Recursive calls, the return addresses are hot in many contexts
+  for (int i = 0; i < 20; i++) {
+    assert(fib(20) == 6765);
+  }
+
+  // Nested loops with an early exit of the inner loop
+  uint64_t inner = 0;
+  for (int i = 0; i < 1000; i++) {
+    for (int j = 0; j < 1000; j++) {
+      if (j == i) {
+        break;
+      }
+      inner++;
+    }
+  }
+  assert(inner == 999 * 1000 / 2);
+
+  printf("Hot paths OK\n");
+  return 0;
+}
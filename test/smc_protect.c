@@ -0,0 +1,63 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Copyright 2017 The University of Manchester
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  RISC-V code written to a RWX mapping, executed, rewritten in place and
+  executed again. The riscv_flush_icache syscall made by __clear_cache()
+  invalidates the stale fragment. With DBM_SMC_PROTECT, the page is also
+  write protected after it is scanned and the store to it invalidates it.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#define ROUNDS 16
+
+// addi a0, x0, imm
+#define ADDI_A0(imm) (0x00000513 | ((uint32_t)(imm) << 20))
+// ret
+#define RET 0x00008067
+
+static void write_code(uint32_t *code, int imm) {
+  code[0] = ADDI_A0(imm);
+  code[1] = RET;
+  __builtin___clear_cache((char *)code, (char *)&code[2]);
+}
+
+int main() {
+  uint32_t *code = mmap(NULL, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(code != MAP_FAILED);
+  int (*func)(void) = (int (*)(void))code;
+
+  for (int i = 1; i <= ROUNDS; i++) {
+    write_code(code, i);
+    assert(func() == i);
+    // Called again, through the fragment linked to the first call
+    assert(func() == i);
+  }
+
+  int ret = munmap(code, 4096);
+  assert(ret == 0);
+
+  printf("SMC protect OK\n");
+  return 0;
+}
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 // Module under test
 #include "../arch/riscv/dispatcher_riscv.h"
@@ -21,6 +23,9 @@
 void setUp(void) {}
 void tearDown(void) {}
 
+// Defined by dbm.c, which isn't linked
+uintptr_t page_size;
+
 void test_insert_cond_exit_branch()
 {
 	uint16_t w[3] = {0};
@@ -68,10 +73,121 @@ void test_dispatcher_riscv()
 	TEST_IGNORE_MESSAGE("Test not implemented yet.");
 }
 
+/*
+ * The copy of the trampolines is entered like from an exit: x10 = SPC,
+ * x11 = source_index, with x10, x11 and x12 pushed. The translation of
+ * FAST_SPC returns 1 and the target set by the dispatcher returns 2. Both
+ * restore sp from s2 and return to s3.
+ */
+#define FAST_SPC 0x5550
+#define FAST_NO_LINK 5
+#define FAST_LINKABLE 6
+
+extern void fast_path_hit();
+extern void fast_path_dispatched();
+asm(".text\n"
+	"fast_path_hit:\n"
+	"	MV		sp, s2\n"
+	"	LI		a0, 1\n"
+	"	JR		s3\n"
+	"fast_path_dispatched:\n"
+	"	MV		sp, s2\n"
+	"	LI		a0, 2\n"
+	"	JR		s3\n");
+
+static int dispatcher_calls;
+static uint32_t dispatcher_source_index;
+
+// Called by the slow path of the copied trampoline
+void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr,
+	dbm_thread *thread_data)
+{
+	dispatcher_calls++;
+	dispatcher_source_index = source_index;
+	*next_addr = (uintptr_t)fast_path_dispatched;
+}
+
+static uintptr_t enter_trampoline(uintptr_t trampoline, uintptr_t spc, uintptr_t source_index)
+{
+	register uintptr_t a0 asm("x10") = spc;
+	register uintptr_t a1 asm("x11") = source_index;
+	register uintptr_t a2 asm("x12") = trampoline;
+	asm volatile(
+		"MV		s2, sp\n"
+		"LLA	s3, 1f\n"
+		"ADDI	sp, sp, -24\n"
+		"SD		x12, 0(sp)\n"
+		"JR		x12\n"
+		"1:\n"
+		: "+r"(a0), "+r"(a1), "+r"(a2)
+		:
+		: "s2", "s3", "ra", "x5", "x6", "x7", "x13", "x14", "x15", "x16", "x17",
+		  "x28", "x29", "x30", "x31", "memory");
+	return a0;
+}
+
+void test_dispatcher_trampoline_fast_path()
+{
+	size_t size = (uintptr_t)&end_of_dispatcher_s - (uintptr_t)&start_of_dispatcher_s;
+	uint8_t *copy = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	TEST_ASSERT_NOT_EQUAL(MAP_FAILED, copy);
+	memcpy(copy, &start_of_dispatcher_s, size);
+	#define literal(sym) (copy + ((uintptr_t)&sym - (uintptr_t)&start_of_dispatcher_s))
+
+	page_size = sysconf(_SC_PAGESIZE);
+	hash_table *table = hash_alloc(NULL);
+	hash_init(table, CODE_CACHE_HASH_INIT_SIZE + CODE_CACHE_HASH_OVERP);
+	TEST_ASSERT_TRUE(hash_add(table, FAST_SPC, (uintptr_t)fast_path_hit));
+	dbm_code_cache_meta *meta = calloc(FAST_LINKABLE + 1, sizeof(dbm_code_cache_meta));
+	meta[FAST_NO_LINK].branch_cache_status = BRANCH_NO_LINK;
+	int pending_inval_count = 0;
+	uint32_t is_signal_pending = 0;
+
+	*(hash_entry **)literal(hash_entries_ptr) = table->entries;
+	*(uintptr_t **)literal(hash_index_mask_ptr) = &table->index_mask;
+	*(uintptr_t **)literal(hash_epoch_ptr) = &table->epoch;
+	*(uintptr_t **)literal(hash_seq_ptr) = &table->seq;
+	*(int **)literal(pending_inval_count_ptr) = &pending_inval_count;
+	*(uint32_t **)literal(th_is_pending_ptr) = &is_signal_pending;
+	*(uintptr_t **)literal(branch_status_ptr) = &meta[0].branch_cache_status;
+	*(dbm_code_cache_meta **)literal(code_cache_meta_ptr) = meta;
+	*(size_t *)literal(code_cache_meta_size) = sizeof(dbm_code_cache_meta);
+	__builtin___clear_cache((char *)copy, (char *)copy + size);
+	uintptr_t trampoline = (uintptr_t)literal(dispatcher_trampoline);
+
+	// Exits without a source fragment and exits which can't be linked
+	TEST_ASSERT_EQUAL(1, enter_trampoline(trampoline, FAST_SPC, 0));
+	TEST_ASSERT_EQUAL(1, enter_trampoline(trampoline, FAST_SPC, FAST_NO_LINK));
+	TEST_ASSERT_EQUAL(0, dispatcher_calls);
+
+	// Linkable exits always call the dispatcher
+	TEST_ASSERT_EQUAL(2, enter_trampoline(trampoline, FAST_SPC, FAST_LINKABLE));
+	TEST_ASSERT_EQUAL(1, dispatcher_calls);
+	TEST_ASSERT_EQUAL(FAST_LINKABLE, dispatcher_source_index);
+
+	// A miss has nothing to link
+	TEST_ASSERT_EQUAL(2, enter_trampoline(trampoline, FAST_SPC + 4, FAST_NO_LINK));
+	TEST_ASSERT_EQUAL(2, dispatcher_calls);
+	TEST_ASSERT_EQUAL(0, dispatcher_source_index);
+
+	// Pending invalidations are applied by the dispatcher
+	pending_inval_count = 1;
+	TEST_ASSERT_EQUAL(2, enter_trampoline(trampoline, FAST_SPC, FAST_NO_LINK));
+	TEST_ASSERT_EQUAL(3, dispatcher_calls);
+	TEST_ASSERT_EQUAL(FAST_NO_LINK, dispatcher_source_index);
+
+	#undef literal
+	free(meta);
+	free(table);
+	munmap(copy, size);
+}
+
 int main(void)
 {
 	UNITY_BEGIN();
 	RUN_TEST(test_insert_cond_exit_branch);
 	RUN_TEST(test_dispatcher_riscv);
+	RUN_TEST(test_dispatcher_trampoline_fast_path);
 	return UNITY_END();
 }
\ No newline at end of file
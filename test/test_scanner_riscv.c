@@ -20,6 +20,15 @@
 void setUp(void) {}
 void tearDown(void) {}
 
+// The fragment metadata and the hash table are mapped separately by init_thread()
+static dbm_thread *alloc_thread_data()
+{
+	dbm_thread *thread_data = calloc(1, sizeof(dbm_thread));
+	thread_data->code_cache_meta = calloc(64, sizeof(dbm_code_cache_meta));
+	thread_data->entry_address = calloc(1, sizeof(hash_table));
+	return thread_data;
+}
+
 void test_riscv_copy16()
 {
 	uint16_t w[5] = {0};
@@ -790,11 +799,14 @@ void test_riscv_restore_regs()
 
 void test_riscv_branch_jump()
 {
+#ifdef DBM_COMPACT_EXITS
+	TEST_IGNORE_MESSAGE("Exits are compact, see test_riscv_branch_jump_compact.");
+#endif
 	// HACK: Same handling of internal function calls as in test_riscv_save_regs
 	uint16_t w[37] = {0};
 	uint16_t *write_p = w;
 
-	dbm_thread *thread_data = malloc(sizeof(dbm_thread));
+	dbm_thread *thread_data = alloc_thread_data();
 	thread_data->dispatcher_addr = (uint64_t)write_p + 5000;
 
 	riscv_branch_jump(thread_data, &write_p, 42, (uint64_t)write_p + 125, 
@@ -847,14 +859,50 @@ void test_riscv_branch_jump_cond()
 	TEST_IGNORE_MESSAGE("Test not implemented yet.");
 }
 
-void test_riscv_check_free_space()
+void test_pass1_riscv()
 {
-	TEST_IGNORE_MESSAGE("Test not implemented yet.");
+	uint16_t r[8] = {
+		0x8113, 0x011f,		// ADDI		x2, x31, 17
+		0x4963, 0x4111,		// BLT		x2, x17, .+1042
+		0xA011,				// C.J		.+4
+		0x0001,				// C.NOP
+		0x8082,				// C.JR		ra
+		0xA001				// C.J		.
+	};
+	branch_type bb_type;
+
+	pass1_riscv(&r[0], &bb_type);
+	TEST_ASSERT_EQUAL(cond_imm_riscv, bb_type);
+
+	pass1_riscv(&r[4], &bb_type);
+#ifdef DBM_INLINE_UNCOND_IMM
+	// The jump is followed to the return
+	TEST_ASSERT_EQUAL(uncond_reg_riscv, bb_type);
+#else
+	TEST_ASSERT_EQUAL(uncond_imm_riscv, bb_type);
+#endif
+
+	// Backward jumps are only inlined MAX_BACK_INLINE times
+	pass1_riscv(&r[7], &bb_type);
+	TEST_ASSERT_EQUAL(uncond_imm_riscv, bb_type);
 }
 
-void test_pass1_riscv()
+void test_riscv_dead_regs()
 {
-	TEST_IGNORE_MESSAGE("Test not implemented yet.");
+	uint16_t r[5] = {
+		0x4505,				// C.LI		a0, 1
+		0x05B3, 0x00C5,		// ADD		a1, a0, a2
+		0x8082,				// C.JR		ra
+		0x0001				// C.NOP
+	};
+
+	TEST_ASSERT_EQUAL_HEX32(m_x10 | m_x11, riscv_dead_regs(&r[0]));
+
+	// a0 is read before being written
+	TEST_ASSERT_EQUAL_HEX32(m_x11, riscv_dead_regs(&r[1]));
+
+	// Nothing is known after a control flow instruction
+	TEST_ASSERT_EQUAL_HEX32(0, riscv_dead_regs(&r[3]));
 }
 
 void test_riscv_get_mambo_cond()
@@ -909,6 +957,9 @@ void test_riscv_scanner_deliver_callbacks()
 
 void test_riscv_inline_hash_lookup()
 {
+#if defined(DBM_RAS) || defined(DBM_IBTC) || defined(HASH_SEQLOCK)
+	TEST_IGNORE_MESSAGE("Tested instance is without DBM_RAS, DBM_IBTC and HASH_SEQLOCK.");
+#endif
 	// HACK: Tests without stubs.
 	/*
 	 * Test Indirect Branch Lookup
@@ -916,7 +967,6 @@ void test_riscv_inline_hash_lookup()
 	 * - rn = ra
 	 * - Replaced instruction: RET/C.JR
 	 * - &read_address = 0x5550
-	 * - HASH_MASK = 0xFF
 	 * - dispatcher = 0x6770
 	 * - basic_block = 17
 	 * 
@@ -929,53 +979,58 @@ void test_riscv_inline_hash_lookup()
 	 * 		9			|	ADDI	x11, ra, 0			|
 	 * 		11			|	(LI		ra, 0x5552)			|
 	 * 					|	 -> riscv_copy_to_reg_64bits|
-	 * 		20			|	(LI		x10, &entries)		|
-	 * 					|	 -> riscv_copy_to_reg_64bits|
-	 * 		29			|	(LI		x12, 0x1FE)			|
+	 * 		20			|	(LI		x12, HASH_MULT)		|
 	 * 					|	 -> riscv_copy_to_reg_32bits|
-	 * 		31			|	AND		x12, x12, x11		|
-	 * 		33			|	C.SLLI	x12, 3				|
-	 * 		34			|	C.ADD	x10, x12			|
+	 * 		24			|	MUL		x12, x12, x11		|
+	 * 		26			|	SRLI	x12, x12, 28		|
+	 * 		28			|	(LI		x10, &entries)		|
+	 * 					|	 -> riscv_copy_to_reg_64bits|
+	 * 		37			|	LD		x10, -8(x10)		|
+	 * 		39			|	AND		x12, x12, x10		|
+	 * 		41			|	AUIPC	x10, 0				|
+	 * 		43			|	LD		x10, -24(x10)		|
+	 * 		45			|	C.ADD	x10, x12			|
 	 * 					|								|
 	 * 					| lin_probing:					|
-	 * 		35			|	C.LD	x12, 0(x10)			|
-	 * 		36			|	C.ADDI	x10, 16				|
-	 * 		37			|	(C.BEQZ	x12, not_found)		|
+	 * 		46			|	C.LD	x12, 0(x10)			|
+	 * 		47			|	C.ADDI	x10, 16				|
+	 * 		48			|	(C.BEQZ	x12, not_found)		|
 	 * 					|	 -> riscv_bez_helper		|
-	 * 		38			|	(BNE	x12, x11, lin_probing)
+	 * 		49			|	(BNE	x12, x11, lin_probing)
 	 * 					|	 -> riscv_b_cond_helper		|
-	 * 		40			|	LD		x10, -8(x10)		|
-	 * 		42			|	(POP	x12)				|
+	 * 		51			|	LD		x10, -8(x10)		|
+	 * 		53			|	(POP	x12)				|
 	 * 					|	 -> riscv_pop_helper		|
-	 * 		45			|	C.JR	x10					|
+	 * 		56			|	C.JR	x10					|
 	 * 					|								|
 	 * 					| not_found:					|
-	 * 		46			|	C.MV	x10, x11			|
-	 * 		47			|	(LI		x11, basic_block)	|
+	 * 		57			|	C.MV	x10, x11			|
+	 * 		58			|	(LI		x11, basic_block)	|
 	 * 					|	 -> riscv_copy_to_reg_32bits|
-	 * 		49			|	(POP	x12)				|
+	 * 		60			|	(POP	x12)				|
 	 * 					|	 -> riscv_pop_helper		|
-	 * 		52			|	(JAL	x0, 0x6770)			|
+	 * 		63			|	(JAL	x0, 0x6770)			|
 	 * 					|	 -> riscv_branch_imm_helper	|
 	 * 					+-------------------------------+
 	 */
 
-	uint16_t w[55] = {0};
+	uint16_t w[66] = {0};
 	uint16_t *write_p = w;
 	
 	uint16_t *read_address = (uint16_t *)0x5552;
 
-	dbm_thread *thread_data = malloc(sizeof(dbm_thread));
+	dbm_thread *thread_data = alloc_thread_data();
 	thread_data->dispatcher_addr = 0x6770;
+	thread_data->entry_address->epoch = 0; // Not flushed, no epoch check
 
 	riscv_inline_hash_lookup(thread_data, 17, &write_p, read_address, ra, 0, ra, true,
 		INST_16BIT);
 
-	TEST_ASSERT_EQUAL_HEX16(0, w[54]);
-	TEST_ASSERT_EQUAL_PTR(&w[54], write_p);
+	TEST_ASSERT_EQUAL_HEX16(0, w[65]);
+	TEST_ASSERT_EQUAL_PTR(&w[65], write_p);
 	TEST_ASSERT_EQUAL(thread_data->code_cache_meta[17].rn, x11);
 
-	uint16_t w_exp[54] = {0};
+	uint16_t w_exp[65] = {0};
 	uint16_t *write_p_exp = w_exp;
 	uint16_t *lin_probing;
 	uint16_t *branch_to_not_found;
@@ -986,14 +1041,22 @@ void test_riscv_inline_hash_lookup()
 	write_p_exp += 2;
 
 	riscv_copy_to_reg_64bits(&write_p_exp, ra, (uint64_t)read_address + 2);
-	riscv_copy_to_reg_64bits(&write_p_exp, x10, 
-		(uint64_t)&thread_data->entry_address.entries);
-	riscv_copy_to_reg_32bits(&write_p_exp, x12, CODE_CACHE_HASH_SIZE << 1);
+	riscv_copy_to_reg_32bits(&write_p_exp, x12, HASH_MULT);
+	riscv_mul(&write_p_exp, x12, x12, x11);
+	write_p_exp += 2;
+	riscv_srli(&write_p_exp, x12, x12, 28);
+	write_p_exp += 2;
 
-	riscv_and(&write_p_exp, x12, x12, x11);
+	riscv_copy_to_reg_64bits(&write_p_exp, x10, 
+		(uint64_t)thread_data->entry_address->entries);
+	riscv_ld(&write_p_exp, x10, x10, -8);
+	write_p_exp += 2;
+	riscv_and(&write_p_exp, x12, x12, x10);
+	write_p_exp += 2;
+	riscv_auipc(&write_p_exp, x10, 0);
+	write_p_exp += 2;
+	riscv_ld(&write_p_exp, x10, x10, -24);
 	write_p_exp += 2;
-	riscv_c_slli(&write_p_exp, x12, 0, 3);
-	write_p_exp++;
 	riscv_c_add(&write_p_exp, x10, x12);
 	write_p_exp++;
 	
@@ -1020,10 +1083,535 @@ void test_riscv_inline_hash_lookup()
 	riscv_pop_helper(&write_p_exp, x12);
 	riscv_branch_imm_helper(&write_p_exp, 0x6770, false);
 
-	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, 54);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, 65);
+
+	// JALR ra, 8(x10): ra is dead before the jump and holds the target, x12 isn't saved
+	write_p = w;
+	riscv_inline_hash_lookup(thread_data, 17, &write_p, read_address, x10, 8, ra, false,
+		INST_32BIT);
+
+	write_p_exp = w_exp;
+	riscv_save_regs(&write_p_exp, (m_x10 | m_x11));
+	riscv_addi(&write_p_exp, ra, x10, 8);
+	write_p_exp += 2;
+	riscv_copy_to_reg_32bits(&write_p_exp, x11, HASH_MULT);
+	riscv_mul(&write_p_exp, x11, x11, ra);
+	write_p_exp += 2;
+
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, write_p_exp - w_exp);
+
+	free(thread_data);
+}
+
+#ifdef DBM_COMPACT_EXITS
+void test_riscv_branch_jump_compact()
+{
+	uint16_t w[16] = {0};
+	uint16_t *write_p = w;
+
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->exit_trampoline_addr = (uint64_t)write_p + 5000;
+
+	// The target is stored in the metadata, loaded by the exit trampoline
+	riscv_branch_jump(thread_data, &write_p, 42, 0x5552, REPLACE_TARGET | INSERT_BRANCH);
+
+	TEST_ASSERT_EQUAL_HEX64(0x5552, thread_data->code_cache_meta[42].branch_taken_addr);
+
+	uint16_t w_exp[16] = {0};
+	uint16_t *write_p_exp = w_exp;
+
+	riscv_copy_to_reg_32bits(&write_p_exp, x10, offsetof(dbm_code_cache_meta,
+		branch_taken_addr));
+	riscv_copy_to_reg_32bits(&write_p_exp, x11, 42);
+	riscv_large_jump_helper(&write_p_exp, (uint64_t)w_exp + 5000, false, x12);
+	TEST_ASSERT_EQUAL_PTR(w + (write_p_exp - w_exp), write_p);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, write_p_exp - w_exp);
+
+	free(thread_data);
+}
+#endif
+
+void test_riscv_check_free_space()
+{
+	/*
+	 * The continuation block is in JAL range, the fragment jumps to it.
+	 * allocate_bb() always returns block 0 in the tests.
+	 */
+	uint16_t *buf = calloc(1, 2 * sizeof(dbm_block));
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->code_cache = (dbm_code_cache *)buf;
+#ifdef DBM_VAR_SIZE_BB
+	uint32_t bb_offset[1] = {0};
+	thread_data->bb_offset = bb_offset;
+#endif
+
+	uint16_t *write_p = buf + BASIC_BLOCK_SIZE + 10;
+	uint16_t *data_p = write_p + 8;
+
+	riscv_check_free_space(thread_data, &write_p, &data_p, 4, 7);
+
+	TEST_ASSERT_EQUAL(7, thread_data->code_cache_meta[0].actual_id);
+	TEST_ASSERT_EQUAL_PTR(buf, write_p);
+
+	uint16_t w_exp[2] = {0};
+	uint16_t *write_p_exp = w_exp;
+	riscv_branch_imm_helper(&write_p_exp, (uint64_t)w_exp - (BASIC_BLOCK_SIZE + 10) * 2,
+		false);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, &buf[BASIC_BLOCK_SIZE + 10], write_p_exp - w_exp);
+
+	// Enough space, nothing is emitted
+	uint16_t *old_write_p = write_p;
+	data_p = write_p + 64;
+	riscv_check_free_space(thread_data, &write_p, &data_p, 4, 7);
+	TEST_ASSERT_EQUAL_PTR(old_write_p, write_p);
+	TEST_ASSERT_EQUAL(0, *write_p);
+
+	free(thread_data);
+	free(buf);
+}
+
+#ifdef DBM_VAR_SIZE_BB
+void test_riscv_check_free_space_far()
+{
+	/*
+	 * The continuation block is out of JAL range, as when the next fragment is
+	 * allocated in another code cache region after the current one was evicted.
+	 * 		+-------------------------------+
+	 * 		|	PUSH	x10					|
+	 * 		|	AUIPC	x10, offset[31:12]	|
+	 * 		|	JALR	x0, offset[11:0](x10)
+	 * 		+-------------------------------+
+	 * cont:|	POP		x10					|
+	 * 		+-------------------------------+
+	 */
+	const size_t far = 0x200000; // 2 MiB, JAL reaches +-1 MiB
+	uint16_t *buf = calloc(1, far + 2 * sizeof(dbm_block));
+	uint32_t bb_offset[1] = {far};
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->code_cache = (dbm_code_cache *)buf;
+	thread_data->bb_offset = bb_offset;
+
+	uint16_t *write_p = buf + 10;
+	uint16_t *data_p = write_p + 8;
+	uint16_t *cont = (uint16_t *)((uintptr_t)buf + far);
+
+	riscv_check_free_space(thread_data, &write_p, &data_p, 4, 7);
+
+	TEST_ASSERT_EQUAL(7, thread_data->code_cache_meta[0].actual_id);
+
+	uint16_t w_exp[8] = {0};
+	uint16_t *write_p_exp = w_exp;
+
+	riscv_push_helper(&write_p_exp, x10);
+	riscv_large_jump_helper(&write_p_exp, (uint64_t)w_exp + far - 20, false, x10);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, &buf[10], write_p_exp - w_exp);
+	TEST_ASSERT_EQUAL(0, buf[10 + (write_p_exp - w_exp)]);
+	TEST_ASSERT_LESS_OR_EQUAL(CONT_JUMP_SIZE / 2, write_p_exp - w_exp);
+
+	write_p_exp = w_exp;
+	riscv_pop_helper(&write_p_exp, x10);
+	TEST_ASSERT_EQUAL_PTR(cont + (write_p_exp - w_exp), write_p);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, cont, write_p_exp - w_exp);
+
+	free(thread_data);
+	free(buf);
+}
+#endif
+
+#ifdef DBM_RAS
+void test_riscv_ras_push()
+{
+	uint16_t w[96] __attribute__((aligned(8))) = {0};
+	uint16_t *write_p = w;
+
+	dbm_thread *thread_data = alloc_thread_data();
+
+	riscv_ras_push(thread_data, 17, &write_p, 0x5556, x5, x6);
+
+	// The record follows the C.J, 8 byte aligned
+	ras_record *record = (ras_record *)&w[4];
+	TEST_ASSERT_EQUAL_PTR(record, thread_data->code_cache_meta[17].ras_call);
+	TEST_ASSERT_EQUAL_HEX64(0x5556, record->spc);
+	TEST_ASSERT_EQUAL_HEX64(0, record->tpc);
+	TEST_ASSERT_NULL(record->prev);
+	TEST_ASSERT_EQUAL_PTR(&w[40], write_p);
+
+	uint16_t w_exp[40] __attribute__((aligned(8))) = {0};
+	uint16_t *write_p_exp = w_exp;
+	int ras_offset = offsetof(dbm_thread, ras) - offsetof(dbm_thread, ras_top);
+
+	riscv_branch_imm_helper(&write_p_exp, (uint64_t)&w_exp[16], false);
+	w_exp[1] = w_exp[2] = w_exp[3] = C_NOP_INSTRUCTION;
+	memcpy(&w_exp[4], record, sizeof(ras_record));
+	write_p_exp = &w_exp[16];
+
+	riscv_copy_to_reg_64bits(&write_p_exp, x5, (uint64_t)&thread_data->ras_top);
+	riscv_ld(&write_p_exp, x6, x5, 0);
+	write_p_exp += 2;
+	riscv_addi(&write_p_exp, x6, x6, 8);
+	write_p_exp += 2;
+	riscv_sd(&write_p_exp, x6, x5, 0, 0);
+	write_p_exp += 2;
+	riscv_andi(&write_p_exp, x6, x6, RAS_MASK);
+	write_p_exp += 2;
+	riscv_c_add(&write_p_exp, x5, x6);
+	write_p_exp++;
+	riscv_auipc(&write_p_exp, x6, 0);
+	write_p_exp += 2;
+	riscv_addi(&write_p_exp, x6, x6, ((uintptr_t)&w_exp[4] - (uintptr_t)&w_exp[34]) & 0xFFF);
+	write_p_exp += 2;
+	riscv_sd(&write_p_exp, x6, x5, (ras_offset >> 5) & 0x7F, ras_offset & 0x1F);
+	write_p_exp += 2;
+	TEST_ASSERT_EQUAL_PTR(&w_exp[40], write_p_exp);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, 40);
+
+	// Inlined calls of the same fragment are chained
+	riscv_ras_push(thread_data, 17, &write_p, 0x6666, x5, x6);
+	TEST_ASSERT_EQUAL_PTR(&w[40 + 4], thread_data->code_cache_meta[17].ras_call);
+	TEST_ASSERT_EQUAL_PTR(record, thread_data->code_cache_meta[17].ras_call->prev);
+
+	free(thread_data);
+}
+
+void test_riscv_ras_pop()
+{
+	uint16_t w[32] = {0};
+	uint16_t *write_p = w;
+
+	dbm_thread *thread_data = alloc_thread_data();
+
+	riscv_ras_pop(thread_data, &write_p, ra);
+
+	// [Size: 62 B]
+	TEST_ASSERT_EQUAL_PTR(&w[31], write_p);
+	TEST_ASSERT_EQUAL(0, w[31]);
+
+	uint16_t w_exp[31] = {0};
+	uint16_t *write_p_exp = w_exp;
+	int ras_offset = offsetof(dbm_thread, ras) - offsetof(dbm_thread, ras_top);
+
+	riscv_copy_to_reg_64bits(&write_p_exp, x10, (uint64_t)&thread_data->ras_top);
+	riscv_ld(&write_p_exp, x11, x10, 0);
+	write_p_exp += 2;
+	riscv_andi(&write_p_exp, x12, x11, RAS_MASK);
+	write_p_exp += 2;
+	riscv_addi(&write_p_exp, x11, x11, -8 & 0xFFF);
+	write_p_exp += 2;
+	riscv_sd(&write_p_exp, x11, x10, 0, 0);
+	write_p_exp += 2;
+	riscv_c_add(&write_p_exp, x10, x12);
+	write_p_exp++;
+	riscv_ld(&write_p_exp, x10, x10, ras_offset);
+	write_p_exp += 2;
+	riscv_ld(&write_p_exp, x11, x10, 0);
+	write_p_exp += 2;
+	{
+		// BNE x11, ra, miss
+		mambo_cond cond = {x11, ra, NE};
+		riscv_b_cond_helper(&write_p_exp, (uint64_t)&w_exp[31], &cond);
+	}
+	riscv_ld(&write_p_exp, x10, x10, 8);
+	write_p_exp += 2;
+	riscv_bez_helper(&write_p_exp, x10, (uint64_t)&w_exp[31]);
+	riscv_pop_helper(&write_p_exp, x12);
+	riscv_c_jr(&write_p_exp, x10);
+	write_p_exp++;
+	TEST_ASSERT_EQUAL_PTR(&w_exp[31], write_p_exp);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, 31);
+
+	free(thread_data);
+}
+#endif
+
+#ifdef DBM_IBTC
+void test_riscv_ibtc_lookup()
+{
+	uint16_t w[64] __attribute__((aligned(8))) = {0};
+	uint16_t *write_p = w;
+
+	dbm_thread *thread_data = alloc_thread_data();
+
+	uint16_t *not_found = riscv_ibtc_lookup(thread_data, 17, &write_p, x11, x13);
+
+	// The ways follow the C.J, 8 byte aligned, all free
+	ibtc_entry *ibtc = (ibtc_entry *)&w[4];
+	TEST_ASSERT_EQUAL_PTR(ibtc, thread_data->code_cache_meta[17].ibtc);
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		TEST_ASSERT_EQUAL_HEX64(0, ibtc[i].spc);
+		TEST_ASSERT_EQUAL_HEX64(0, ibtc[i].tpc);
+	}
+	int lookup = 4 + IBTC_WAYS * sizeof(ibtc_entry) / 2;
+
+	uint16_t w_exp[64] __attribute__((aligned(8))) = {0};
+	uint16_t *write_p_exp = w_exp;
+
+	riscv_branch_imm_helper(&write_p_exp, (uint64_t)&w_exp[lookup], false);
+	w_exp[1] = w_exp[2] = w_exp[3] = C_NOP_INSTRUCTION;
+	write_p_exp = &w_exp[lookup];
+
+	riscv_auipc(&write_p_exp, x10, 0);
+	write_p_exp += 2;
+	riscv_addi(&write_p_exp, x10, x10, ((uintptr_t)&w_exp[4] - (uintptr_t)&w_exp[lookup])
+		& 0xFFF);
+	write_p_exp += 2;
+	for (int i = 0; i < IBTC_WAYS; i++) {
+		uint16_t *branch_to_next;
+		riscv_ld(&write_p_exp, x13, x10, 16 * i);
+		write_p_exp += 2;
+		branch_to_next = write_p_exp;
+		write_p_exp += 2;
+		riscv_ld(&write_p_exp, x10, x10, 16 * i + 8);
+		write_p_exp += 2;
+		riscv_pop_helper(&write_p_exp, x12);
+		riscv_c_jr(&write_p_exp, x10);
+		write_p_exp++;
+		{
+			// BNE x13, x11, next
+			mambo_cond cond = {x13, x11, NE};
+			riscv_b_cond_helper(&branch_to_next, (uint64_t)write_p_exp, &cond);
+		}
+	}
+
+	// The caller inserts the branch to the hash lookup while a way is free
+	TEST_ASSERT_EQUAL_PTR(w + (write_p_exp - w_exp), not_found);
+	TEST_ASSERT_EQUAL_PTR(not_found + 1, write_p);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, write_p_exp - w_exp);
+
+	free(thread_data);
+}
+#endif
+
+#ifdef DBM_JUMP_TABLES
+void test_riscv_jump_table_lookup()
+{
+	uint16_t w[64] = {0};
+	uint16_t *write_p = w;
+
+	// Relative table of 4 byte entries, as emitted for a switch
+	int32_t table[4] = {0x100, 0x140, 0x180, 0x1C0};
+	riscv_jump_table jt = {
+		.rt = x14,
+		.base = (uintptr_t)table,
+		.entries = 4,
+		.entry_size = 4,
+		.relative = true,
+		.jr_address = (uint16_t *)0x5550
+	};
+
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->jump_tables = calloc(JT_POOL_NO, sizeof(thread_data->jump_tables[0]));
+
+	riscv_jump_table_lookup(thread_data, 17, &write_p, &jt);
+
+	jump_table_entry *entries = thread_data->jump_tables[0];
+	TEST_ASSERT_NULL(jt.jr_address);
+	TEST_ASSERT_EQUAL_PTR(entries, thread_data->code_cache_meta[17].jump_table);
+	TEST_ASSERT_EQUAL(4, thread_data->code_cache_meta[17].jump_table_size);
+	TEST_ASSERT_EQUAL(4, thread_data->jump_table_free[0]);
+	for (int i = 0; i < 4; i++) {
+		TEST_ASSERT_EQUAL_HEX64((uintptr_t)table + table[i], entries[i].spc);
+		TEST_ASSERT_EQUAL_HEX64(0, entries[i].tpc);
+	}
+
+	uint16_t w_exp[64] = {0};
+	uint16_t *write_p_exp = w_exp;
+	uint16_t *branch_out_of_range, *branch_mismatch, *branch_unset;
+
+	riscv_save_regs(&write_p_exp, (m_x11 | m_x12));
+	riscv_ld(&write_p_exp, x12, sp, 16);
+	write_p_exp += 2;
+	riscv_sd(&write_p_exp, x10, sp, 0, 16);
+	write_p_exp += 2;
+	riscv_copy_to_reg_64bits(&write_p_exp, x11, (uintptr_t)table);
+	riscv_sub(&write_p_exp, x12, x12, x11);
+	write_p_exp += 2;
+	riscv_copy_to_reg_32bits(&write_p_exp, x11, 16);
+	branch_out_of_range = write_p_exp;
+	write_p_exp += 2;
+	riscv_slli(&write_p_exp, x12, x12, 2);
+	write_p_exp += 2;
+	riscv_andi(&write_p_exp, x12, x12, -16 & 0xFFF);
+	write_p_exp += 2;
+	riscv_copy_to_reg_64bits(&write_p_exp, x11, (uintptr_t)entries);
+	riscv_c_add(&write_p_exp, x12, x11);
+	write_p_exp++;
+	riscv_ld(&write_p_exp, x11, x12, 0);
+	write_p_exp += 2;
+	branch_mismatch = write_p_exp;
+	write_p_exp += 2;
+	riscv_ld(&write_p_exp, x10, x12, 8);
+	write_p_exp += 2;
+	branch_unset = write_p_exp++;
+	riscv_pop_helper(&write_p_exp, x12);
+	riscv_c_jr(&write_p_exp, x10);
+	write_p_exp++;
+	{
+		mambo_cond cond = {x12, x11, GEU};
+		riscv_b_cond_helper(&branch_out_of_range, (uint64_t)write_p_exp, &cond);
+	}
+	{
+		mambo_cond cond = {x11, x14, NE};
+		riscv_b_cond_helper(&branch_mismatch, (uint64_t)write_p_exp, &cond);
+	}
+	riscv_bez_helper(&branch_unset, x10, (uint64_t)write_p_exp);
+	riscv_restore_regs(&write_p_exp, (m_x10 | m_x11 | m_x12));
+
+	TEST_ASSERT_EQUAL_PTR(w + (write_p_exp - w_exp), write_p);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, write_p_exp - w_exp);
+
+	// The pool is full, only the entry address pushed before the load is dropped
+	thread_data->jump_table_free[0] = JT_POOL_SIZE - 2;
+	jt.jr_address = (uint16_t *)0x5550;
+	write_p = w;
+	riscv_jump_table_lookup(thread_data, 18, &write_p, &jt);
+	TEST_ASSERT_NULL(jt.jr_address);
+	TEST_ASSERT_NULL(thread_data->code_cache_meta[18].jump_table);
+	TEST_ASSERT_EQUAL(JT_POOL_SIZE - 2, thread_data->jump_table_free[0]);
+	TEST_ASSERT_EQUAL_PTR(&w[1], write_p);
+	TEST_ASSERT_EQUAL_HEX16(0x0121, w[0]); // C.ADDI sp, 8
 
+	free(thread_data->jump_tables);
 	free(thread_data);
 }
+#endif
+
+#ifdef DBM_LINK_PLT
+void test_riscv_plt_exit()
+{
+	uint16_t w[512] = {0};
+	uint16_t *write_p = w;
+	uint16_t *read_address = (uint16_t *)0x5550;
+
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->dispatcher_addr = (uint64_t)w + 5000;
+	thread_data->exit_trampoline_addr = (uint64_t)w + 6000;
+
+	riscv_plt_exit(thread_data, 17, &write_p, read_address, x15, ra, 0x7770);
+
+	// The exit is a linkable direct branch to the target found in the GOT
+	dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[17];
+	TEST_ASSERT_EQUAL(uncond_imm_riscv, bb_meta->exit_branch_type);
+	TEST_ASSERT_EQUAL_HEX64(0x7770, bb_meta->branch_taken_addr);
+	TEST_ASSERT_EQUAL_HEX32(NOP_INSTRUCTION, *(uint32_t *)bb_meta->exit_branch_addr);
+
+	uint16_t w_exp[64] = {0};
+	uint16_t *write_p_exp = w_exp;
+	uint16_t *branch_to_miss;
+
+	thread_data->dispatcher_addr = (uint64_t)w_exp + 5000;
+	thread_data->exit_trampoline_addr = (uint64_t)w_exp + 6000;
+
+	// ra is written by the jump, it's compared without saving a register
+	riscv_copy_to_reg_64bits(&write_p_exp, ra, 0x7770);
+	branch_to_miss = write_p_exp;
+	write_p_exp += 2;
+	riscv_copy_to_reg_64bits(&write_p_exp, ra, 0x5554);
+	TEST_ASSERT_EQUAL_PTR(w + (write_p_exp - w_exp), bb_meta->exit_branch_addr);
+	*(uint32_t *)write_p_exp = NOP_INSTRUCTION;
+	write_p_exp += 2;
+	riscv_save_regs(&write_p_exp, (m_x10 | m_x11 | m_x12));
+	riscv_branch_jump(thread_data, &write_p_exp, 17, 0x7770,
+		(REPLACE_TARGET | INSERT_BRANCH));
+	{
+		// BNE ra, x15, miss
+		mambo_cond cond = {ra, x15, NE};
+		riscv_b_cond_helper(&branch_to_miss, (uint64_t)write_p_exp, &cond);
+	}
+	// The lookup sets ra
+	riscv_save_regs(&write_p_exp, (m_x10 | m_x11));
+	riscv_copy_to_reg_64bits(&write_p_exp, ra, 0x5554);
+
+	// Followed by the hash lookup of other targets, which isn't linked
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, w, write_p_exp - w_exp);
+
+	free(thread_data);
+}
+#endif
+
+void test_riscv_encode_stub_bb()
+{
+	uint16_t *buf = calloc(1, 2 * sizeof(dbm_block));
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->code_cache = (dbm_code_cache *)buf;
+	thread_data->dispatcher_addr = (uint64_t)buf + 5000;
+#ifdef DBM_COMPACT_EXITS
+	thread_data->exit_trampoline_addr = (uint64_t)buf + 6000;
+#endif
+#ifdef DBM_VAR_SIZE_BB
+	uint32_t bb_offset[1] = {0};
+	thread_data->bb_offset = bb_offset;
+#endif
+
+	riscv_encode_stub_bb(thread_data, 0, 0x5550);
+
+	// Invalidations of the target don't concern the stub
+	dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[0];
+	TEST_ASSERT_EQUAL_PTR((uint16_t *)0x5550, bb_meta->source_addr);
+	TEST_ASSERT_EQUAL_PTR(bb_meta->source_start, bb_meta->source_end);
+	TEST_ASSERT_EQUAL_HEX64((uintptr_t)buf, bb_meta->tpc);
+	TEST_ASSERT_EQUAL_PTR(buf, bb_meta->exit_branch_addr);
+
+	uint16_t w_exp[STUB_BB_SIZE / 2] = {0};
+	uint16_t *write_p_exp = w_exp;
+
+	thread_data->dispatcher_addr = (uint64_t)w_exp + 5000;
+#ifdef DBM_COMPACT_EXITS
+	thread_data->exit_trampoline_addr = (uint64_t)w_exp + 6000;
+#endif
+
+	riscv_restore_regs(&write_p_exp, (m_x10 | m_x11));
+	riscv_save_regs(&write_p_exp, (m_x10 | m_x11 | m_x12));
+	riscv_branch_jump(thread_data, &write_p_exp, 0, 0x5550,
+		(REPLACE_TARGET | INSERT_BRANCH));
+	TEST_ASSERT_LESS_OR_EQUAL(STUB_BB_SIZE / 2, write_p_exp - w_exp);
+	TEST_ASSERT_EQUAL_HEX16_ARRAY(w_exp, buf, write_p_exp - w_exp);
+
+	free(thread_data);
+	free(buf);
+}
+
+#ifdef DBM_DECODE_CACHE
+void test_riscv_decode_cached()
+{
+	uint16_t r[4] = {
+		0x8113, 0x011f,		// ADDI		x2, x31, 17
+		0x4505,				// C.LI		a0, 1
+		0x8082				// C.JR		ra
+	};
+
+	decode_table table = {(uintptr_t)r, (uintptr_t)&r[4], calloc(4, sizeof(decode_cache_entry))};
+	dbm_thread *thread_data = alloc_thread_data();
+	thread_data->decode_table = &table;
+
+	TEST_ASSERT_EQUAL(RISCV_ADDI, riscv_decode_cached(thread_data, &r[0]));
+	TEST_ASSERT_EQUAL(RISCV_C_LI, riscv_decode_cached(thread_data, &r[2]));
+	TEST_ASSERT_EQUAL(RISCV_ADDI, riscv_decode_cached(thread_data, &r[0]));
+	TEST_ASSERT_EQUAL_HEX32(0x011f8113, table.entries[0].word);
+
+	// The table belongs to the mapping, the other threads find the entries
+	dbm_thread *other_thread = alloc_thread_data();
+	other_thread->decode_table = &table;
+	decode_cache_entry decoded;
+	TEST_ASSERT_TRUE(riscv_decode_cache_lookup(other_thread, &r[0],
+		riscv_inst_word(&r[0]), &decoded));
+	TEST_ASSERT_EQUAL(RISCV_ADDI, decoded.inst);
+	TEST_ASSERT_EQUAL(4, decoded.len);
+	TEST_ASSERT_TRUE(riscv_decode_cache_lookup(other_thread, &r[2],
+		riscv_inst_word(&r[2]), &decoded));
+	TEST_ASSERT_EQUAL(2, decoded.len);
+
+	// Entries are matched by encoding, modified code is decoded again
+	r[2] = 0x8082;
+	TEST_ASSERT_FALSE(riscv_decode_cache_lookup(thread_data, &r[2],
+		riscv_inst_word(&r[2]), &decoded));
+	TEST_ASSERT_EQUAL(RISCV_C_JR, riscv_decode_cached(thread_data, &r[2]));
+	TEST_ASSERT_EQUAL(RISCV_C_JR, table.entries[2].inst);
+
+	free(table.entries);
+	free(other_thread);
+	free(thread_data);
+}
+#endif
 
 void test_scan_riscv()
 {
@@ -1056,13 +1644,37 @@ int main(void)
 	RUN_TEST(test_riscv_save_regs);
 	RUN_TEST(test_riscv_restore_regs);
 	RUN_TEST(test_riscv_branch_jump);
+#ifdef DBM_COMPACT_EXITS
+	RUN_TEST(test_riscv_branch_jump_compact);
+#endif
 	RUN_TEST(test_riscv_get_inst_length);
 	RUN_TEST(test_riscv_branch_jump_cond);
 	RUN_TEST(test_riscv_check_free_space);
+#ifdef DBM_VAR_SIZE_BB
+	RUN_TEST(test_riscv_check_free_space_far);
+#endif
 	RUN_TEST(test_pass1_riscv);
+	RUN_TEST(test_riscv_dead_regs);
 	RUN_TEST(test_riscv_get_mambo_cond);
 	RUN_TEST(test_riscv_scanner_deliver_callbacks);
 	RUN_TEST(test_riscv_inline_hash_lookup);
+#ifdef DBM_RAS
+	RUN_TEST(test_riscv_ras_push);
+	RUN_TEST(test_riscv_ras_pop);
+#endif
+#ifdef DBM_IBTC
+	RUN_TEST(test_riscv_ibtc_lookup);
+#endif
+#ifdef DBM_JUMP_TABLES
+	RUN_TEST(test_riscv_jump_table_lookup);
+#endif
+#ifdef DBM_LINK_PLT
+	RUN_TEST(test_riscv_plt_exit);
+#endif
+	RUN_TEST(test_riscv_encode_stub_bb);
+#ifdef DBM_DECODE_CACHE
+	RUN_TEST(test_riscv_decode_cached);
+#endif
 	RUN_TEST(test_scan_riscv);
 	return UNITY_END();
 }
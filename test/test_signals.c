@@ -317,6 +317,7 @@ void test_unlink_fragment()
 	if (!allocate_thread_data(&thread_data)) {
 		TEST_FAIL_MESSAGE("Failed to allocate initial thread data");
 	}
+	thread_data->code_cache_meta = calloc(1, sizeof(dbm_code_cache_meta));
 	current_thread = thread_data;
 
 	uint16_t w[6] = {0x0067, 0x0000};
@@ -497,6 +498,7 @@ void test_restore_exit()
 	if (!allocate_thread_data(&thread_data)) {
 		TEST_FAIL_MESSAGE("Failed to allocate initial thread data");
 	}
+	thread_data->code_cache_meta = calloc(1, sizeof(dbm_code_cache_meta));
 
 	uint16_t w[6];
 	void *write_p = w;
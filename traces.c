@@ -42,6 +42,12 @@
 #define NOP_INSTRUCTION      0xD503201F
 #define THIRTY_TWO_KB        32 * 1024
 #define ONE_MEGABYTE         1024 * 1024
+#elif DBM_ARCH_RISCV64
+#include "pie/pie-riscv-encoder.h"
+#include "arch/riscv/dispatcher_riscv.h"
+#define NOP_INSTRUCTION      0x00010001 // 2x C.NOP
+// No fragment is added past it, the exits branch to their stubs with B(cond) (+-4 KiB)
+#define TRACE_BODY_LIMIT     (2 * 1024)
 #endif
 
 #ifdef DEBUG
@@ -64,7 +70,7 @@ uintptr_t active_trace_lookup(dbm_thread *thread_data, uintptr_t target) {
   if (target == spc) {
     return adjust_cc_entry(thread_data->active_trace.entry_addr);
   }
-  uintptr_t return_tpc = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t return_tpc = hash_lookup(thread_data->entry_address, target);
   if (return_tpc >= (uintptr_t)thread_data->code_cache->traces)
     return adjust_cc_entry(return_tpc);
   return UINT_MAX;
@@ -89,6 +95,12 @@ uintptr_t active_trace_lookup_or_stub(dbm_thread *thread_data, uintptr_t target)
 int allocate_trace_fragment(dbm_thread *thread_data) {
   int id = thread_data->active_trace.id++;
   assert(id < (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO));
+  if (id >= thread_data->trace_meta_committed) {
+    cc_meta_commit(thread_data, id);
+  }
+#ifdef DBM_ARCH_RISCV64
+  thread_data->code_cache_meta[id].source_ranges = NULL;
+#endif
   return id;
 }
 
@@ -106,6 +118,16 @@ uint32_t scan_trace(dbm_thread *thread_data, void *address, cc_type type, int *s
   thread_data->code_cache_meta[trace_id].source_addr = address;
   thread_data->code_cache_meta[trace_id].tpc = (uintptr_t)write_p;
   thread_data->code_cache_meta[trace_id].branch_cache_status = 0;
+#ifdef DBM_RAS
+  thread_data->code_cache_meta[trace_id].ras_call = NULL;
+#endif
+#ifdef DBM_IBTC
+  thread_data->code_cache_meta[trace_id].ibtc = NULL;
+#endif
+#ifdef DBM_JUMP_TABLES
+  thread_data->code_cache_meta[trace_id].jump_table = NULL;
+  thread_data->code_cache_meta[trace_id].jump_table_size = 0;
+#endif
 
 #ifdef __arm__
   if (thumb) {
@@ -117,17 +139,30 @@ uint32_t scan_trace(dbm_thread *thread_data, void *address, cc_type type, int *s
 #ifdef __aarch64__
   fragment_len = scan_a64(thread_data, (uint32_t *)address, trace_id, type, (uint32_t*)write_p);
 #endif
+#ifdef DBM_ARCH_RISCV64
+  fragment_len = scan_riscv(thread_data, (uint16_t *)address, trace_id, type, (uint16_t*)write_p);
+#endif
 
 #ifdef __arm__
   inst_set inst_type = thumb ? THUMB_INST : ARM_INST;
 #elif __aarch64__
   inst_set inst_type = A64_INST;
+#elif DBM_ARCH_RISCV64
+  inst_set inst_type = RISCV64_INST;
 #endif
   bool stop = true;
+  mambo_cond cond;
+#ifdef DBM_ARCH_RISCV64
+  cond.cond = AL;
+  cond.r1 = x0;
+  cond.r2 = x0;
+#else
+  cond = -1;
+#endif
   mambo_deliver_callbacks_code(POST_BB_C, thread_data, type, trace_id, inst_type,
-                               -1, -1, address, write_p, NULL, &stop);
+                               -1, cond, address, write_p, NULL, &stop);
   mambo_deliver_callbacks_code(POST_FRAGMENT_C, thread_data, type, trace_id, inst_type,
-                               -1, -1, address, write_p, NULL, &stop);
+                               -1, cond, address, write_p, NULL, &stop);
   assert(stop == true);
 
   __clear_cache(write_p, write_p + fragment_len);
@@ -249,6 +284,19 @@ void patch_trace_branches(dbm_thread *thread_data, uint32_t *orig_branch, uintpt
 }
 #endif
 
+#ifdef DBM_ARCH_RISCV64
+/* Jumps from a trace to a fragment or trace entry, after its pops if it's in
+   JAL range. Otherwise x10 and x11 are pushed again for the pops. */
+static void riscv_trace_jump(uint16_t **write_p, uintptr_t tpc) {
+  if (riscv_branch_imm_helper(write_p, tpc + 8, false) == 0) {
+    return;
+  }
+  riscv_save_regs(write_p, (m_x10 | m_x11));
+  int ret = riscv_large_jump_helper(write_p, tpc, false, x10);
+  assert(ret == 0);
+}
+#endif
+
 void install_trace(dbm_thread *thread_data) {
   ll_entry *cc_link;
   uintptr_t orig_branch;
@@ -278,12 +326,14 @@ void install_trace(dbm_thread *thread_data) {
     } else {
       a64_b_helper((uint32_t *)orig_branch, tpc + 4);
     }
+#elif DBM_ARCH_RISCV64
+    riscv_link_to_trace(thread_data, orig_branch, tpc);
 #endif
     cc_link = cc_link->next;
     __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
   }
 
-  hash_add(&thread_data->entry_address, spc, tpc);
+  hash_add(thread_data->entry_address, spc, tpc);
 
 #ifdef __arm__
   thread_data->trace_id = thread_data->active_trace.id;
@@ -402,6 +452,55 @@ void install_trace(dbm_thread *thread_data) {
   uint32_t *write_p = (uint32_t*)(thread_data->code_cache_meta[bb_source].tpc + 4);
   a64_BRK(&write_p, 0); // BRK trap
   __clear_cache(write_p, write_p + 1);
+#elif DBM_ARCH_RISCV64
+  /*
+   *          Trace
+   *    +----------------+
+   *    | inst           |
+   *    | B(cond) 1      |
+   *    | inst           |
+   *    | B(cond) 2      |
+   *    | inst           |
+   *    | exit           |
+   *    +----------------+ Exit 1
+   *  1:| J to+8         | <- JAL range
+   *    +----------------+ Exit 2
+   *  2:| PUSH x10, x11  | <- out of JAL range, to pops x10 and x11
+   *    | AUIPC x10      |
+   *    | JALR x0, x10   |
+   *    +----------------+
+   */
+  uint16_t *exit_stub_addr = thread_data->active_trace.write_p;
+  for (int i = 0; i < thread_data->active_trace.free_exit_rec; i++) {
+    uint16_t *from = (uint16_t *)thread_data->active_trace.exits[i].from;
+    uintptr_t const to = thread_data->active_trace.exits[i].to;
+
+    // Give the exit a number and set metadata
+    int const exit_id = allocate_trace_fragment(thread_data);
+    thread_data->code_cache_meta[exit_id].tpc = (uintptr_t)exit_stub_addr;
+    thread_data->code_cache_meta[exit_id].exit_branch_type = trace_exit;
+    thread_data->code_cache_meta[exit_id].exit_branch_addr = exit_stub_addr;
+    thread_data->code_cache_meta[exit_id].branch_cache_status = BRANCH_LINKED;
+    thread_data->code_cache_meta[exit_id].branch_taken_addr = to; // Code Cache target
+
+    int ret = riscv_b_cond_helper(&from, (uint64_t)exit_stub_addr,
+                                  &thread_data->active_trace.exits[i].cond);
+    assert(ret > 0);
+    __clear_cache((void *)thread_data->active_trace.exits[i].from, (void *)from);
+
+    uint16_t *exit_start = exit_stub_addr;
+    riscv_trace_jump(&exit_stub_addr, to);
+    __clear_cache((void *)exit_start, (void *)exit_stub_addr);
+  }
+  thread_data->trace_id = thread_data->active_trace.id;
+  thread_data->active_trace.write_p = exit_stub_addr;
+  thread_data->trace_cache_next = (uint8_t *)exit_stub_addr;
+
+  // Send everything still entering the source basic block to the trace
+  uint16_t *write_p = (uint16_t *)thread_data->code_cache_meta[bb_source].tpc;
+  int ret = riscv_large_jump_helper(&write_p, tpc, false, x10); // replaces the pops
+  assert(ret == 0);
+  __clear_cache((void *)thread_data->code_cache_meta[bb_source].tpc, write_p);
 #endif
 }
 
@@ -411,6 +510,9 @@ int trace_record_exit(dbm_thread *thread_data, uintptr_t from, uintptr_t to) {
 #ifdef __aarch64__
 int trace_record_exit(dbm_thread *thread_data, uintptr_t from, uintptr_t to, int fragment_id) {
 #endif // __arch64__
+#ifdef DBM_ARCH_RISCV64
+int trace_record_exit(dbm_thread *thread_data, uintptr_t from, uintptr_t to, mambo_cond *cond) {
+#endif
   int record = thread_data->active_trace.free_exit_rec++;
   if (record >= MAX_TRACE_REC_EXITS) {
     return -1;
@@ -421,6 +523,9 @@ int trace_record_exit(dbm_thread *thread_data, uintptr_t from, uintptr_t to, int
 #ifdef __aarch64__
   thread_data->active_trace.exits[record].fragment_id = fragment_id;
 #endif
+#ifdef DBM_ARCH_RISCV64
+  thread_data->active_trace.exits[record].cond = *cond;
+#endif
 
   return 0;
 }
@@ -471,6 +576,28 @@ void set_up_trace_exit(dbm_thread *thread_data, uint32_t **o_write_p, int fragme
   *o_write_p = write_p;
 }
 #endif
+
+#ifdef DBM_ARCH_RISCV64
+void set_up_trace_exit(dbm_thread *thread_data, uint16_t **o_write_p, int fragment_id, bool is_taken) {
+  dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
+  uint16_t *write_p = *o_write_p;
+  mambo_cond cond = bb_meta->branch_condition;
+  if (is_taken) {
+    cond.cond = invert_cond(cond.cond);
+  }
+
+  // B(cond) to the exit stub, inserted by install_trace()
+  *(uint32_t *)write_p = NOP_INSTRUCTION;
+
+  uintptr_t addr = is_taken ? bb_meta->branch_skipped_addr : bb_meta->branch_taken_addr;
+  uintptr_t tpc = active_trace_lookup_or_scan(thread_data, addr);
+  int ret = trace_record_exit(thread_data, (uintptr_t)write_p, tpc, &cond);
+  assert(ret == 0);
+  write_p += 2;
+
+  *o_write_p = write_p;
+}
+#endif
 #endif
 
 /* This is called from trace_head_incr, which is called by trace heads */
@@ -492,6 +619,10 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
   uint32_t  *bb_addr = (uint32_t *)&thread_data->code_cache->blocks[bb_source];
 #endif
 
+  // Called from the code cache by trace_head_incr, like dispatcher()
+  int ret = lock_code_cache();
+  assert(ret == 0);
+
   thread_data->trace_fragment_count = 0;
 #ifdef __arm__
   if (thread_data->code_cache_meta[bb_source].exit_branch_type == cbz_thumb ||
@@ -510,6 +641,10 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
       || thread_data->code_cache_meta[bb_source].exit_branch_type == tbz_a64
       || thread_data->code_cache_meta[bb_source].exit_branch_type == cond_imm_a64
       || thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_imm_a64) {
+#endif
+#ifdef DBM_ARCH_RISCV64
+  if (thread_data->code_cache_meta[bb_source].exit_branch_type == cond_imm_riscv
+      || thread_data->code_cache_meta[bb_source].exit_branch_type == uncond_imm_riscv) {
 #endif
     source_addr = thread_data->code_cache_meta[bb_source].source_addr;
     ret_addr->spc = (uintptr_t)source_addr;
@@ -521,11 +656,14 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
     thread_data->trace_cache_next += (TRACE_ALIGN -
                                      ((uintptr_t)thread_data->trace_cache_next & TRACE_ALIGN_MASK))
                                      & TRACE_ALIGN_MASK;
-    if ((uintptr_t)thread_data->trace_cache_next >= (uintptr_t)thread_data->code_cache + MAX_BRANCH_RANGE - TRACE_LIMIT_OFFSET
+    if ((uintptr_t)thread_data->trace_cache_next >= (uintptr_t)thread_data->code_cache->traces + TRACE_CACHE_SIZE - TRACE_LIMIT_OFFSET
         || thread_data->trace_id >= (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO - TRACE_FRAGMENT_OVERP)) {
       fprintf(stderr, "trace cache full, flushing the CC\n");
       flush_code_cache(thread_data);
       ret_addr->tpc = lookup_or_scan(thread_data, (uintptr_t)source_addr, NULL);
+      cc_sync_icache(thread_data);
+      ret = unlock_code_cache();
+      assert(ret == 0);
       return;
     }
 
@@ -575,8 +713,26 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
         fprintf(stderr, "Disallowed type of exit in the first trace fragment: %d\n",
                 thread_data->code_cache_meta[trace_id].exit_branch_type);
         while(1);
+#endif
+#ifdef DBM_ARCH_RISCV64
+      case cond_imm_riscv:
+      case uncond_imm_riscv:
+        break;
+      // a plugin may have changed the exit
+      case uncond_reg_riscv:
+        thread_data->active_trace.write_p += fragment_len;
+        install_trace(thread_data);
+        break;
+      default:
+        fprintf(stderr, "Disallowed type of exit in the first trace fragment: %d\n",
+                thread_data->code_cache_meta[trace_id].exit_branch_type);
+        while(1);
 #endif
     }
+    // trace_head_incr returns straight to the new trace
+    cc_sync_icache(thread_data);
+    ret = unlock_code_cache();
+    assert(ret == 0);
   } else {
     fprintf(stderr, "\nUnknown exit branch type in trace head: %d\n", thread_data->code_cache_meta[bb_source].exit_branch_type);
     while(1);
@@ -595,8 +751,15 @@ void early_trace_exit(dbm_thread *thread_data, dbm_code_cache_meta* bb_meta,
 #ifdef __aarch64__
   a64_cc_branch(thread_data, (uint32_t *)write_p, tpc + 4);
 #endif
+#ifdef DBM_ARCH_RISCV64
+  uint16_t *end = (uint16_t *)write_p;
+  riscv_trace_jump(&end, tpc);
+  __clear_cache(write_p, end);
+  write_p = end;
+#else
   __clear_cache(write_p, write_p+4);
   write_p += 4;
+#endif
   thread_data->active_trace.write_p = (uint8_t *)write_p;
   install_trace(thread_data);
 
@@ -613,6 +776,9 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
 #endif
 #ifdef __aarch64__
   uint32_t *write_p = (uint32_t *) bb_meta->exit_branch_addr;
+#endif
+#ifdef DBM_ARCH_RISCV64
+  uint16_t *write_p = bb_meta->exit_branch_addr;
 #endif
   size_t fragment_len;
   thread_data->was_flushed = false;
@@ -730,6 +896,21 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
       *next_addr = lookup_or_scan(thread_data, target, NULL);
       return;
       break;
+#endif
+#ifdef DBM_ARCH_RISCV64
+    case cond_imm_riscv:
+      set_up_trace_exit(thread_data, &write_p, source_index, is_taken);
+      bb_meta->branch_cache_status = is_taken ? BRANCH_LINKED : FALLTHROUGH_LINKED;
+      break;
+    case uncond_imm_riscv:
+      bb_meta->branch_cache_status = BRANCH_LINKED;
+      break;
+    case uncond_reg_riscv:
+      *next_addr = lookup_or_scan(thread_data, target, NULL);
+      // Fill the shadow return address stack and inline target cache records
+      dispatcher_riscv(thread_data, source_index, uncond_reg_riscv, target, *next_addr);
+      return;
+      break;
 #endif
     default:
       fprintf(stderr, "Trace dispatcher unknown %p\n", write_p);
@@ -746,7 +927,11 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
   }
 
   // Check if the fragment count has reached the max limit
-  if (thread_data->trace_fragment_count > MAX_TRACE_FRAGMENTS) {
+  if (thread_data->trace_fragment_count > MAX_TRACE_FRAGMENTS
+#ifdef DBM_ARCH_RISCV64
+      || (uintptr_t)write_p - thread_data->active_trace.entry_addr > TRACE_BODY_LIMIT
+#endif
+     ) {
     debug("Trace fragment count limit, branch to: 0x%x, written at: %p\n", target, write_p);
     addr = active_trace_lookup_or_scan(thread_data, target);
     early_trace_exit(thread_data, bb_meta, write_p, target, addr);
@@ -770,6 +955,9 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
 #endif
 #ifdef __aarch64__
   fragment_len = scan_trace(thread_data, (uint32_t *)target, mambo_trace, &fragment_id);
+#endif
+#ifdef DBM_ARCH_RISCV64
+  fragment_len = scan_trace(thread_data, (uint16_t *)target, mambo_trace, &fragment_id);
 #endif
   debug("len: %d\n\n", fragment_len);
 
@@ -786,6 +974,8 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
     case trace_inline_max:
 #elif __aarch64__
     case uncond_branch_reg:
+#elif DBM_ARCH_RISCV64
+    case uncond_reg_riscv:
 #endif
       install_trace(thread_data);
       break;
@@ -801,5 +991,15 @@ void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_in
 
   *next_addr = (uintptr_t)(write_p - 2);
 #endif
+#ifdef DBM_ARCH_RISCV64
+  // Insert a trampoline after the trace which pops x10, x11 and jumps to the new fragment
+  write_p = (uint16_t *)thread_data->active_trace.write_p;
+  uint16_t *trampoline = write_p;
+  riscv_restore_regs(&write_p, (m_x10 | m_x11));
+  riscv_branch_imm_helper(&write_p, *next_addr, false);
+  __clear_cache(trampoline, write_p);
+
+  *next_addr = (uintptr_t)trampoline;
+#endif
 #endif // DBM_TRACES
 }